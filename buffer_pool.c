@@ -0,0 +1,116 @@
+/*
+  buffer_pool.c -- reusable I/O buffers and request-scoped arenas.
+*/
+
+#include "buffer_pool.h"
+#include <stdlib.h>
+
+#define ARENA_ALIGN 16
+
+// header at the start of every block of an arena
+struct arena_block
+{
+    arena_block *next; // block carved before this one
+    size_t size;       // bytes of the block, header included
+    int pooled;        // the block is a buffer of the pool, otherwise it came from the heap
+};
+
+#define BLOCK_HEADER ((sizeof(arena_block) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+void buffer_pool_init(buffer_pool *pool, size_t size, size_t max_free)
+{
+    pool->size = size;
+    pool->max_free = max_free;
+    pool->nfree = 0;
+    pool->free = NULL;
+    pool->heap_allocs = 0;
+}
+
+void buffer_pool_destroy(buffer_pool *pool)
+{
+    while (pool->free != NULL)
+    {
+        void *buf = pool->free;
+        pool->free = *(void **)buf;
+        free(buf);
+    }
+    pool->nfree = 0;
+}
+
+void *buffer_get(buffer_pool *pool)
+{
+    if (pool->free != NULL)
+    {
+        void *buf = pool->free;
+        pool->free = *(void **)buf;
+        pool->nfree--;
+        return buf;
+    }
+    pool->heap_allocs++;
+    return malloc(pool->size);
+}
+
+void buffer_put(buffer_pool *pool, void *buf)
+{
+    if (buf == NULL)
+        return;
+    if (pool->nfree >= pool->max_free)
+    {
+        free(buf);
+        return;
+    }
+    *(void **)buf = pool->free;
+    pool->free = buf;
+    pool->nfree++;
+}
+
+void arena_init(arena *a, buffer_pool *pool)
+{
+    a->pool = pool;
+    a->head = NULL;
+    a->used = 0;
+}
+
+void *arena_alloc(arena *a, size_t size)
+{
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (a->head == NULL || a->used + size > a->head->size)
+    {
+        // a new block, from the pool unless the allocation does not fit into one of its buffers
+        int pooled = BLOCK_HEADER + size <= a->pool->size;
+        arena_block *block;
+        if (pooled)
+        {
+            block = (arena_block *)buffer_get(a->pool);
+        }
+        else
+        {
+            a->pool->heap_allocs++;
+            block = (arena_block *)malloc(BLOCK_HEADER + size);
+        }
+        if (block == NULL)
+            return NULL;
+        block->next = a->head;
+        block->size = pooled ? a->pool->size : BLOCK_HEADER + size;
+        block->pooled = pooled;
+        a->head = block;
+        a->used = BLOCK_HEADER;
+    }
+    void *p = (char *)a->head + a->used;
+    a->used += size;
+    return p;
+}
+
+void arena_reset(arena *a)
+{
+    while (a->head != NULL)
+    {
+        arena_block *block = a->head;
+        a->head = block->next;
+        if (block->pooled)
+            buffer_put(a->pool, block);
+        else
+            free(block);
+    }
+    a->used = 0;
+}
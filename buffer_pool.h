@@ -0,0 +1,63 @@
+/*
+ * buffer_pool.h -- reusable I/O buffers and request-scoped arenas.
+ *
+ * Every worker keeps the fixed-size buffers its connections give back and
+ * hands them out again, so the request path does not go through malloc() and
+ * free() once the pool has warmed up. A pool belongs to the thread running
+ * the worker's event loop and needs no locking.
+ *
+ * An arena hands out memory that lives as long as the current request, carved
+ * from buffers of the pool and given back all at once when the request ends.
+ *
+ * The pool counts the buffers it had to take from the heap, a pool that has
+ * warmed up does not take any more.
+ */
+
+#include <stddef.h>
+
+#ifndef BUFFER_POOL
+#define BUFFER_POOL
+
+typedef struct buffer_pool buffer_pool;
+typedef struct arena arena;
+typedef struct arena_block arena_block;
+
+struct buffer_pool
+{
+   size_t size;               // size of every buffer
+   size_t max_free;           // buffers kept at most, the others go back to the heap
+   size_t nfree;              // buffers in free
+   void *free;                // buffers given back, linked through their first word
+   unsigned long heap_allocs; // allocations that could not be served from the pool
+};
+
+/* Set up pool for buffers of size bytes, keeping at most max_free of them */
+void buffer_pool_init(buffer_pool *pool, size_t size, size_t max_free);
+
+/* Free the buffers kept by the pool, the ones handed out must be back */
+void buffer_pool_destroy(buffer_pool *pool);
+
+/* Take a buffer of pool->size bytes, NULL if the heap is exhausted */
+void *buffer_get(buffer_pool *pool);
+
+/* Give back a buffer taken with buffer_get(), NULL is ignored */
+void buffer_put(buffer_pool *pool, void *buf);
+
+struct arena
+{
+   buffer_pool *pool; // pool the blocks come from
+   arena_block *head; // block being carved, the others follow it
+   size_t used;       // bytes of head handed out
+};
+
+/* Prepare an empty arena drawing from pool */
+void arena_init(arena *a, buffer_pool *pool);
+
+/* Allocate size bytes, aligned for any type, that live until arena_reset().
+ * Returns NULL if the heap is exhausted. */
+void *arena_alloc(arena *a, size_t size);
+
+/* Free everything allocated from the arena at once */
+void arena_reset(arena *a);
+
+#endif
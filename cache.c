@@ -0,0 +1,1365 @@
+/*
+  cache.c -- in-memory cache of responses.
+*/
+
+#include "cache.h"
+#include "cache_policy.h"
+#include "slab.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define DEFAULT_NBUCKETS 1024
+#define MIN_CHUNK_SIZE 4096        // size of the first chunk of an element, header included
+#define MAX_CHUNK_SIZE SLAB_MAX_ITEM // chunks double in size up to this
+#define RECLAIM_TRIES 64           // elements evicted at most to make room for one allocation
+#define INFLIGHT_BUCKETS 256       // buckets of the table of elements being filled, per shard
+#define VARY_SLOTS 64              // urls whose Vary names are remembered, per shard
+#define BODY_BUCKETS 4096          // buckets of the table of shared bodies
+#define SNAPSHOT_MAGIC 0x38534350u // "PCS8"
+
+typedef struct cache_shard cache_shard;
+
+// names of the headers the responses of a url vary on
+struct vary_slot
+{
+    cache_key url;               // key of the url, the slot is empty if names is
+    char names[CACHE_VARY_MAX];
+};
+
+/*
+  The cache is split into a power-of-two number of shards, selected by one
+  half of the key. Each shard has its own lock, hash table, policy state and
+  a share of MAX_SIZE, so requests for keys in different shards never contend.
+  Elements that are still being fetched live in a separate, smaller table of
+  the same shard until the fetch ends.
+*/
+struct cache_shard
+{
+    pthread_mutex_t lock; // protects everything below
+
+    cache_element **buckets; // hash table, every bucket is a singly linked chain
+    size_t nbuckets;         // always a power of two
+    size_t nelements;
+
+    cache_policy_state *policy; // orders the elements for eviction
+    size_t cache_size;       // bytes accounted to the elements of this shard
+    size_t max_size;         // share of MAX_SIZE this shard may use
+
+    cache_element *inflight[INFLIGHT_BUCKETS]; // elements being filled, chained through hnext too
+    struct vary_slot vary[VARY_SLOTS];          // Vary names of the urls of this shard, direct mapped
+} __attribute__((aligned(64))); // one cache line per shard lock
+
+static cache_shard *shards;
+static size_t nshards; // always a power of two
+
+/*
+  A body shared by elements of any shard. The chunks of every element
+  sharing it end with its chunks, and the last element to go frees them.
+  Bodies are found by their digest in a table of their own, whose lock also
+  protects their reference counts. Their memory is accounted for apart from
+  the elements, every shard is charged an equal part of it.
+*/
+struct cache_body
+{
+    cache_key digest;   // of the bytes of the body
+    size_t len;
+    cache_chunk *chunks; // first chunk of the body
+    size_t mem_size;    // bytes of the slab items of the body and of its chunks
+    int refcount;       // elements whose chunks end with the body
+    cache_body *hnext;  // next body in the same bucket
+};
+
+static struct
+{
+    pthread_mutex_t lock; // protects the table and the reference counts of the bodies
+    cache_body *buckets[BODY_BUCKETS];
+    size_t mem_size;      // bytes of every body in the table, updated under the lock and read without it
+} bodies;
+
+/*
+  A snapshot file is a header, the key, data and entity tag of every
+  response one after the other, and an open addressing hash table locating
+  them, so a restarted proxy only maps the file and can look responses up in
+  it right away.
+*/
+struct snapshot_header
+{
+    uint32_t magic;        // SNAPSHOT_MAGIC
+    uint32_t count;        // responses in the file
+    uint64_t slots;        // slots of the table, a power of two
+    uint64_t table_offset; // offset of the table in the file
+};
+
+struct snapshot_slot
+{
+    uint64_t hash;        // lo half of the key, the slot is empty if key_len is 0
+    uint64_t key_offset;  // offset of the key in the file
+    uint64_t data_offset; // offset of the response
+    uint64_t data_len;
+    int64_t expires;      // time the response stops being fresh
+    int64_t stale_until;  // time it stops being served stale while it is revalidated
+    int64_t error_until;  // time it stops standing in for a failed fetch
+    int64_t received;     // time its Age counts from
+    int64_t last_modified; // Last-Modified of the response, -1 if it had none
+    uint32_t key_len;
+    uint32_t etag_len;    // bytes of the ETag following the data, 0 if it had none
+    uint32_t identity_head; // heads of a gzip copy, see cache_fill_encoded()
+    uint32_t encoded_head;
+    uint32_t body_offset;   // where the body starts, 0 if it is not shared
+};
+
+// the snapshot the proxy started from, responses are copied out of it the first time they are missed
+static struct
+{
+    const char *base;            // mapping of the file, NULL without a snapshot
+    size_t size;
+    const struct snapshot_slot *table;
+    uint64_t slots;
+    unsigned char *taken;        // per slot: the response was looked up and is the cache's business now
+} restored;
+
+// the shard is picked with the hi half of the key, the buckets inside a shard use the lo half
+static cache_shard *shard_for(const cache_key *key)
+{
+    return &shards[key->hi & (nshards - 1)];
+}
+
+/*
+  Hash table helpers, the caller holds the shard lock
+*/
+
+static cache_element *table_lookup(cache_shard *shard, const cache_key *key)
+{
+    cache_element *element = shard->buckets[key->lo & (shard->nbuckets - 1)];
+    while (element != NULL)
+    {
+        if (CACHE_KEY_EQ(element->key, *key))
+            return element;
+        element = element->hnext;
+    }
+    return NULL;
+}
+
+static void table_unlink(cache_shard *shard, cache_element *element)
+{
+    cache_element **link = &shard->buckets[element->key.lo & (shard->nbuckets - 1)];
+    while (*link != element)
+    {
+        link = &(*link)->hnext;
+    }
+    *link = element->hnext;
+    shard->nelements--;
+}
+
+// doubles the table once it holds more elements than buckets, keeping chains short
+static void table_grow(cache_shard *shard)
+{
+    size_t newlen = shard->nbuckets * 2;
+    cache_element **newbuckets = (cache_element **)calloc(newlen, sizeof(cache_element *));
+    if (newbuckets == NULL)
+        return; // longer chains are still correct
+
+    for (size_t i = 0; i < shard->nbuckets; i++)
+    {
+        cache_element *element = shard->buckets[i];
+        while (element != NULL)
+        {
+            cache_element *next = element->hnext;
+            element->hnext = newbuckets[element->key.lo & (newlen - 1)];
+            newbuckets[element->key.lo & (newlen - 1)] = element;
+            element = next;
+        }
+    }
+    free(shard->buckets);
+    shard->buckets = newbuckets;
+    shard->nbuckets = newlen;
+}
+
+static void table_insert(cache_shard *shard, cache_element *element)
+{
+    if (shard->nelements >= shard->nbuckets)
+        table_grow(shard);
+    element->hnext = shard->buckets[element->key.lo & (shard->nbuckets - 1)];
+    shard->buckets[element->key.lo & (shard->nbuckets - 1)] = element;
+    shard->nelements++;
+}
+
+/*
+  In-flight table helpers, the caller holds the shard lock
+*/
+
+static cache_element *inflight_lookup(cache_shard *shard, const cache_key *key)
+{
+    cache_element *element = shard->inflight[key->lo & (INFLIGHT_BUCKETS - 1)];
+    while (element != NULL)
+    {
+        if (CACHE_KEY_EQ(element->key, *key))
+            return element;
+        element = element->hnext;
+    }
+    return NULL;
+}
+
+static void inflight_insert(cache_shard *shard, cache_element *element)
+{
+    element->hnext = shard->inflight[element->key.lo & (INFLIGHT_BUCKETS - 1)];
+    shard->inflight[element->key.lo & (INFLIGHT_BUCKETS - 1)] = element;
+    element->inflight = 1;
+}
+
+// removes the element so no new reader attaches to it, does nothing if it was already removed
+static void inflight_unlink(cache_shard *shard, cache_element *element)
+{
+    if (!element->inflight)
+        return;
+    cache_element **link = &shard->inflight[element->key.lo & (INFLIGHT_BUCKETS - 1)];
+    while (*link != element)
+    {
+        link = &(*link)->hnext;
+    }
+    *link = element->hnext;
+    element->hnext = NULL;
+    element->inflight = 0;
+}
+
+/*
+  Waiter helpers, the caller holds the element lock
+*/
+
+// writes the eventfd of every waiter that sleeps, or of every waiter if all is set
+static void wake_waiters(cache_element *element, int all)
+{
+    uint64_t one = 1;
+    for (cache_waiter *waiter = element->waiters; waiter != NULL; waiter = waiter->next)
+    {
+        if (all || waiter->waiting)
+        {
+            waiter->waiting = 0;
+            if (write(waiter->fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            {
+                perror("Error in waking a reader");
+            }
+        }
+    }
+}
+
+// ends the fill with the given state and tells every reader
+static void finish_fill(cache_element *element, cache_state state)
+{
+    pthread_mutex_lock(&element->lock);
+    __atomic_store_n(&element->state, state, __ATOMIC_RELEASE);
+    wake_waiters(element, 1);
+    pthread_mutex_unlock(&element->lock);
+}
+
+static void free_chunks(cache_chunk *chunk, cache_chunk *end)
+{
+    while (chunk != end)
+    {
+        cache_chunk *next = chunk->next;
+        slab_free(chunk);
+        chunk = next;
+    }
+}
+
+// drops the reference of an element to a shared body, the last one frees it
+static void release_body(cache_body *body)
+{
+    pthread_mutex_lock(&bodies.lock);
+    int last = --body->refcount == 0;
+    if (last)
+    {
+        cache_body **link = &bodies.buckets[body->digest.lo & (BODY_BUCKETS - 1)];
+        while (*link != body)
+        {
+            link = &(*link)->hnext;
+        }
+        *link = body->hnext;
+        __atomic_sub_fetch(&bodies.mem_size, body->mem_size, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&bodies.lock);
+    if (last)
+    {
+        free_chunks(body->chunks, NULL);
+        slab_free(body);
+    }
+}
+
+void release_cache_element(cache_element *element)
+{
+    if (__atomic_sub_fetch(&element->refcount, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        free_chunks(element->chunks, element->body != NULL ? element->body->chunks : NULL); // the chunks of its own
+        if (element->body != NULL)
+            release_body(element->body);
+        pthread_mutex_destroy(&element->lock);
+        slab_free(element);
+    }
+}
+
+cache_state cache_element_state(cache_element *element)
+{
+    return (cache_state)__atomic_load_n(&element->state, __ATOMIC_ACQUIRE);
+}
+
+// the part of the memory of the shared bodies a shard is charged for
+static size_t bodies_share()
+{
+    return __atomic_load_n(&bodies.mem_size, __ATOMIC_RELAXED) / nshards;
+}
+
+// unlinks an element from the table and the policy and drops the reference of the cache, the caller holds the shard lock
+static void delete_element(cache_shard *shard, cache_element *element)
+{
+    table_unlink(shard, element);
+    cache_policy_remove(shard->policy, element);
+    shard->cache_size -= element->mem_size;
+    release_cache_element(element); // readers that pinned the element keep it alive
+}
+
+// removes the element the policy picks, the caller holds the shard lock, returns -1 if the shard is empty
+static int remove_cache_element(cache_shard *shard)
+{
+    cache_element *victim = cache_policy_victim(shard->policy);
+    if (victim == NULL)
+        return -1;
+    delete_element(shard, victim);
+    return 0;
+}
+
+/*
+    The reclaim function makes room in the memory of the cache by evicting the element the policy picks in the next shard that has
+    one, the shards taking turns. It returns -1 if every shard is empty. Memory still pinned by readers is freed once they are done.
+*/
+static int reclaim()
+{
+    static size_t next; // shared by every thread, a race only makes the turns less fair
+    for (size_t i = 0; i < nshards; i++)
+    {
+        cache_shard *shard = &shards[__atomic_fetch_add(&next, 1, __ATOMIC_RELAXED) & (nshards - 1)];
+        pthread_mutex_lock(&shard->lock);
+        int evicted = remove_cache_element(shard) == 0;
+        pthread_mutex_unlock(&shard->lock);
+        if (evicted)
+            return 0;
+    }
+    return -1;
+}
+
+// allocates an item of the cache memory, evicting elements while it is full, the caller holds no shard lock
+static void *cache_alloc(size_t size, size_t *item_size)
+{
+    for (int tries = 0;; tries++)
+    {
+        void *item = slab_alloc(size, item_size);
+        if (item != NULL || tries == RECLAIM_TRIES || reclaim() < 0)
+            return item;
+    }
+}
+
+int cache_init(int count, const char *policy_name)
+{
+    const cache_policy *policy = cache_policy_find(policy_name);
+    if (policy == NULL)
+        return -1;
+    pthread_mutex_init(&bodies.lock, NULL);
+    nshards = 1;
+    while ((int)nshards < count) // round up to a power of two
+    {
+        nshards *= 2;
+    }
+    while (nshards > 1 && (size_t)(MAX_SIZE) / nshards < (size_t)(MAX_ELEMENT_SIZE)) // every shard must have room for the largest element
+    {
+        nshards /= 2;
+    }
+
+    shards = (cache_shard *)aligned_alloc(64, nshards * sizeof(cache_shard));
+    for (size_t i = 0; i < nshards; i++)
+    {
+        cache_shard *shard = &shards[i];
+        pthread_mutex_init(&shard->lock, NULL); // initializing a mutex lock
+        shard->nbuckets = DEFAULT_NBUCKETS;
+        shard->buckets = (cache_element **)calloc(shard->nbuckets, sizeof(cache_element *));
+        shard->nelements = 0;
+        shard->cache_size = 0;
+        shard->max_size = (size_t)(MAX_SIZE) / nshards;
+        shard->policy = cache_policy_create(policy, shard->max_size);
+        if (shard->policy == NULL)
+            return -1;
+        memset(shard->inflight, 0, sizeof(shard->inflight));
+        memset(shard->vary, 0, sizeof(shard->vary));
+    }
+    if (slab_init((size_t)(MAX_SIZE)) < 0)
+    {
+        printf("Failed to reserve the memory of the cache, nothing will be cached\n");
+    }
+    return 0;
+}
+
+// creates an element to be filled for key, the only reference belongs to the filler
+static cache_element *create_element(const cache_key *key)
+{
+    size_t item_size;
+    cache_element *element = (cache_element *)cache_alloc(sizeof(cache_element), &item_size);
+    if (element == NULL)
+        return NULL;
+    memset(element, 0, sizeof(cache_element));
+    element->key = *key;
+    element->refcount = 1; // the reference of the filler
+    element->state = CACHE_FILLING;
+    element->mem_size = item_size;
+    element->last_modified = -1;
+    pthread_mutex_init(&element->lock, NULL);
+    return element;
+}
+
+// finds key among the cached elements that can be served and those being filled and pins it, the caller holds the shard lock
+static cache_element *find_element(cache_shard *shard, const cache_key *key, time_t now, int *status)
+{
+    cache_element *site = table_lookup(shard, key);
+    if (site != NULL && site->freshness.expires <= now && site->freshness.stale_until <= now) // too stale to serve, it is revalidated first
+    {
+        site = NULL;
+    }
+    if (site != NULL)
+    {
+        cache_policy_hit(shard->policy, site);
+        *status = site->freshness.expires > now ? CACHE_HIT : CACHE_STALE;
+    }
+    else if ((site = inflight_lookup(shard, key)) != NULL) // somebody is fetching it already
+    {
+        *status = CACHE_FOLLOW;
+    }
+    if (site != NULL)
+        __atomic_add_fetch(&site->refcount, 1, __ATOMIC_RELAXED); // pinned for the caller
+    return site;
+}
+
+/*
+    The stale_element function returns the stale response cached for key, pinned for a fill that revalidates it, or NULL if there is
+    none. A stale response that can neither be revalidated nor be served stale anymore is dropped instead, the fill fetches it in full.
+    The caller holds the shard lock.
+*/
+static cache_element *stale_element(cache_shard *shard, const cache_key *key, time_t now)
+{
+    cache_element *site = table_lookup(shard, key);
+    if (site == NULL || site->freshness.expires > now)
+        return NULL;
+    int validated = site->etag[0] != '\0' || site->last_modified >= 0;
+    if (!validated && site->freshness.stale_until <= now && site->freshness.error_until <= now)
+    {
+        delete_element(shard, site);
+        return NULL;
+    }
+    __atomic_add_fetch(&site->refcount, 1, __ATOMIC_RELAXED);
+    return site;
+}
+
+// finds key in the restored snapshot, returns its slot or NULL
+static const struct snapshot_slot *snapshot_find(const cache_key *key)
+{
+    if (restored.base == NULL)
+        return NULL;
+    for (uint64_t n = 0, i = key->lo & (restored.slots - 1); n < restored.slots; n++, i = (i + 1) & (restored.slots - 1))
+    {
+        const struct snapshot_slot *slot = &restored.table[i];
+        if (slot->key_len == 0)
+            return NULL;
+        if (slot->hash == key->lo && slot->key_len == sizeof(cache_key) && memcmp(restored.base + slot->key_offset, key, sizeof(cache_key)) == 0)
+            return slot;
+    }
+    return NULL; // a table without an empty slot is rejected when it is mapped, the probe is bounded anyway
+}
+
+/*
+    The restore_element function fills an element that missed with the response the restored snapshot holds for its key, if any, and
+    caches it. It returns 0 with the cached element pinned for the caller in *site, or -1 if the snapshot does not have the key or its
+    response went stale meanwhile. The slot is used only once, a response evicted after that is fetched again like any other.
+    Requests may already follow the element, so a gzip copy is restored into an element of its own: the followers could not tell it
+    from a response as it was received. The fill is withdrawn instead and they look the key up again.
+*/
+static int restore_element(cache_element **site, time_t now)
+{
+    cache_element *element = *site;
+    const struct snapshot_slot *slot = snapshot_find(&element->key);
+    if (slot == NULL || __atomic_exchange_n(&restored.taken[slot - restored.table], 1, __ATOMIC_RELAXED))
+        return -1;
+    if (slot->expires <= now)
+        return -1;
+    cache_element *restored_element = element;
+    if (slot->encoded_head > 0 && (restored_element = create_element(&element->key)) == NULL)
+        return -1;
+    restored_element->freshness.expires = slot->expires;
+    restored_element->freshness.stale_until = slot->stale_until;
+    restored_element->freshness.error_until = slot->error_until;
+    restored_element->freshness.received = slot->received;
+    char etag[CACHE_ETAG_MAX];
+    memcpy(etag, restored.base + slot->data_offset + slot->data_len, slot->etag_len); // shorter than etag, checked when the file was mapped
+    etag[slot->etag_len] = '\0';
+    cache_fill_validators(restored_element, etag, slot->last_modified);
+    cache_fill_encoded(restored_element, slot->identity_head, slot->encoded_head);
+    const char *data = restored.base + slot->data_offset;
+    size_t head_len = slot->body_offset > 0 ? slot->body_offset : slot->data_len; // all of the response if the body is not shared
+    int failed = cache_fill_append(restored_element, data, head_len) < 0;
+    if (!failed && slot->body_offset > 0)
+    {
+        cache_fill_body(restored_element);
+        failed = cache_fill_append(restored_element, data + slot->body_offset, slot->data_len - slot->body_offset) < 0;
+    }
+    if (failed)
+    {
+        if (restored_element != element)
+            release_cache_element(restored_element);
+        return -1;
+    }
+    __atomic_add_fetch(&restored_element->refcount, 1, __ATOMIC_RELAXED); // the reference of the filler goes to the cache
+    cache_fill_commit(restored_element);
+    if (restored_element != element)
+    {
+        cache_fill_withdraw(element);
+        *site = restored_element;
+    }
+    return 0;
+}
+
+cache_element *cache_lookup(const cache_key *key, int *status, cache_element **stale)
+{
+    cache_shard *shard = shard_for(key);
+    time_t now = time(NULL);
+
+    *status = CACHE_FILL; // also when no element could be created, the caller then fetches without caching
+    *stale = NULL;
+    pthread_mutex_lock(&shard->lock);
+    cache_policy_access(shard->policy, key); // counted once, hit or miss
+    cache_element *site = find_element(shard, key, now, status);
+    pthread_mutex_unlock(&shard->lock);
+
+    if (site == NULL) // the caller fetches it, later misses follow
+    {
+        cache_element *created = create_element(key); // outside the lock, making room may evict from any shard
+        pthread_mutex_lock(&shard->lock);
+        site = find_element(shard, key, now, status); // another request may have started the fetch meanwhile
+        if (site == NULL && created != NULL)
+        {
+            inflight_insert(shard, created);
+            site = created;
+            created = NULL;
+            *stale = stale_element(shard, key, now);
+        }
+        pthread_mutex_unlock(&shard->lock);
+        if (created != NULL)
+            release_cache_element(created);
+    }
+
+    if (*status == CACHE_FILL && site != NULL && restored.base != NULL) // the proxy restarted, the response may be in the snapshot
+    {
+        if (restore_element(&site, now) == 0)
+        {
+            *status = CACHE_HIT;
+            if (*stale != NULL) // replaced by the restored response
+            {
+                release_cache_element(*stale);
+                *stale = NULL;
+            }
+        }
+        else if (site->len > 0) // part of it was copied, the element cannot be filled from the remote server anymore
+        {
+            cache_fill_withdraw(site);
+            site = NULL;
+        }
+    }
+
+    if (*status == CACHE_HIT)
+        printf("\n Url found\n");
+    else if (*status == CACHE_STALE)
+        printf("\n Url found stale\n");
+    else
+        printf("URL not found\n");
+    return site;
+}
+
+cache_element *cache_refresh(const cache_key *key, cache_element **stale, int fresh)
+{
+    cache_shard *shard = shard_for(key);
+    time_t now = time(NULL);
+
+    *stale = NULL;
+    pthread_mutex_lock(&shard->lock);
+    int running = inflight_lookup(shard, key) != NULL;
+    pthread_mutex_unlock(&shard->lock);
+    if (running) // the usual case once a refresh started, nothing is allocated for it
+        return NULL;
+
+    cache_element *created = create_element(key); // outside the lock, making room may evict from any shard
+    cache_element *fill = NULL;
+    if (created == NULL)
+        return NULL;
+    pthread_mutex_lock(&shard->lock);
+    if (inflight_lookup(shard, key) == NULL)
+    {
+        *stale = fresh ? table_lookup(shard, key) : stale_element(shard, key, now);
+        if (fresh && *stale != NULL) // stale_element() pins what it returns
+            __atomic_add_fetch(&(*stale)->refcount, 1, __ATOMIC_RELAXED);
+    }
+    if (*stale != NULL)
+    {
+        inflight_insert(shard, created);
+        fill = created;
+        created = NULL;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    if (created != NULL)
+        release_cache_element(created);
+    return fill;
+}
+
+void cache_revalidated(cache_element *element, const cache_freshness *freshness)
+{
+    cache_shard *shard = shard_for(&element->key);
+    pthread_mutex_lock(&shard->lock);
+    element->freshness = *freshness; // lookups read it under the lock, the data stays as it is
+    pthread_mutex_unlock(&shard->lock);
+}
+
+// checks whether len more bytes can be stored, marks the element uncacheable once it outgrows the cache, returns -1 if nobody needs the bytes anymore
+static int fill_admit(cache_element *element, size_t len)
+{
+    if (!element->uncacheable && (element->len + len > MAX_ELEMENT_SIZE || element->mem_size + len > shard_for(&element->key)->max_size))
+    {
+        cache_shard *shard = shard_for(&element->key);
+        element->uncacheable = 1; // too big to be cached, no new reader may attach to it
+        pthread_mutex_lock(&shard->lock);
+        inflight_unlink(shard, element);
+        pthread_mutex_unlock(&shard->lock);
+    }
+    if (element->uncacheable)
+    {
+        pthread_mutex_lock(&element->lock);
+        int readers = element->waiters != NULL;
+        pthread_mutex_unlock(&element->lock);
+        if (!readers)
+            return -1;
+    }
+    return 0;
+}
+
+// returns the chunk the next appended bytes go into, with room for at least one byte, NULL if it could not be allocated
+static cache_chunk *fill_chunk(cache_element *element)
+{
+    cache_chunk *last = element->last;
+    if (last != NULL && last->len < last->size)
+        return last;
+
+    // start a new chunk, each one twice as big as the last up to MAX_CHUNK_SIZE
+    size_t size = last == NULL ? MIN_CHUNK_SIZE : (sizeof(cache_chunk) + last->size) * 2;
+    if (size > MAX_CHUNK_SIZE)
+        size = MAX_CHUNK_SIZE;
+    size_t item_size;
+    cache_chunk *chunk = (cache_chunk *)cache_alloc(size, &item_size);
+    if (chunk == NULL)
+        return NULL;
+    chunk->next = NULL;
+    chunk->size = item_size - sizeof(cache_chunk); // the data fills the whole item
+    chunk->len = 0;
+    if (last == NULL)
+        element->chunks = chunk;
+    else
+        last->next = chunk;
+    element->last = chunk;
+    element->mem_size += item_size;
+    return chunk;
+}
+
+// publishes the bytes appended so far, then wakes the readers that sent everything before them
+static void fill_publish(cache_element *element, size_t newlen)
+{
+    pthread_mutex_lock(&element->lock);
+    __atomic_store_n(&element->len, newlen, __ATOMIC_RELEASE);
+    wake_waiters(element, 0);
+    pthread_mutex_unlock(&element->lock);
+}
+
+int cache_fill_append(cache_element *element, const char *data, size_t len)
+{
+    if (fill_admit(element, len) < 0)
+        return -1;
+
+    size_t newlen = element->len + len; // only the filler changes len, readers see it once it is published
+    while (len > 0)
+    {
+        cache_chunk *last = fill_chunk(element);
+        if (last == NULL)
+            return -1;
+        size_t n = last->size - last->len;
+        if (n > len)
+            n = len;
+        memcpy(last->data + last->len, data, n);
+        if (element->body_offset > 0)
+            cache_digest_update(&element->body_digest, data, n);
+        last->len += n;
+        data += n;
+        len -= n;
+    }
+    fill_publish(element, newlen);
+    return 0;
+}
+
+int cache_fill_read(cache_element *element, int fd, size_t len)
+{
+    if (fill_admit(element, len) < 0)
+        return -1;
+
+    size_t newlen = element->len + len;
+    while (len > 0)
+    {
+        cache_chunk *last = fill_chunk(element);
+        if (last == NULL)
+            return -1;
+        size_t n = last->size - last->len;
+        if (n > len)
+            n = len;
+        ssize_t bytes_read = read(fd, last->data + last->len, n);
+        if (bytes_read <= 0) // the bytes read so far stay unpublished, the element is abandoned anyway
+            return -1;
+        if (element->body_offset > 0)
+            cache_digest_update(&element->body_digest, last->data + last->len, bytes_read);
+        last->len += bytes_read;
+        len -= bytes_read;
+    }
+    fill_publish(element, newlen);
+    return 0;
+}
+
+/*
+    The cache_fill_body function ends the chunk the head was appended to where the head ends, so the body starts a chunk of its own
+    and can be shared as a whole. Readers walk chunk->size bytes of every chunk before the last one: the new size is published with
+    the first byte of the body, and until then a reader does not read past the bytes of the head.
+*/
+void cache_fill_body(cache_element *element)
+{
+    element->body_offset = element->len;
+    cache_digest_init(&element->body_digest);
+    if (element->last != NULL)
+        element->last->size = element->last->len;
+}
+
+void cache_fill_freshness(cache_element *element, const cache_freshness *freshness)
+{
+    element->freshness = *freshness; // read under the shard lock once the element is committed
+}
+
+void cache_fill_validators(cache_element *element, const char *etag, time_t last_modified)
+{
+    element->etag[0] = '\0';
+    if (strlen(etag) < sizeof(element->etag))
+        strcpy(element->etag, etag);
+    element->last_modified = last_modified;
+}
+
+// the first chunk of the body of element, which starts a chunk of its own
+static cache_chunk *body_chunk(cache_element *element)
+{
+    cache_chunk *chunk = element->chunks;
+    for (size_t pos = 0; pos < element->body_offset; pos += chunk->size, chunk = chunk->next)
+    {
+    }
+    return chunk;
+}
+
+// compares the len bytes of two chains of chunks, each full but the last
+static int same_bytes(cache_chunk *a, cache_chunk *b, size_t len)
+{
+    size_t a_offset = 0, b_offset = 0;
+    while (len > 0)
+    {
+        if (a_offset == a->size)
+        {
+            a = a->next;
+            a_offset = 0;
+        }
+        if (b_offset == b->size)
+        {
+            b = b->next;
+            b_offset = 0;
+        }
+        size_t n = a->size - a_offset < b->size - b_offset ? a->size - a_offset : b->size - b_offset;
+        if (n > len)
+            n = len;
+        if (memcmp(a->data + a_offset, b->data + b_offset, n) != 0)
+            return 0;
+        a_offset += n;
+        b_offset += n;
+        len -= n;
+    }
+    return 1;
+}
+
+// a complete element holding a copy of the head of element followed by body, NULL if memory ran out
+static cache_element *compact_element(cache_element *element, cache_body *body)
+{
+    if (sizeof(cache_chunk) + element->body_offset > SLAB_MAX_ITEM)
+        return NULL;
+    cache_element *compact = create_element(&element->key);
+    size_t item_size;
+    cache_chunk *head = compact != NULL ? (cache_chunk *)cache_alloc(sizeof(cache_chunk) + element->body_offset, &item_size) : NULL;
+    if (head == NULL)
+    {
+        if (compact != NULL)
+            release_cache_element(compact);
+        return NULL;
+    }
+    cache_cursor cursor;
+    struct iovec iov;
+    size_t len = 0;
+    cache_cursor_init(&cursor, element);
+    while (len < element->body_offset && cache_cursor_iov(&cursor, &iov, 1) > 0)
+    {
+        size_t n = iov.iov_len < element->body_offset - len ? iov.iov_len : element->body_offset - len;
+        memcpy(head->data + len, iov.iov_base, n);
+        len += n;
+        cache_cursor_advance(&cursor, n);
+    }
+    head->size = head->len = element->body_offset; // full, the body follows
+    head->next = body->chunks;
+    compact->chunks = compact->last = head;
+    compact->mem_size += item_size;
+    compact->len = element->len;
+    compact->body = body;
+    compact->body_offset = element->body_offset;
+    compact->identity_head = element->identity_head;
+    compact->encoded_head = element->encoded_head;
+    return compact;
+}
+
+/*
+    The share_body function looks the body of a complete element up among the shared bodies by its digest, and makes it a shared body
+    itself if it is the first one. A body found is only used if its bytes are the same: the digest is not meant to resist an attacker,
+    who could otherwise get a response of theirs served for another url. It returns the element to cache instead of element, its head
+    followed by the shared body, or NULL if the body cannot be shared. The element returned is only accounted for its head.
+*/
+static cache_element *share_body(cache_element *element)
+{
+    cache_key digest = cache_digest_final(&element->body_digest);
+    size_t len = element->len - element->body_offset;
+    cache_chunk *first = body_chunk(element);
+    size_t item_size;
+    cache_body *created = (cache_body *)cache_alloc(sizeof(cache_body), &item_size); // outside the lock, making room may evict
+
+    pthread_mutex_lock(&bodies.lock);
+    cache_body *body = bodies.buckets[digest.lo & (BODY_BUCKETS - 1)];
+    while (body != NULL && !(CACHE_KEY_EQ(body->digest, digest) && body->len == len))
+    {
+        body = body->hnext;
+    }
+    if (body != NULL)
+    {
+        body->refcount++; // for the element cached instead
+    }
+    else if (created != NULL)
+    {
+        body = created;
+        created = NULL;
+        body->digest = digest;
+        body->len = len;
+        body->chunks = first;
+        body->mem_size = item_size;
+        for (cache_chunk *chunk = first; chunk != NULL; chunk = chunk->next)
+            body->mem_size += sizeof(cache_chunk) + chunk->size; // the data of a chunk fills its item
+        body->refcount = 2; // element, whose chunks end with it now, and the element cached instead
+        element->body = body;
+        body->hnext = bodies.buckets[digest.lo & (BODY_BUCKETS - 1)];
+        bodies.buckets[digest.lo & (BODY_BUCKETS - 1)] = body;
+        __atomic_add_fetch(&bodies.mem_size, body->mem_size, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&bodies.lock);
+    if (created != NULL)
+        slab_free(created);
+    if (body == NULL)
+        return NULL;
+
+    cache_element *compact = NULL;
+    if (element->body == body || same_bytes(body->chunks, first, len))
+        compact = compact_element(element, body);
+    if (compact == NULL)
+        release_body(body);
+    return compact;
+}
+
+int cache_fill_commit(cache_element *element)
+{
+    cache_shard *shard = shard_for(&element->key);
+    int cached = 0;
+
+    if (!element->uncacheable && element->body == NULL && element->body_offset > 0 && element->len - element->body_offset >= CACHE_BODY_MIN)
+    {
+        cache_element *compact = share_body(element);
+        if (compact != NULL)
+            return cache_fill_replace(element, compact);
+    }
+
+    finish_fill(element, CACHE_COMPLETE); // before the element is cached, eviction may drop it right after
+
+    pthread_mutex_lock(&shard->lock);
+    inflight_unlink(shard, element);
+    if (!element->uncacheable)
+    {
+        cache_element *old = table_lookup(shard, &element->key);
+        if (old != NULL) // an older response for the same key
+        {
+            delete_element(shard, old);
+        }
+        while (shard->cache_size + bodies_share() + element->mem_size > shard->max_size && remove_cache_element(shard) == 0)
+        {
+            // evict without releasing the lock we already hold
+        }
+        table_insert(shard, element); // the reference of the filler now belongs to the cache
+        cache_policy_insert(shard->policy, element);
+        shard->cache_size += element->mem_size;
+        cached = 1;
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    if (!cached)
+    {
+        release_cache_element(element);
+    }
+    return cached;
+}
+
+cache_element *cache_fill_create(const cache_key *key)
+{
+    return create_element(key);
+}
+
+int cache_fill_replace(cache_element *element, cache_element *replacement)
+{
+    cache_shard *shard = shard_for(&element->key);
+
+    replacement->freshness = element->freshness;
+    replacement->last_modified = element->last_modified;
+    strcpy(replacement->etag, element->etag);
+    finish_fill(element, CACHE_COMPLETE); // its readers send it as it is
+
+    pthread_mutex_lock(&shard->lock);
+    inflight_unlink(shard, element);
+    pthread_mutex_unlock(&shard->lock);
+    release_cache_element(element);
+    return cache_fill_commit(replacement);
+}
+
+void cache_fill_encoded(cache_element *element, size_t identity_head, size_t encoded_head)
+{
+    element->identity_head = identity_head; // never changes once data is published, readers read it without a lock
+    element->encoded_head = encoded_head;
+}
+
+void cache_fill_abandon(cache_element *element)
+{
+    cache_shard *shard = shard_for(&element->key);
+
+    pthread_mutex_lock(&shard->lock);
+    inflight_unlink(shard, element);
+    pthread_mutex_unlock(&shard->lock);
+
+    finish_fill(element, CACHE_ABORTED);
+    release_cache_element(element);
+}
+
+void cache_fill_withdraw(cache_element *element)
+{
+    element->uncacheable = 1; // tells the readers to look the key up again rather than fail
+    cache_fill_abandon(element);
+}
+
+void cache_follow(cache_element *element, cache_waiter *waiter)
+{
+    pthread_mutex_lock(&element->lock);
+    waiter->waiting = 0;
+    waiter->next = element->waiters;
+    element->waiters = waiter;
+    pthread_mutex_unlock(&element->lock);
+}
+
+int cache_wait(cache_element *element, cache_waiter *waiter, size_t pos)
+{
+    int sleep = 0;
+    pthread_mutex_lock(&element->lock);
+    if (element->len == pos && element->state == CACHE_FILLING) // nothing new can be published while we hold the lock
+    {
+        waiter->waiting = 1;
+        sleep = 1;
+    }
+    pthread_mutex_unlock(&element->lock);
+    return sleep;
+}
+
+void cache_unfollow(cache_element *element, cache_waiter *waiter)
+{
+    pthread_mutex_lock(&element->lock);
+    cache_waiter **link = &element->waiters;
+    while (*link != NULL && *link != waiter)
+    {
+        link = &(*link)->next;
+    }
+    if (*link != NULL)
+    {
+        *link = waiter->next;
+    }
+    pthread_mutex_unlock(&element->lock);
+}
+
+void cache_cursor_init(cache_cursor *cursor, cache_element *element)
+{
+    cursor->element = element;
+    cursor->chunk = NULL;
+    cursor->offset = 0;
+    cursor->pos = 0;
+}
+
+/*
+  Readers never look at chunk->len, the filler may be writing it. Every chunk
+  but the last is full, so a reader walks chunk->size bytes per chunk and
+  stops at the published length. A next pointer is only followed when bytes
+  behind it have been published, which guarantees it was set.
+*/
+int cache_cursor_iov(cache_cursor *cursor, struct iovec *iov, int maxiov)
+{
+    size_t len = __atomic_load_n(&cursor->element->len, __ATOMIC_ACQUIRE);
+    if (cursor->pos >= len)
+        return 0;
+    if (cursor->chunk == NULL) // the element had no data when the cursor was created
+        cursor->chunk = cursor->element->chunks;
+
+    int n = 0;
+    cache_chunk *chunk = cursor->chunk;
+    size_t offset = cursor->offset;
+    size_t pos = cursor->pos;
+    while (pos < len && n < maxiov)
+    {
+        if (offset == chunk->size)
+        {
+            chunk = chunk->next;
+            offset = 0;
+        }
+        size_t avail = chunk->size - offset;
+        if (avail > len - pos)
+            avail = len - pos;
+        iov[n].iov_base = chunk->data + offset;
+        iov[n].iov_len = avail;
+        n++;
+        pos += avail;
+        offset += avail;
+    }
+    return n;
+}
+
+void cache_cursor_advance(cache_cursor *cursor, size_t n)
+{
+    if (cursor->chunk == NULL && n > 0) // nothing was read yet, the bytes skipped are published
+        cursor->chunk = cursor->element->chunks;
+    cursor->pos += n;
+    while (n > 0)
+    {
+        if (cursor->offset == cursor->chunk->size)
+        {
+            cursor->chunk = cursor->chunk->next;
+            cursor->offset = 0;
+        }
+        size_t avail = cursor->chunk->size - cursor->offset;
+        if (avail > n)
+            avail = n;
+        cursor->offset += avail;
+        n -= avail;
+    }
+}
+
+int cache_vary_get(const cache_key *url, char *names, size_t size)
+{
+    cache_shard *shard = shard_for(url);
+    struct vary_slot *slot = &shard->vary[url->lo & (VARY_SLOTS - 1)];
+    int found = 0;
+    pthread_mutex_lock(&shard->lock);
+    if (CACHE_KEY_EQ(slot->url, *url) && slot->names[0] != '\0' && strlen(slot->names) < size)
+    {
+        strcpy(names, slot->names);
+        found = 1;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return found ? 0 : -1;
+}
+
+void cache_vary_set(const cache_key *url, const char *names)
+{
+    cache_shard *shard = shard_for(url);
+    struct vary_slot *slot = &shard->vary[url->lo & (VARY_SLOTS - 1)];
+    if (strlen(names) >= CACHE_VARY_MAX)
+        return;
+    pthread_mutex_lock(&shard->lock);
+    if (names[0] != '\0') // the url replaces whatever the slot held
+    {
+        slot->url = *url;
+        strcpy(slot->names, names);
+    }
+    else if (CACHE_KEY_EQ(slot->url, *url)) // its responses stopped varying
+    {
+        slot->names[0] = '\0';
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/*
+  Snapshots
+*/
+
+// an element pinned by a snapshot while its data is written out
+typedef struct
+{
+    cache_element *element;
+    size_t len;
+    cache_freshness freshness; // as it was when the element was pinned, a revalidation may change it
+} snapshot_item;
+
+// appends the pinned complete elements of a shard that are still fresh to *items
+static int pin_shard(cache_shard *shard, time_t now, snapshot_item **items, size_t *count, size_t *capacity)
+{
+    pthread_mutex_lock(&shard->lock);
+    for (size_t i = 0; i < shard->nbuckets; i++)
+    for (cache_element *element = shard->buckets[i]; element != NULL; element = element->hnext)
+    {
+        if (element->freshness.expires <= now) // a stale response would have to be revalidated after the restart
+            continue;
+        if (*count == *capacity)
+        {
+            size_t grown_capacity = *capacity ? *capacity * 2 : 1024;
+            snapshot_item *grown = (snapshot_item *)realloc(*items, grown_capacity * sizeof(snapshot_item));
+            if (grown == NULL)
+            {
+                pthread_mutex_unlock(&shard->lock);
+                return -1;
+            }
+            *items = grown;
+            *capacity = grown_capacity;
+        }
+        __atomic_add_fetch(&element->refcount, 1, __ATOMIC_RELAXED);
+        (*items)[*count].element = element;
+        (*items)[*count].freshness = element->freshness;
+        (*items)[(*count)++].len = element->len;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return 0;
+}
+
+// writes all of buf at the current offset of fd, returns -1 on failure
+static int write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = (const char *)buf;
+    while (len > 0)
+    {
+        ssize_t n = write(fd, p, len);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// writes the data of a complete element at the current offset of fd, straight from its chunks
+static int write_element(int fd, cache_element *element)
+{
+    cache_cursor cursor;
+    struct iovec iov[16];
+    cache_cursor_init(&cursor, element);
+    int iovcnt;
+    while ((iovcnt = cache_cursor_iov(&cursor, iov, 16)) > 0)
+    {
+        ssize_t n = writev(fd, iov, iovcnt);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        cache_cursor_advance(&cursor, n);
+    }
+    return 0;
+}
+
+// puts the slot of a response written at slot->key_offset in the table of the snapshot
+static void table_put(struct snapshot_slot *table, uint64_t slots, const struct snapshot_slot *slot)
+{
+    uint64_t i = slot->hash & (slots - 1);
+    while (table[i].key_len != 0)
+    {
+        i = (i + 1) & (slots - 1);
+    }
+    table[i] = *slot;
+}
+
+/*
+    The cache_snapshot function writes every complete and fresh response of the cache to a temporary file, followed by the fresh
+    responses of the restored snapshot that were never looked up, up to MAX_SIZE in all. The file is renamed over path once it is whole, so a crash
+    never leaves a torn snapshot behind. The shard locks are only held while the elements are pinned, the data is written without them.
+*/
+int cache_snapshot(const char *path)
+{
+    snapshot_item *items = NULL;
+    size_t count = 0, capacity = 0;
+    time_t now = time(NULL);
+    for (size_t i = 0; i < nshards; i++)
+    {
+        if (pin_shard(&shards[i], now, &items, &count, &capacity) < 0)
+            break;
+    }
+
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    size_t nrestored = 0; // slots of the restored snapshot carried over
+    for (uint64_t i = 0; restored.base != NULL && i < restored.slots; i++)
+    {
+        if (restored.table[i].key_len != 0 && restored.table[i].expires > now && !__atomic_load_n(&restored.taken[i], __ATOMIC_RELAXED))
+            nrestored++;
+    }
+    uint64_t slots = 1;
+    while (slots < 2 * (count + nrestored) || slots < 2)
+    {
+        slots *= 2;
+    }
+    struct snapshot_slot *table = (struct snapshot_slot *)calloc(slots, sizeof(struct snapshot_slot));
+    int failed = fd < 0 || table == NULL;
+
+    struct snapshot_header header = {SNAPSHOT_MAGIC, 0, slots, 0};
+    uint64_t offset = sizeof(header);
+    failed = failed || write_all(fd, &header, sizeof(header)) < 0;
+    for (size_t i = 0; i < count && !failed && offset < MAX_SIZE; i++)
+    {
+        cache_element *element = items[i].element;
+        struct snapshot_slot slot;
+        memset(&slot, 0, sizeof(slot));
+        slot.hash = element->key.lo;
+        slot.key_offset = offset;
+        slot.key_len = sizeof(cache_key);
+        slot.data_offset = offset + slot.key_len;
+        slot.data_len = items[i].len;
+        slot.expires = items[i].freshness.expires;
+        slot.stale_until = items[i].freshness.stale_until;
+        slot.error_until = items[i].freshness.error_until;
+        slot.received = items[i].freshness.received;
+        slot.last_modified = element->last_modified;
+        slot.etag_len = strlen(element->etag);
+        slot.identity_head = element->identity_head;
+        slot.encoded_head = element->encoded_head;
+        slot.body_offset = element->body_offset;
+        failed = write_all(fd, &element->key, slot.key_len) < 0 || write_element(fd, element) < 0 || write_all(fd, element->etag, slot.etag_len) < 0;
+        table_put(table, slots, &slot);
+        offset += slot.key_len + slot.data_len + slot.etag_len;
+        header.count++;
+    }
+    for (uint64_t i = 0; restored.base != NULL && i < restored.slots && !failed && offset < MAX_SIZE; i++)
+    {
+        const struct snapshot_slot *slot = &restored.table[i];
+        if (slot->key_len == 0 || slot->expires <= now || __atomic_load_n(&restored.taken[i], __ATOMIC_RELAXED))
+            continue;
+        size_t len = slot->key_len + slot->data_len + slot->etag_len; // the data follows the key, the entity tag the data
+        failed = write_all(fd, restored.base + slot->key_offset, len) < 0;
+        struct snapshot_slot moved = *slot;
+        moved.key_offset = offset;
+        moved.data_offset = offset + slot->key_len;
+        table_put(table, slots, &moved);
+        offset += len;
+        header.count++;
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        release_cache_element(items[i].element);
+    }
+    free(items);
+
+    header.table_offset = offset;
+    failed = failed || write_all(fd, table, slots * sizeof(struct snapshot_slot)) < 0 ||
+             pwrite(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) || fsync(fd) < 0;
+    free(table);
+    if (fd >= 0)
+        close(fd);
+    if (failed || rename(tmp, path) < 0)
+    {
+        perror("Error in writing the cache snapshot");
+        unlink(tmp);
+        return -1;
+    }
+    return header.count;
+}
+
+int cache_restore(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    struct stat st;
+    const char *base = (const char *)MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(struct snapshot_header))
+    {
+        base = (const char *)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd); // the mapping keeps the file
+    if (base == MAP_FAILED)
+        return -1;
+
+    const struct snapshot_header *header = (const struct snapshot_header *)base;
+    size_t size = st.st_size;
+    if (header->magic != SNAPSHOT_MAGIC || header->slots == 0 || (header->slots & (header->slots - 1)) != 0 ||
+        header->table_offset > size || (size - header->table_offset) / sizeof(struct snapshot_slot) < header->slots)
+    {
+        printf("Ignoring the damaged cache snapshot %s\n", path);
+        munmap((void *)base, size);
+        return -1;
+    }
+    const struct snapshot_slot *table = (const struct snapshot_slot *)(base + header->table_offset);
+    uint64_t empty = 0; // a probe for a key that is missing ends at an empty slot, a table without one is damaged too
+    int damaged = 0;
+    for (uint64_t i = 0; i < header->slots && !damaged; i++) // a slot pointing outside the data would be read later, reject the file now
+    {
+        empty += table[i].key_len == 0;
+        damaged = table[i].key_len != 0 && (table[i].data_offset < table[i].key_offset || table[i].data_offset > header->table_offset ||
+                                            table[i].data_len > header->table_offset - table[i].data_offset ||
+                                            table[i].etag_len >= CACHE_ETAG_MAX ||
+                                            table[i].etag_len > header->table_offset - table[i].data_offset - table[i].data_len ||
+                                            (uint64_t)table[i].identity_head + table[i].encoded_head > table[i].data_len ||
+                                            table[i].body_offset > table[i].data_len);
+    }
+    if (damaged || empty == 0)
+    {
+        printf("Ignoring the damaged cache snapshot %s\n", path);
+        munmap((void *)base, size);
+        return -1;
+    }
+
+    restored.taken = (unsigned char *)calloc(header->slots, 1);
+    if (restored.taken == NULL)
+    {
+        munmap((void *)base, size);
+        return -1;
+    }
+    restored.table = table;
+    restored.slots = header->slots;
+    restored.size = size;
+    restored.base = base;
+    return header->count;
+}
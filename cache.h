@@ -0,0 +1,287 @@
+/*
+ * cache.h -- in-memory cache of responses.
+ *
+ * Every element is indexed by a hash table on its key (see cache_key.h) and
+ * linked into the lists of the eviction policy (see cache_policy.h). Looking
+ * up, promoting and evicting an element are therefore all O(1), however many
+ * elements the cache holds. The cache is split into shards by key, each with
+ * its own lock, policy state and share of MAX_SIZE.
+ *
+ * Elements and their data are allocated from the size-class slabs of slab.h,
+ * in an arena of MAX_SIZE bytes, and accounted for with the real size of their
+ * items. When the arena is full, the elements the policy picks are evicted
+ * until the allocation fits.
+ *
+ * Identical bodies are stored once: many urls (versioned assets, cache
+ * busters, mirrors) return the same bytes. A body the filler marked is
+ * digested as it arrives, and once the response is complete the element is
+ * cached as a copy of its head followed by the body it shares with every
+ * other element whose body has the same digest and the same bytes. The
+ * elements are only accounted for their heads. A body is accounted for on
+ * its own until the last element sharing it goes, every shard being charged
+ * an equal part of the bodies.
+ */
+
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <time.h>
+#include "cache_key.h"
+
+#ifndef CACHE
+#define CACHE
+
+#ifndef MAX_ELEMENT_SIZE // cache_stress.c builds the cache with a smaller one, so that it keeps many shards
+#define MAX_ELEMENT_SIZE 10 * (1 << 20)
+#endif
+#ifndef MAX_SIZE // cache_stress.c builds the cache with a smaller one
+#define MAX_SIZE 200 * (1 << 20)
+#endif
+#define CACHE_ETAG_MAX 128 // longest entity tag kept to revalidate a response with
+#define CACHE_BODY_MIN (16 * 1024) // shorter bodies are not shared, a head of their own costs about as much
+
+typedef struct cache_freshness cache_freshness;
+
+typedef struct cache_chunk cache_chunk;
+typedef struct cache_body cache_body;
+typedef struct cache_element cache_element;
+typedef struct cache_cursor cache_cursor;
+typedef struct cache_waiter cache_waiter;
+
+/*
+   The data of an element is a list of chunks that is only ever appended to.
+   Chunks double in size up to a limit, so appending never copies the bytes
+   already stored and only the last chunk is partly empty.
+ */
+struct cache_chunk
+{
+   cache_chunk *next; // next chunk of the same element
+   size_t size;       // capacity of data
+   size_t len;        // bytes of data in use, only read by the filler
+   char data[];
+};
+
+/*
+   A response is fresh until expires. After that it is only used once it was
+   revalidated, except that it may be served stale until stale_until while it
+   is revalidated in the background (stale-while-revalidate), and until
+   error_until when revalidating it fails (stale-if-error). Its Age is the
+   time since received.
+ */
+struct cache_freshness
+{
+   time_t expires;
+   time_t stale_until;
+   time_t error_until;
+   time_t received; // when the response arrived, less the age it already had then
+};
+
+typedef enum
+{
+   CACHE_FILLING,  // the response is still streaming in
+   CACHE_COMPLETE, // every byte of the response is stored
+   CACHE_ABORTED   // the fetch failed or was given up, the data is incomplete
+} cache_state;
+
+struct cache_element
+{
+   cache_chunk *chunks;     // data stream, never modified once the element is cached
+   cache_chunk *last;       // chunk receiving appended data
+   size_t len;              // size of data published to readers
+   size_t mem_size;         // bytes of the slab items of the element, accounted against MAX_SIZE
+   int refcount;            // one reference held by the cache (or the filler) plus one per reader
+   int state;               // a cache_state
+   int uncacheable;         // the response outgrew the cache, it is only kept for the readers already attached
+   int inflight;            // the element is in the table of responses being fetched
+   cache_freshness freshness; // until when the response may be used, read and revalidated under the shard lock
+   time_t last_modified;    // Last-Modified of the response, -1 if it had none
+   char etag[CACHE_ETAG_MAX]; // ETag of the response, empty if it had none
+   size_t identity_head;    // gzip copies (see cache_encoding.h): bytes of the head for clients that do not accept gzip, the data starts with it
+   size_t encoded_head;     // gzip copies: bytes of the head of the gzip body, which follow the identity head, 0 for other elements
+   size_t body_offset;      // where the body starts in the data, 0 unless the filler marked it with cache_fill_body()
+   cache_digest body_digest; // digest of the body so far, while the element fills
+   cache_body *body;        // body shared with other elements the chunks end with, NULL if the element owns all of its chunks
+   pthread_mutex_t lock;    // protects waiters and the state changes readers wait for
+   cache_waiter *waiters;   // readers streaming the element while it fills
+   cache_key key;           // digest of the canonical url of the response, and of its variant
+   cache_element *hnext;    // next element in the same hash bucket
+   cache_element *policy_prev; // neighbours on the list of the eviction policy the element is on
+   cache_element *policy_next;
+   int policy_list;         // which list of the policy that is
+};
+
+/* Set up the cache with count shards (rounded up to a power of two, but no
+ * more than leave every shard room for an element of MAX_ELEMENT_SIZE),
+ * evicting with the policy called policy. Must be called once before any
+ * other cache function, returns -1 if there is no such policy or it could not
+ * be set up */
+int cache_init(int count, const char *policy);
+
+/*
+   Look up key. Concurrent misses on the same key are collapsed into a single
+   fetch, so the lookup has four outcomes, returned in *status:
+
+   CACHE_HIT:    the complete response is cached and still fresh. The
+                 eviction policy is told about the hit.
+   CACHE_STALE:  the complete response is cached, it is stale but may be
+                 served while it is revalidated in the background. The
+                 caller serves it like a hit and starts the revalidation with
+                 cache_refresh().
+   CACHE_FOLLOW: another request is fetching the response right now. The
+                 element it fills is returned, the caller streams it as it
+                 arrives (see cache_follow()).
+   CACHE_FILL:   nobody has the response, the caller must fetch it and fill
+                 the returned element, see cache_fill_append(). If a stale
+                 response is cached for key, it is returned in *stale: the
+                 caller revalidates it with its validators, and serves it if
+                 the remote server answers that it did not change, or fails
+                 while error_until has not passed. *stale is NULL otherwise.
+
+   The returned elements are pinned: they stay valid even if they are evicted
+   meanwhile, until the caller hands them back with release_cache_element()
+   (or finishes the fill). No lock is held in between, so the data can be
+   sent straight from the element.
+ */
+#define CACHE_HIT 0
+#define CACHE_FOLLOW 1
+#define CACHE_FILL 2
+#define CACHE_STALE 3
+cache_element *cache_lookup(const cache_key *key, int *status, cache_element **stale);
+
+/*
+   Start the background revalidation of the stale response cached for key:
+   returns the element to fill, and the stale response pinned in *stale, like
+   a CACHE_FILL lookup. Only one runs at a time, it returns NULL if the
+   response is being fetched already or is not stale anymore. With fresh
+   set, a response that is still fresh is revalidated too, for a client
+   that asked for it.
+ */
+cache_element *cache_refresh(const cache_key *key, cache_element **stale, int fresh);
+
+/* The remote server confirmed that the stale response element did not
+ * change, it is used until the new freshness runs out */
+void cache_revalidated(cache_element *element, const cache_freshness *freshness);
+
+/* Drop a reference returned by cache_lookup(), the last reference frees the element */
+void release_cache_element(cache_element *element);
+
+/* State of the element, read it before the data with a cursor, so that a
+ * complete element is known to have all its data published */
+cache_state cache_element_state(cache_element *element);
+
+/*
+   The filler adds bytes with cache_fill_append() as they arrive and ends the
+   fill with cache_fill_commit() once the response is complete (the element is
+   then cached, replacing an older response for the same key) or with
+   cache_fill_abandon() if the fetch failed. Both end the filler's use of the
+   element.
+
+   Once the element grows past MAX_ELEMENT_SIZE or its shard it will not be
+   cached anymore, but the bytes are still stored for the readers already
+   streaming it. cache_fill_append() returns -1 when nobody needs them: the
+   filler should abandon the element and keep relaying without it.
+
+   cache_fill_withdraw() ends a fill that is not needed because the response
+   can be had elsewhere (from the disk cache for example), the readers
+   already attached look the key up again.
+
+   cache_fill_freshness() sets until when the response may be used and
+   cache_fill_validators() what it is revalidated with, before the fill is
+   committed. A response without freshness is stale right away, and without
+   validators it is fetched again in full once it is stale.
+
+   cache_fill_read() appends len bytes read from fd instead, straight into the
+   chunks of the element. fd must have them ready (a pipe the filler tee()d
+   the response into for example), it returns -1 like cache_fill_append() and
+   when fewer bytes could be read.
+
+   A complete response can also be cached in another form than it was
+   received in: cache_fill_create() returns an element for the same key that
+   nobody looks up, the filler writes the other form into it and
+   cache_fill_replace() then ends the fill of the original element, whose
+   readers get all of it, and caches the replacement instead, with the same
+   freshness and validators. cache_fill_encoded() marks an element as a gzip
+   copy, before any of its data is appended.
+
+   cache_fill_body() tells that the bytes appended next are the body of the
+   response, which may then be shared with other elements (see above). The
+   filler calls it once, right after the head of a body of CACHE_BODY_MIN
+   bytes at least.
+ */
+int cache_fill_append(cache_element *element, const char *data, size_t len);
+int cache_fill_read(cache_element *element, int fd, size_t len);
+void cache_fill_freshness(cache_element *element, const cache_freshness *freshness);
+void cache_fill_validators(cache_element *element, const char *etag, time_t last_modified);
+int cache_fill_commit(cache_element *element);
+void cache_fill_abandon(cache_element *element);
+void cache_fill_withdraw(cache_element *element);
+cache_element *cache_fill_create(const cache_key *key);
+int cache_fill_replace(cache_element *element, cache_element *replacement);
+void cache_fill_body(cache_element *element);
+void cache_fill_encoded(cache_element *element, size_t identity_head, size_t encoded_head);
+
+/*
+   Readers of an element that is still filling register a waiter with
+   cache_follow(). Once a reader has sent everything published, cache_wait()
+   returns 1 and the eventfd of the waiter is written as soon as more data is
+   published or the fill ends. It returns 0 if that already happened.
+   cache_unfollow() must be called before the eventfd is closed.
+ */
+struct cache_waiter
+{
+   int fd;             // eventfd of the reader
+   int waiting;        // the reader sleeps until the eventfd is written
+   cache_waiter *next; // next waiter of the same element
+};
+
+void cache_follow(cache_element *element, cache_waiter *waiter);
+int cache_wait(cache_element *element, cache_waiter *waiter, size_t pos);
+void cache_unfollow(cache_element *element, cache_waiter *waiter);
+
+/*
+   A cursor walks the data of an element without copying it:
+   cache_cursor_iov() points up to maxiov iovecs at the published bytes that
+   follow the cursor (0 means nothing is available yet) and
+   cache_cursor_advance() moves the cursor past n of them, e.g. after a
+   writev().
+ */
+struct cache_cursor
+{
+   cache_element *element; // element being read
+   cache_chunk *chunk;     // chunk holding the next byte, NULL before the first chunk
+   size_t offset;          // offset of that byte inside chunk
+   size_t pos;             // offset of that byte in the whole data
+};
+
+void cache_cursor_init(cache_cursor *cursor, cache_element *element);
+int cache_cursor_iov(cache_cursor *cursor, struct iovec *iov, int maxiov);
+void cache_cursor_advance(cache_cursor *cursor, size_t n);
+
+/*
+   Responses that carry Vary are cached under the url followed by the values
+   of the request headers they name. The names are remembered per url, so the
+   next request for it can build the same key before the response arrives:
+   cache_vary_get() copies them to names (at most size bytes) and returns 0,
+   or returns -1 if the responses of url are not known to vary. url is the
+   key of the canonical url alone.
+   cache_vary_set() records them, an empty list forgets them. The table is
+   small and direct mapped, a url pushed out of it builds the plain key again
+   and is told the names by its next response.
+ */
+#define CACHE_VARY_MAX 128 // longest list of names remembered
+int cache_vary_get(const cache_key *url, char *names, size_t size);
+void cache_vary_set(const cache_key *url, const char *names);
+
+/*
+   Snapshots let a restarted proxy serve hits right away. cache_snapshot()
+   writes the complete responses of the cache to path and returns how many it
+   wrote, or -1 on failure. It can run in its own thread while the cache is in
+   use. cache_restore(), called once after cache_init(), maps the snapshot at
+   path and returns how many responses it holds (-1 if there is none). They
+   are not loaded: each one is copied into the cache the first time
+   cache_lookup() misses on it.
+ */
+int cache_snapshot(const char *path);
+int cache_restore(const char *path);
+
+#endif
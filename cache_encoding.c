@@ -0,0 +1,329 @@
+/*
+  cache_encoding.c -- gzip copies of cached text responses.
+*/
+
+#include "cache_encoding.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#define GZIP_WINDOW_BITS (15 + 16) // the largest window, with a gzip wrapper rather than a zlib one
+#define GZIP_MEM_LEVEL 8           // zlib's default
+#define HEAD_ROOM (CACHE_ENCODING_HEAD_MAX + 128) // a rewritten head grows by the framing headers at most
+
+// appends to out as long as it has room, a head that does not fit is given up on
+typedef struct
+{
+    char *out;
+    size_t size;
+    size_t len;
+} head_writer;
+
+static void put_bytes(head_writer *w, const char *data, size_t len)
+{
+    if (w->len + len <= w->size)
+        memcpy(w->out + w->len, data, len);
+    w->len += len;
+}
+
+static void put_string(head_writer *w, const char *s)
+{
+    put_bytes(w, s, strlen(s));
+}
+
+// checks whether a list of q-values gives a weight of zero, i.e. only zeros follow "q="
+static int q_zero(const char *p, const char *end)
+{
+    for (; p < end && *p != ',' && *p != ';'; p++)
+    {
+        if (*p >= '1' && *p <= '9')
+            return 0;
+    }
+    return 1;
+}
+
+/*
+    The cache_encoding_accepted function reads the codings of Accept-Encoding with their weights: gzip (or its old name x-gzip) is
+    accepted unless its weight is zero, and so is * when gzip is not named. A request without the header only accepts identity.
+*/
+int cache_encoding_accepted(http_request *request)
+{
+    int gzip = -1, any = -1; // weight of each, -1 while it is not named
+    for (size_t i = 0; i < request->nheaders; i++)
+    {
+        http_header *h = &request->headers[i];
+        if (h->known != HTTP_ACCEPT_ENCODING)
+            continue;
+        const char *p = h->value.data, *end = h->value.data + h->value.len;
+        while (p < end)
+        {
+            while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+                p++;
+            const char *name = p;
+            while (p < end && *p != ',' && *p != ';' && *p != ' ' && *p != '\t')
+                p++;
+            size_t name_len = p - name;
+            int weight = 1;
+            while (p < end && *p != ',') // parameters, only q matters
+            {
+                if ((*p == 'q' || *p == 'Q') && p + 1 < end && p[1] == '=')
+                    weight = !q_zero(p + 2, end);
+                p++;
+            }
+            if ((name_len == 4 && strncasecmp(name, "gzip", 4) == 0) || (name_len == 6 && strncasecmp(name, "x-gzip", 6) == 0))
+                gzip = weight;
+            else if (name_len == 1 && name[0] == '*')
+                any = weight;
+        }
+    }
+    return gzip >= 0 ? gzip : any > 0;
+}
+
+int cache_encoding_compressible(const http_response *response)
+{
+    return response->status == 200 && response->body == HTTP_BODY_LENGTH && response->textual && !response->content_encoded &&
+           response->content_length >= CACHE_ENCODING_MIN && response->content_length <= CACHE_ENCODING_MAX;
+}
+
+/*
+    The write_head function writes the head of a gzip copy from the head the response was received with, which ends with its empty line:
+    the framing and coding headers are replaced with those of the body that follows, encoded or not. It returns the length of the head,
+    or -1 if it does not fit into size bytes.
+*/
+static long write_head(const char *head, size_t head_len, int encoded, size_t body_len, char *out, size_t size)
+{
+    head_writer w = {out, size, 0};
+    int varies = 0; // Vary names Accept-Encoding already
+    const char *line = head;
+    const char *end = head + head_len - 2; // the empty line is written last
+    int status_line = 1;
+    while (line < end)
+    {
+        const char *eol = (const char *)memchr(line, '\n', end - line);
+        const char *next = eol != NULL ? eol + 1 : end;
+        const char *colon = (const char *)memchr(line, ':', next - line);
+        size_t name_len = colon != NULL ? (size_t)(colon - line) : 0;
+        if (!status_line && colon != NULL)
+        {
+            const char *value = colon + 1;
+            while (value < next && (*value == ' ' || *value == '\t'))
+                value++;
+            const char *value_end = next;
+            while (value_end > value && (value_end[-1] == '\r' || value_end[-1] == '\n' || value_end[-1] == ' '))
+                value_end--;
+            http_view v = {value, (size_t)(value_end - value)};
+            if ((name_len == 14 && strncasecmp(line, "Content-Length", 14) == 0) ||
+                (name_len == 16 && strncasecmp(line, "Content-Encoding", 16) == 0) ||
+                (name_len == 17 && strncasecmp(line, "Transfer-Encoding", 17) == 0))
+            {
+                line = next;
+                continue;
+            }
+            if (name_len == 4 && strncasecmp(line, "Vary", 4) == 0 && (http_view_has_token(v, "accept-encoding") || http_view_has_token(v, "*")))
+                varies = 1;
+            if (encoded && name_len == 4 && strncasecmp(line, "ETag", 4) == 0 && value < next && *value == '"') // strong, the bytes differ
+            {
+                put_string(&w, "ETag: W/");
+                put_bytes(&w, value, next - value);
+                line = next;
+                continue;
+            }
+        }
+        put_bytes(&w, line, next - line);
+        status_line = 0;
+        line = next;
+    }
+
+    char framing[96];
+    snprintf(framing, sizeof(framing), "%s%sContent-Length: %zu\r\n\r\n", varies ? "" : "Vary: Accept-Encoding\r\n",
+             encoded ? "Content-Encoding: gzip\r\n" : "", body_len);
+    put_string(&w, framing);
+    return w.len <= w.size ? (long)w.len : -1;
+}
+
+// finds the end of the head at the start of element, copying it to head; returns its length with the empty line, 0 if it is too long
+static size_t read_head(cache_element *element, char *head, size_t size)
+{
+    cache_cursor cursor;
+    struct iovec iov;
+    size_t len = 0;
+    cache_cursor_init(&cursor, element);
+    while (len < size && cache_cursor_iov(&cursor, &iov, 1) > 0)
+    {
+        size_t n = iov.iov_len < size - len ? iov.iov_len : size - len;
+        memcpy(head + len, iov.iov_base, n);
+        len += n;
+        cache_cursor_advance(&cursor, n);
+    }
+    for (size_t i = 0; i + 4 <= len; i++)
+    {
+        if (memcmp(head + i, "\r\n\r\n", 4) == 0)
+            return i + 4;
+    }
+    return 0;
+}
+
+int cache_encoder_init(cache_encoder *encoder, cache_element *element, size_t head_len, size_t body_len, int level)
+{
+    memset(&encoder->stream, 0, sizeof(encoder->stream));
+    encoder->body = NULL;
+    encoder->head_len = head_len;
+    encoder->body_len = body_len;
+    encoder->failed = 1;
+    if (head_len > CACHE_ENCODING_HEAD_MAX || body_len < CACHE_ENCODING_MIN || body_len > CACHE_ENCODING_MAX)
+        return -1;
+    encoder->size = body_len - body_len / 8; // the gzip body must save an eighth at least
+    encoder->body = (char *)malloc(encoder->size);
+    if (encoder->body == NULL)
+        return -1;
+    if (deflateInit2(&encoder->stream, level, Z_DEFLATED, GZIP_WINDOW_BITS, GZIP_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        free(encoder->body);
+        encoder->body = NULL;
+        return -1;
+    }
+    encoder->stream.next_out = (Bytef *)encoder->body;
+    encoder->stream.avail_out = encoder->size;
+    cache_cursor_init(&encoder->cursor, element);
+    encoder->failed = 0;
+    return 0;
+}
+
+/*
+    The cache_encoder_feed function deflates the body bytes the element received since the last call, straight from its chunks. The
+    head is skipped once enough of the element arrived. A gzip body that outgrows its buffer is not worth keeping, the encoder fails.
+*/
+void cache_encoder_feed(cache_encoder *encoder)
+{
+    struct iovec iov;
+    while (!encoder->failed && cache_cursor_iov(&encoder->cursor, &iov, 1) > 0)
+    {
+        size_t n = iov.iov_len;
+        if (encoder->cursor.pos < encoder->head_len)
+        {
+            size_t head = encoder->head_len - encoder->cursor.pos;
+            cache_cursor_advance(&encoder->cursor, n < head ? n : head);
+            continue;
+        }
+        encoder->stream.next_in = (Bytef *)iov.iov_base;
+        encoder->stream.avail_in = n;
+        if (deflate(&encoder->stream, Z_NO_FLUSH) != Z_OK || encoder->stream.avail_in > 0) // out is full
+            encoder->failed = 1;
+        cache_cursor_advance(&encoder->cursor, n);
+    }
+}
+
+/*
+    The cache_encoder_finish function deflates what is left of the body and reads the head back from the element: the encoded head
+    states the length of the gzip body, so the heads are written last. The heads and the body then go into a new element.
+*/
+cache_element *cache_encoder_finish(cache_encoder *encoder)
+{
+    cache_element *element = encoder->cursor.element;
+    cache_encoder_feed(encoder);
+    if (encoder->failed || element->len != encoder->head_len + encoder->body_len || deflate(&encoder->stream, Z_FINISH) != Z_STREAM_END)
+        return NULL;
+    size_t encoded_len = encoder->stream.total_out;
+
+    char head[CACHE_ENCODING_HEAD_MAX];
+    size_t head_len = read_head(element, head, sizeof(head));
+    char *heads = head_len == encoder->head_len ? (char *)malloc(2 * HEAD_ROOM) : NULL;
+    long identity_head = -1, encoded_head = -1;
+    if (heads != NULL)
+    {
+        identity_head = write_head(head, head_len, 0, encoder->body_len, heads, HEAD_ROOM);
+        encoded_head = write_head(head, head_len, 1, encoded_len, heads + HEAD_ROOM, HEAD_ROOM);
+    }
+
+    cache_element *encoded = NULL;
+    if (identity_head >= 0 && encoded_head >= 0 && (encoded = cache_fill_create(&element->key)) != NULL)
+    {
+        cache_fill_encoded(encoded, identity_head, encoded_head);
+        int failed = cache_fill_append(encoded, heads, identity_head) < 0 || cache_fill_append(encoded, heads + HEAD_ROOM, encoded_head) < 0;
+        if (!failed)
+        {
+            cache_fill_body(encoded); // the gzip body may be shared with other urls
+            failed = cache_fill_append(encoded, encoder->body, encoded_len) < 0;
+        }
+        if (failed)
+        {
+            release_cache_element(encoded); // the only reference
+            encoded = NULL;
+        }
+    }
+    free(heads);
+    if (encoded != NULL)
+        printf("Cached a gzip copy of %zu bytes for a body of %zu\n", encoded_len, encoder->body_len);
+    return encoded;
+}
+
+void cache_encoder_end(cache_encoder *encoder)
+{
+    if (encoder->body != NULL)
+    {
+        deflateEnd(&encoder->stream);
+        free(encoder->body);
+        encoder->body = NULL;
+    }
+}
+
+int cache_decoder_init(cache_decoder *decoder, cache_element *element)
+{
+    cache_cursor_init(&decoder->cursor, element);
+    memset(&decoder->stream, 0, sizeof(decoder->stream));
+    decoder->ended = 0;
+    return inflateInit2(&decoder->stream, GZIP_WINDOW_BITS) == Z_OK ? 0 : -1;
+}
+
+/*
+    The cache_decoder_read function copies the identity head first, then skips the encoded head and inflates the gzip body straight
+    from the chunks of the element. inflate() is called even once all of the input was consumed, it may still hold output.
+*/
+ssize_t cache_decoder_read(cache_decoder *decoder, char *out, size_t size)
+{
+    cache_cursor *cursor = &decoder->cursor;
+    cache_element *element = cursor->element;
+    struct iovec iov;
+    if (cursor->pos < element->identity_head)
+    {
+        size_t n = 0;
+        while (n < size && cursor->pos < element->identity_head && cache_cursor_iov(cursor, &iov, 1) > 0)
+        {
+            size_t len = element->identity_head - cursor->pos;
+            if (len > iov.iov_len)
+                len = iov.iov_len;
+            if (len > size - n)
+                len = size - n;
+            memcpy(out + n, iov.iov_base, len);
+            n += len;
+            cache_cursor_advance(cursor, len);
+        }
+        if (cursor->pos == element->identity_head)
+            cache_cursor_advance(cursor, element->encoded_head); // only clients that accept gzip are sent it
+        return n;
+    }
+
+    z_stream *stream = &decoder->stream;
+    stream->next_out = (Bytef *)out;
+    stream->avail_out = size;
+    while (stream->avail_out > 0 && !decoder->ended)
+    {
+        int iovcnt = cache_cursor_iov(cursor, &iov, 1);
+        stream->next_in = iovcnt > 0 ? (Bytef *)iov.iov_base : NULL;
+        stream->avail_in = iovcnt > 0 ? iov.iov_len : 0;
+        int ret = inflate(stream, Z_NO_FLUSH);
+        if (iovcnt > 0)
+            cache_cursor_advance(cursor, iov.iov_len - stream->avail_in);
+        if (ret == Z_STREAM_END)
+            decoder->ended = 1;
+        else if (ret != Z_OK) // damaged, or cut short: no more output can be had
+            return stream->avail_out < size ? (ssize_t)(size - stream->avail_out) : -1;
+    }
+    return size - stream->avail_out;
+}
+
+void cache_decoder_end(cache_decoder *decoder)
+{
+    inflateEnd(&decoder->stream);
+}
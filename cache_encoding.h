@@ -0,0 +1,94 @@
+/*
+ * cache_encoding.h -- gzip copies of cached text responses.
+ *
+ * Text responses compress several times over, so the memory cache can keep
+ * them compressed and hold that many more. The body of a response that is
+ * worth it is deflated by a cache_encoder while it arrives, and once it is
+ * whole a gzip copy of it is built and cached in its place. The copy holds
+ * two heads, one after the other, followed by the gzip body:
+ *
+ *   - the identity head, which is the head of the response with the
+ *     Content-Length of the plain body,
+ *   - the encoded head, with Content-Encoding: gzip and the Content-Length
+ *     of the gzip body. Its entity tag, if strong, is made weak since the
+ *     bytes differ.
+ *
+ * Both carry Vary: Accept-Encoding. A client that accepts gzip is sent the
+ * encoded head and the body straight from the cache. Any other client is
+ * sent the identity head and the body as a cache_decoder inflates it, a
+ * buffer at a time.
+ */
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <zlib.h>
+#include "cache.h"
+#include "http_request.h"
+#include "http_response.h"
+
+#ifndef CACHE_ENCODING
+#define CACHE_ENCODING
+
+#define CACHE_ENCODING_MIN 1024            // shorter bodies gain too little to be compressed
+#define CACHE_ENCODING_MAX (1 << 20)       // longer bodies are cached as they are, the gzip body is held in memory until it is complete
+#define CACHE_ENCODING_HEAD_MAX 8192       // responses with longer heads are cached as they are
+
+typedef struct cache_encoder cache_encoder;
+typedef struct cache_decoder cache_decoder;
+
+/* Returns 1 if the Accept-Encoding of request accepts gzip */
+int cache_encoding_accepted(http_request *request);
+
+/* Returns 1 if the response, whose headers were parsed, is worth a gzip
+ * copy: a 200 with a textual Content-Type, no Content-Encoding and a
+ * Content-Length between CACHE_ENCODING_MIN and CACHE_ENCODING_MAX */
+int cache_encoding_compressible(const http_response *response);
+
+/*
+   An encoder deflates the body of a response while the response is filled
+   into element, so that a worker compresses the bytes of each read as they
+   arrive rather than the whole body at once when it is complete.
+   cache_encoder_init() starts it for a response whose head is head_len
+   bytes and whose body is body_len, with the given zlib level.
+   cache_encoder_feed() deflates the bytes appended to element since the
+   last call. cache_encoder_finish() builds the gzip copy of the complete
+   element, to be cached with cache_fill_replace(), and returns NULL if the
+   copy would not be smaller by at least an eighth, if the response is not
+   laid out as expected or if memory ran out. cache_encoder_end() frees
+   what the encoder holds, whether it finished or not.
+ */
+struct cache_encoder
+{
+   cache_cursor cursor; // next byte of the element to deflate
+   z_stream stream;     // deflates the body
+   char *body;          // the gzip body so far
+   size_t size;         // bytes of body, an eighth less than the plain body
+   size_t head_len;     // bytes of the head at the start of the element
+   size_t body_len;     // bytes of the plain body
+   int failed;          // the body does not shrink enough or zlib failed, the rest is not deflated
+};
+
+int cache_encoder_init(cache_encoder *encoder, cache_element *element, size_t head_len, size_t body_len, int level);
+void cache_encoder_feed(cache_encoder *encoder);
+cache_element *cache_encoder_finish(cache_encoder *encoder);
+void cache_encoder_end(cache_encoder *encoder);
+
+/*
+   A decoder reads a gzip copy as the response it was made from: its
+   identity head, then its body inflated. cache_decoder_read() writes up to
+   size bytes to out and returns how many, 0 once everything was read and
+   -1 if the copy is damaged. cache_decoder_end() frees what the decoder
+   holds, the element stays pinned by the caller.
+ */
+struct cache_decoder
+{
+   cache_cursor cursor; // next byte of the element to read
+   z_stream stream;     // inflates the gzip body
+   int ended;           // the gzip body was inflated whole
+};
+
+int cache_decoder_init(cache_decoder *decoder, cache_element *element);
+ssize_t cache_decoder_read(cache_decoder *decoder, char *out, size_t size);
+void cache_decoder_end(cache_decoder *decoder);
+
+#endif
@@ -0,0 +1,320 @@
+/*
+  cache_key.c -- keys of the cached responses.
+*/
+
+#include "cache_key.h"
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+
+#define DIGEST_SEED 0x9e3779b97f4a7c15ULL
+
+static const http_view default_scheme = {"http", 4}; // of a target without one
+
+// appends to out as long as it has room, counting every byte like snprintf()
+typedef struct
+{
+    char *out;
+    size_t size;
+    size_t len;
+} url_writer;
+
+static void put(url_writer *w, char c)
+{
+    if (w->len + 1 < w->size)
+        w->out[w->len] = c;
+    w->len++;
+}
+
+static void put_lower(url_writer *w, http_view v)
+{
+    for (size_t i = 0; i < v.len; i++)
+    {
+        put(w, tolower((unsigned char)v.data[i]));
+    }
+}
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    c = tolower((unsigned char)c);
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+// bytes that mean the same encoded or not, RFC 3986 section 2.3
+static int unreserved(int c)
+{
+    return isalnum(c) || c == '-' || c == '.' || c == '_' || c == '~';
+}
+
+/*
+    The put_path function appends the path and query with every percent-encoded byte written one way: decoded if it is unreserved,
+    with upper case hex digits otherwise. A fragment, which clients should not send, is left out.
+*/
+static void put_path(url_writer *w, http_view path)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    for (size_t i = 0; i < path.len && path.data[i] != '#'; i++)
+    {
+        int hi, lo;
+        if (path.data[i] == '%' && i + 2 < path.len && (hi = hex_value(path.data[i + 1])) >= 0 && (lo = hex_value(path.data[i + 2])) >= 0)
+        {
+            int c = hi << 4 | lo;
+            if (unreserved(c))
+            {
+                put(w, c);
+            }
+            else
+            {
+                put(w, '%');
+                put(w, hex[hi]);
+                put(w, hex[lo]);
+            }
+            i += 2;
+            continue;
+        }
+        put(w, path.data[i]);
+    }
+}
+
+size_t cache_key_url(http_request *request, char *out, size_t size)
+{
+    url_writer w = {out, size, 0};
+    http_view host = request->host;
+    while (host.len > 0 && host.data[host.len - 1] == '.') // "example.com." is example.com
+        host.len--;
+
+    int default_port = 80;
+    if (request->scheme.len == 0)
+    {
+        put_lower(&w, default_scheme);
+    }
+    else
+    {
+        put_lower(&w, request->scheme);
+        if (http_view_caseeq(request->scheme, "https"))
+            default_port = 443;
+    }
+    put(&w, ':');
+    put(&w, '/');
+    put(&w, '/');
+    put_lower(&w, host);
+    if (request->port.len > 0 && request->port_number != default_port)
+    {
+        char port[8];
+        int n = snprintf(port, sizeof(port), ":%d", request->port_number);
+        for (int i = 0; i < n; i++)
+            put(&w, port[i]);
+    }
+    put_path(&w, request->path);
+
+    if (size > 0)
+        out[w.len < size ? w.len : size - 1] = '\0';
+    return w.len;
+}
+
+static uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t fmix64(uint64_t k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+// mixes one block of 16 bytes into the two lanes
+static void digest_block(cache_digest *d, const unsigned char *p)
+{
+    const uint64_t c1 = 0x87c37b91114253d5ULL;
+    const uint64_t c2 = 0x4cf5ad432745937fULL;
+    uint64_t k1, k2;
+    memcpy(&k1, p, 8);
+    memcpy(&k2, p + 8, 8);
+    k1 *= c1;
+    k1 = rotl64(k1, 31);
+    k1 *= c2;
+    d->h1 ^= k1;
+    d->h1 = rotl64(d->h1, 27);
+    d->h1 += d->h2;
+    d->h1 = d->h1 * 5 + 0x52dce729;
+    k2 *= c2;
+    k2 = rotl64(k2, 33);
+    k2 *= c1;
+    d->h2 ^= k2;
+    d->h2 = rotl64(d->h2, 31);
+    d->h2 += d->h1;
+    d->h2 = d->h2 * 5 + 0x38495ab5;
+}
+
+void cache_digest_init(cache_digest *d)
+{
+    d->h1 = d->h2 = DIGEST_SEED;
+    d->len = 0;
+}
+
+/*
+    The cache_digest_update function is the block loop of MurmurHash3 x64_128: 16 bytes are mixed in at a time into two 64-bit lanes.
+    The bytes that do not make a whole block yet wait in d->tail for the next ones.
+*/
+void cache_digest_update(cache_digest *d, const char *data, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    size_t pending = d->len & 15;
+    d->len += len;
+    if (pending > 0)
+    {
+        size_t n = 16 - pending < len ? 16 - pending : len;
+        memcpy(d->tail + pending, p, n);
+        p += n;
+        len -= n;
+        if (pending + n < 16)
+            return;
+        digest_block(d, d->tail);
+    }
+    for (; len >= 16; p += 16, len -= 16)
+    {
+        digest_block(d, p);
+    }
+    memcpy(d->tail, p, len);
+}
+
+/*
+    The cache_digest_final function mixes in the last bytes and the length, then finalizes the lanes into each other. It is not meant
+    to resist an attacker, only to make accidental collisions negligible: two bodies with the same digest are compared byte for byte.
+*/
+cache_key cache_digest_final(cache_digest *d)
+{
+    const uint64_t c1 = 0x87c37b91114253d5ULL;
+    const uint64_t c2 = 0x4cf5ad432745937fULL;
+    const unsigned char *tail = d->tail;
+    size_t rest = d->len & 15;
+    uint64_t h1 = d->h1, h2 = d->h2;
+    uint64_t k1 = 0, k2 = 0;
+    for (size_t i = rest; i > 8; i--)
+    {
+        k2 ^= (uint64_t)tail[i - 1] << ((i - 9) * 8);
+    }
+    if (rest > 8)
+    {
+        k2 *= c2;
+        k2 = rotl64(k2, 33);
+        k2 *= c1;
+        h2 ^= k2;
+    }
+    for (size_t i = rest < 8 ? rest : 8; i > 0; i--)
+    {
+        k1 ^= (uint64_t)tail[i - 1] << ((i - 1) * 8);
+    }
+    if (rest > 0)
+    {
+        k1 *= c1;
+        k1 = rotl64(k1, 31);
+        k1 *= c2;
+        h1 ^= k1;
+    }
+
+    h1 ^= d->len;
+    h2 ^= d->len;
+    h1 += h2;
+    h2 += h1;
+    h1 = fmix64(h1);
+    h2 = fmix64(h2);
+    h1 += h2;
+    h2 += h1;
+    cache_key key = {h1, h2};
+    return key;
+}
+
+static uint32_t rotr32(uint32_t x, int r)
+{
+    return (x >> r) | (x << (32 - r));
+}
+
+// mixes one block of 64 bytes into the state, FIPS 180-4 section 6.2.2
+static void sha256_block(uint32_t state[8], const unsigned char *p)
+{
+    static const uint32_t k[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++)
+    {
+        w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 | (uint32_t)p[4 * i + 2] << 8 | p[4 * i + 3];
+    }
+    for (int i = 16; i < 64; i++)
+    {
+        uint32_t s0 = rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; i++)
+    {
+        uint32_t t1 = h + (rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+        uint32_t t2 = (rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
+
+/*
+    The cache_key_digest function returns the first 128 bits of the SHA-256 of data. Keys come from urls and headers anyone can
+    send, so finding a second text with the key of another is made as hard as the digest makes it: a cache entry cannot be poisoned
+    by a crafted url. Keys are short, the cost is a block or two per request.
+*/
+cache_key cache_key_digest(const char *data, size_t len)
+{
+    uint32_t state[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    const unsigned char *p = (const unsigned char *)data;
+    size_t rest = len;
+    for (; rest >= 64; p += 64, rest -= 64)
+    {
+        sha256_block(state, p);
+    }
+
+    unsigned char last[128] = {0}; // the remaining bytes, the padding and the length in bits, one block or two
+    memcpy(last, p, rest);
+    last[rest] = 0x80;
+    size_t last_len = rest + 9 <= 64 ? 64 : 128;
+    uint64_t bits = (uint64_t)len * 8;
+    for (int i = 0; i < 8; i++)
+    {
+        last[last_len - 1 - i] = (unsigned char)(bits >> (8 * i));
+    }
+    sha256_block(state, last);
+    if (last_len == 128)
+        sha256_block(state, last + 64);
+
+    cache_key key = {(uint64_t)state[0] << 32 | state[1], (uint64_t)state[2] << 32 | state[3]};
+    return key;
+}
@@ -0,0 +1,65 @@
+/*
+ * cache_key.h -- keys of the cached responses.
+ *
+ * A response is cached under its url in a canonical form, so that requests
+ * for the same resource share it however the client spelled the url and
+ * whatever else it sent: the scheme and host are in lower case, the default
+ * port is left out and percent-encoded bytes are written one way only. A
+ * response that varies on request headers is cached under the url followed
+ * by their values (see http_cache_variant()).
+ *
+ * The key itself is a 128-bit digest of that text, cut from its SHA-256.
+ * Every key is the same size, comparing two is comparing two pairs of
+ * integers, and the digest is spread enough that its halves serve as hashes
+ * for the tables directly. Clients choose the text, so the digest has to be
+ * one they cannot find a second text for: two keys are equal only if the
+ * texts are.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include "http_request.h"
+
+#ifndef CACHE_KEY
+#define CACHE_KEY
+
+typedef struct cache_key cache_key;
+
+struct cache_key
+{
+   uint64_t lo; // picks the bucket of a table
+   uint64_t hi; // picks the shard of the memory cache
+};
+
+#define CACHE_KEY_EQ(a, b) ((a).lo == (b).lo && (a).hi == (b).hi)
+
+/*
+   Write the canonical url of request to out, NUL terminated and truncated
+   to size bytes. Returns the length of the whole url, like snprintf().
+ */
+size_t cache_key_url(http_request *request, char *out, size_t size);
+
+/* Key of the len bytes of data */
+cache_key cache_key_digest(const char *data, size_t len);
+
+/*
+   A faster digest (MurmurHash3 x64_128) of data that arrives in pieces:
+   cache_digest_update() takes the next len bytes, cache_digest_final()
+   returns the digest of all of them. Response bodies are digested this way
+   as they are cached. It does not resist an attacker, bodies with the same
+   digest are only the same once their bytes are compared.
+ */
+typedef struct cache_digest cache_digest;
+
+struct cache_digest
+{
+   uint64_t h1, h2;         // the two lanes, the blocks mixed in so far
+   size_t len;              // bytes taken so far
+   unsigned char tail[16];  // the last len % 16 of them, not a whole block yet
+};
+
+void cache_digest_init(cache_digest *d);
+void cache_digest_update(cache_digest *d, const char *data, size_t len);
+cache_key cache_digest_final(cache_digest *d);
+
+#endif
@@ -0,0 +1,537 @@
+/*
+  cache_policy.c -- eviction policies of the memory cache.
+*/
+
+#include "cache_policy.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#define MIN_ELEMENT_SIZE 4096 // no element takes less, the tables are sized for a cache full of such elements
+#define MIN_ENTRIES 64
+#define PROTECTED_PERCENT 80  // share of the bytes of the main lists that are protected
+#define SKETCH_DEPTH 4        // counters an access increments, the estimate is the smallest
+#define SAMPLE_FACTOR 10      // the sketch is halved after this many accesses per entry
+#define DOORKEEPER_BITS 8     // bits of the doorkeeper per entry
+#define DOORKEEPER_HASHES 2
+
+// lists an element can be on, element->policy_list tells which
+enum
+{
+    LIST_PROBATION, // lru: the only list; slru and tinylfu: hit once since it was cached; arc: T1, likewise
+    LIST_PROTECTED, // slru and tinylfu: hit again; arc: T2, likewise
+    LIST_WINDOW,    // tinylfu: just cached
+    NLISTS
+};
+
+// ghost lists of arc, keys recently evicted from T1 and T2
+enum
+{
+    GHOST_RECENT,   // B1
+    GHOST_FREQUENT, // B2
+    NGHOSTS
+};
+
+typedef struct
+{
+    cache_element *head; // most recently used element
+    cache_element *tail; // least recently used element
+    size_t size;         // bytes of the elements on the list
+} policy_list;
+
+// the key of an element arc evicted, and its size
+typedef struct ghost ghost;
+struct ghost
+{
+    cache_key key;
+    size_t size;
+    int list;     // a GHOST_ list
+    ghost *hnext; // next ghost in the same bucket
+    ghost *prev;  // ghost evicted more recently
+    ghost *next;  // ghost evicted less recently
+};
+
+typedef struct
+{
+    ghost *head;
+    ghost *tail;
+    size_t size; // bytes the ghosts stood for
+} ghost_list;
+
+/*
+  Count-min sketch of the access frequency of keys. Every word holds sixteen
+  4-bit counters, a key maps to SKETCH_DEPTH of them and its estimate is the
+  smallest. Keys go through the doorkeeper first: the first access of a key
+  only sets its bits there, so the many keys seen once do not crowd the
+  counters. Both are aged together by halving the counters and clearing the
+  doorkeeper every sample accesses.
+*/
+typedef struct
+{
+    uint64_t *counters;
+    size_t mask;        // counters in the table, minus one
+    uint64_t *doorkeeper;
+    size_t door_mask;   // bits in the doorkeeper, minus one
+    size_t additions;   // accesses since the last halving
+    size_t sample;
+} sketch;
+
+struct cache_policy
+{
+    const char *name;
+    int window_percent; // share of the bytes of the window
+    int ghosts;         // remembers the keys it evicted
+    int counts;         // estimates the frequency of every key
+    void (*insert)(cache_policy_state *state, cache_element *element);
+    void (*hit)(cache_policy_state *state, cache_element *element);
+    cache_element *(*victim)(cache_policy_state *state);
+};
+
+struct cache_policy_state
+{
+    const cache_policy *policy;
+    size_t max_size;      // bytes of the cache
+    size_t window_max;    // bytes of the tinylfu window
+    size_t protected_max; // bytes of the protected list
+    policy_list lists[NLISTS];
+
+    size_t target;        // arc: bytes of T1 aimed at, moved by hits on the ghosts
+    ghost_list ghosts[NGHOSTS];
+    ghost **ghost_buckets;
+    size_t ghost_mask;
+
+    sketch freq;          // tinylfu
+};
+
+/*
+  Lists
+*/
+
+static void list_push_front(cache_policy_state *state, int list, cache_element *element)
+{
+    policy_list *l = &state->lists[list];
+    element->policy_list = list;
+    element->policy_prev = NULL;
+    element->policy_next = l->head;
+    if (l->head != NULL)
+        l->head->policy_prev = element;
+    else
+        l->tail = element;
+    l->head = element;
+    l->size += element->mem_size;
+}
+
+static void list_unlink(cache_policy_state *state, cache_element *element)
+{
+    policy_list *l = &state->lists[element->policy_list];
+    if (element->policy_prev != NULL)
+        element->policy_prev->policy_next = element->policy_next;
+    else
+        l->head = element->policy_next;
+    if (element->policy_next != NULL)
+        element->policy_next->policy_prev = element->policy_prev;
+    else
+        l->tail = element->policy_prev;
+    element->policy_prev = element->policy_next = NULL;
+    l->size -= element->mem_size;
+}
+
+// puts the element at the front of list, whichever list it was on
+static void list_move(cache_policy_state *state, int list, cache_element *element)
+{
+    list_unlink(state, element);
+    list_push_front(state, list, element);
+}
+
+/*
+  Ghosts
+*/
+
+static ghost **ghost_bucket(cache_policy_state *state, const cache_key *key)
+{
+    return &state->ghost_buckets[key->lo & state->ghost_mask];
+}
+
+static ghost *ghost_find(cache_policy_state *state, const cache_key *key)
+{
+    for (ghost *g = *ghost_bucket(state, key); g != NULL; g = g->hnext)
+    {
+        if (CACHE_KEY_EQ(g->key, *key))
+            return g;
+    }
+    return NULL;
+}
+
+static void ghost_remove(cache_policy_state *state, ghost *g)
+{
+    ghost **link = ghost_bucket(state, &g->key);
+    while (*link != g)
+    {
+        link = &(*link)->hnext;
+    }
+    *link = g->hnext;
+
+    ghost_list *l = &state->ghosts[g->list];
+    if (g->prev != NULL)
+        g->prev->next = g->next;
+    else
+        l->head = g->next;
+    if (g->next != NULL)
+        g->next->prev = g->prev;
+    else
+        l->tail = g->prev;
+    l->size -= g->size;
+    free(g);
+}
+
+// remembers that element is evicted from T1 (GHOST_RECENT) or T2 (GHOST_FREQUENT)
+static void ghost_add(cache_policy_state *state, int list, const cache_element *element)
+{
+    ghost *g = (ghost *)malloc(sizeof(ghost));
+    if (g == NULL) // the key is forgotten, arc adapts a little less
+        return;
+    g->key = element->key;
+    g->size = element->mem_size;
+    g->list = list;
+    ghost **bucket = ghost_bucket(state, &g->key);
+    g->hnext = *bucket;
+    *bucket = g;
+
+    ghost_list *l = &state->ghosts[list];
+    g->prev = NULL;
+    g->next = l->head;
+    if (l->head != NULL)
+        l->head->prev = g;
+    else
+        l->tail = g;
+    l->head = g;
+    l->size += g->size;
+}
+
+/*
+  Sketch
+*/
+
+// the i-th hash of key, the halves of the digest are independent enough to combine
+static uint64_t sketch_hash(const cache_key *key, int i)
+{
+    uint64_t h = key->lo + (uint64_t)i * (key->hi | 1);
+    return h ^ (h >> 29);
+}
+
+static int sketch_init(sketch *s, size_t entries)
+{
+    s->mask = entries * 16 - 1;
+    s->counters = (uint64_t *)calloc(entries, sizeof(uint64_t));
+    s->door_mask = entries * DOORKEEPER_BITS - 1;
+    s->doorkeeper = (uint64_t *)calloc(entries * DOORKEEPER_BITS / 64, sizeof(uint64_t));
+    s->additions = 0;
+    s->sample = entries * SAMPLE_FACTOR;
+    return s->counters != NULL && s->doorkeeper != NULL ? 0 : -1;
+}
+
+// the frequency of key, from 0 to 16
+static int sketch_frequency(const sketch *s, const cache_key *key)
+{
+    int freq = 15;
+    for (int i = 0; i < SKETCH_DEPTH; i++)
+    {
+        size_t index = sketch_hash(key, i) & s->mask;
+        int count = (s->counters[index >> 4] >> ((index & 15) * 4)) & 15;
+        if (count < freq)
+            freq = count;
+    }
+    int seen = 1;
+    for (int i = 0; i < DOORKEEPER_HASHES; i++)
+    {
+        size_t bit = sketch_hash(key, SKETCH_DEPTH + i) & s->door_mask;
+        seen &= (s->doorkeeper[bit >> 6] >> (bit & 63)) & 1;
+    }
+    return freq + seen;
+}
+
+// halves every counter and forgets the keys seen once, the recent past weighs as much as everything before it
+static void sketch_age(sketch *s)
+{
+    for (size_t i = 0; i <= s->mask >> 4; i++)
+    {
+        s->counters[i] = (s->counters[i] >> 1) & 0x7777777777777777ULL;
+    }
+    memset(s->doorkeeper, 0, (s->door_mask + 1) / 8);
+    s->additions /= 2;
+}
+
+static void sketch_add(sketch *s, const cache_key *key)
+{
+    int seen = 1;
+    for (int i = 0; i < DOORKEEPER_HASHES; i++)
+    {
+        size_t bit = sketch_hash(key, SKETCH_DEPTH + i) & s->door_mask;
+        seen &= (s->doorkeeper[bit >> 6] >> (bit & 63)) & 1;
+        s->doorkeeper[bit >> 6] |= 1ULL << (bit & 63);
+    }
+    if (seen)
+    {
+        for (int i = 0; i < SKETCH_DEPTH; i++)
+        {
+            size_t index = sketch_hash(key, i) & s->mask;
+            uint64_t *word = &s->counters[index >> 4];
+            int shift = (index & 15) * 4;
+            if (((*word >> shift) & 15) < 15)
+                *word += 1ULL << shift;
+        }
+    }
+    if (++s->additions >= s->sample)
+        sketch_age(s);
+}
+
+/*
+  lru
+*/
+
+static void lru_insert(cache_policy_state *state, cache_element *element)
+{
+    list_push_front(state, LIST_PROBATION, element);
+}
+
+static void lru_hit(cache_policy_state *state, cache_element *element)
+{
+    list_move(state, LIST_PROBATION, element);
+}
+
+static cache_element *lru_victim(cache_policy_state *state)
+{
+    return state->lists[LIST_PROBATION].tail;
+}
+
+/*
+  slru, also the main lists of tinylfu
+*/
+
+static void slru_insert(cache_policy_state *state, cache_element *element)
+{
+    list_push_front(state, LIST_PROBATION, element);
+}
+
+// a hit on probation earns the element a place on the protected list, which pushes its least recent element back on probation
+static void slru_hit(cache_policy_state *state, cache_element *element)
+{
+    list_move(state, LIST_PROTECTED, element);
+    policy_list *protected_list = &state->lists[LIST_PROTECTED];
+    while (protected_list->size > state->protected_max && protected_list->tail != element)
+    {
+        list_move(state, LIST_PROBATION, protected_list->tail);
+    }
+}
+
+static cache_element *slru_victim(cache_policy_state *state)
+{
+    if (state->lists[LIST_PROBATION].tail != NULL)
+        return state->lists[LIST_PROBATION].tail;
+    return state->lists[LIST_PROTECTED].tail;
+}
+
+/*
+  arc, with sizes in bytes rather than in elements
+*/
+
+/*
+    The arc_insert function puts a new element on T1, unless its key was evicted recently: the element then goes straight to T2, and
+    the target size of T1 grows if the key came from T1 (it was evicted too early from the recent list) or shrinks if it came from T2.
+*/
+static void arc_insert(cache_policy_state *state, cache_element *element)
+{
+    ghost *g = ghost_find(state, &element->key);
+    if (g == NULL)
+    {
+        list_push_front(state, LIST_PROBATION, element);
+        return;
+    }
+    size_t recent = state->ghosts[GHOST_RECENT].size;
+    size_t frequent = state->ghosts[GHOST_FREQUENT].size;
+    if (g->list == GHOST_RECENT)
+    {
+        size_t delta = element->mem_size * (frequent > recent ? frequent / recent : 1);
+        state->target = state->target + delta < state->max_size ? state->target + delta : state->max_size;
+    }
+    else
+    {
+        size_t delta = element->mem_size * (recent > frequent ? recent / frequent : 1);
+        state->target = state->target > delta ? state->target - delta : 0;
+    }
+    ghost_remove(state, g);
+    list_push_front(state, LIST_PROTECTED, element);
+}
+
+static void arc_hit(cache_policy_state *state, cache_element *element)
+{
+    list_move(state, LIST_PROTECTED, element);
+}
+
+// evicts from T1 while it is above its target, from T2 otherwise, and keeps the ghosts within the bounds of ARC
+static cache_element *arc_victim(cache_policy_state *state)
+{
+    policy_list *t1 = &state->lists[LIST_PROBATION];
+    policy_list *t2 = &state->lists[LIST_PROTECTED];
+    cache_element *victim;
+    if (t1->tail != NULL && (t1->size > state->target || t2->tail == NULL))
+    {
+        victim = t1->tail;
+        ghost_add(state, GHOST_RECENT, victim);
+    }
+    else if ((victim = t2->tail) != NULL)
+    {
+        ghost_add(state, GHOST_FREQUENT, victim);
+    }
+
+    ghost_list *b1 = &state->ghosts[GHOST_RECENT];
+    ghost_list *b2 = &state->ghosts[GHOST_FREQUENT];
+    while (b1->tail != NULL && t1->size + b1->size > state->max_size)
+    {
+        ghost_remove(state, b1->tail);
+    }
+    while (b2->tail != NULL && t1->size + t2->size + b1->size + b2->size > 2 * state->max_size)
+    {
+        ghost_remove(state, b2->tail);
+    }
+    return victim;
+}
+
+/*
+  tinylfu
+*/
+
+static void tinylfu_insert(cache_policy_state *state, cache_element *element)
+{
+    list_push_front(state, LIST_WINDOW, element);
+}
+
+static void tinylfu_hit(cache_policy_state *state, cache_element *element)
+{
+    if (element->policy_list == LIST_WINDOW)
+        list_move(state, LIST_WINDOW, element);
+    else
+        slru_hit(state, element);
+}
+
+/*
+    The tinylfu_victim function moves the elements that overflow the window to the main lists, as long as those have room. Once they
+    are full, the least recent element of the window only gets in by evicting the element the main lists would evict, and only if its
+    key was accessed more often: the loser of the two is the victim. Without overflow, the main lists evict as slru does.
+*/
+static cache_element *tinylfu_victim(cache_policy_state *state)
+{
+    policy_list *window = &state->lists[LIST_WINDOW];
+    size_t main_max = state->max_size - state->window_max;
+    while (window->tail != NULL && window->size > state->window_max)
+    {
+        cache_element *candidate = window->tail;
+        cache_element *victim = slru_victim(state);
+        size_t main_size = state->lists[LIST_PROBATION].size + state->lists[LIST_PROTECTED].size;
+        if (victim != NULL && main_size + candidate->mem_size > main_max)
+        {
+            if (sketch_frequency(&state->freq, &candidate->key) <= sketch_frequency(&state->freq, &victim->key))
+                return candidate;
+            list_move(state, LIST_PROBATION, candidate);
+            return victim;
+        }
+        list_move(state, LIST_PROBATION, candidate);
+    }
+    cache_element *victim = slru_victim(state);
+    return victim != NULL ? victim : window->tail;
+}
+
+static const cache_policy policies[] = {
+    {"lru", 0, 0, 0, lru_insert, lru_hit, lru_victim},
+    {"slru", 0, 0, 0, slru_insert, slru_hit, slru_victim},
+    {"arc", 0, 1, 0, arc_insert, arc_hit, arc_victim},
+    {"tinylfu", 1, 0, 1, tinylfu_insert, tinylfu_hit, tinylfu_victim},
+};
+
+const cache_policy *cache_policy_find(const char *name)
+{
+    for (size_t i = 0; i < sizeof(policies) / sizeof(policies[0]); i++)
+    {
+        if (strcmp(policies[i].name, name) == 0)
+            return &policies[i];
+    }
+    return NULL;
+}
+
+const char *cache_policy_name(const cache_policy *policy)
+{
+    return policy->name;
+}
+
+cache_policy_state *cache_policy_create(const cache_policy *policy, size_t max_size)
+{
+    cache_policy_state *state = (cache_policy_state *)calloc(1, sizeof(cache_policy_state));
+    if (state == NULL)
+        return NULL;
+    state->policy = policy;
+    state->max_size = max_size;
+    state->window_max = max_size * policy->window_percent / 100;
+    state->protected_max = (max_size - state->window_max) * PROTECTED_PERCENT / 100;
+
+    size_t entries = MIN_ENTRIES; // a power of two, at least as many as elements fit
+    while (entries < max_size / MIN_ELEMENT_SIZE)
+    {
+        entries *= 2;
+    }
+    int failed = 0;
+    if (policy->ghosts)
+    {
+        state->ghost_mask = entries - 1;
+        state->ghost_buckets = (ghost **)calloc(entries, sizeof(ghost *));
+        failed = state->ghost_buckets == NULL;
+    }
+    if (policy->counts)
+        failed = sketch_init(&state->freq, entries) < 0;
+    if (failed)
+    {
+        cache_policy_destroy(state);
+        return NULL;
+    }
+    return state;
+}
+
+void cache_policy_destroy(cache_policy_state *state)
+{
+    for (int i = 0; i < NGHOSTS; i++)
+    {
+        while (state->ghosts[i].tail != NULL)
+        {
+            ghost_remove(state, state->ghosts[i].tail);
+        }
+    }
+    free(state->ghost_buckets);
+    free(state->freq.counters);
+    free(state->freq.doorkeeper);
+    free(state);
+}
+
+void cache_policy_access(cache_policy_state *state, const cache_key *key)
+{
+    if (state->policy->counts)
+        sketch_add(&state->freq, key);
+}
+
+void cache_policy_insert(cache_policy_state *state, cache_element *element)
+{
+    state->policy->insert(state, element);
+}
+
+void cache_policy_hit(cache_policy_state *state, cache_element *element)
+{
+    state->policy->hit(state, element);
+}
+
+void cache_policy_remove(cache_policy_state *state, cache_element *element)
+{
+    list_unlink(state, element);
+}
+
+cache_element *cache_policy_victim(cache_policy_state *state)
+{
+    return state->policy->victim(state);
+}
@@ -0,0 +1,69 @@
+/*
+ * cache_policy.h -- eviction policies of the memory cache.
+ *
+ * Every shard of the cache (see cache.h) asks its policy which element to
+ * evict when it needs room. The policy keeps the cached elements of the shard
+ * on lists of its own, linked through the policy fields of the elements, and
+ * is told about every lookup, insertion, hit and removal. All of it happens
+ * under the shard lock. The policy is picked by name at startup:
+ *
+ * lru:     one list in order of recency, the least recently used element
+ *          is evicted. A scan of cold urls flushes everything else.
+ * slru:    segmented LRU. New elements go on a probation list and move to a
+ *          protected one (80% of the bytes) when they are hit again, so only
+ *          elements that were hit more than once survive a scan.
+ * arc:     adaptive replacement cache. Like slru, but the share of the two
+ *          lists adapts to the workload, guided by ghost entries that
+ *          remember the keys recently evicted from each.
+ * tinylfu: W-TinyLFU. New elements enter a small LRU window (1% of the
+ *          bytes). An element pushed out of the window only enters the main
+ *          segmented LRU if it was requested more often than the element it
+ *          would evict there, as estimated by a count-min sketch of 4-bit
+ *          counters that is halved regularly so old popularity fades. A
+ *          doorkeeper Bloom filter keeps keys seen only once out of the
+ *          sketch.
+ *
+ * The functions work on a single state and know nothing else of the cache,
+ * so the trace-driven simulator (cache_sim.c) runs the very same code.
+ */
+
+#include <stddef.h>
+#include "cache.h"
+
+#ifndef CACHE_POLICY
+#define CACHE_POLICY
+
+typedef struct cache_policy cache_policy;
+typedef struct cache_policy_state cache_policy_state;
+
+#define CACHE_POLICY_DEFAULT "tinylfu"
+#define CACHE_POLICY_NAMES "lru, slru, arc, tinylfu"
+
+/* The policy called name, NULL if there is none */
+const cache_policy *cache_policy_find(const char *name);
+
+const char *cache_policy_name(const cache_policy *policy);
+
+/* State of policy for a cache of max_size bytes, NULL if it could not be
+ * allocated */
+cache_policy_state *cache_policy_create(const cache_policy *policy, size_t max_size);
+void cache_policy_destroy(cache_policy_state *state);
+
+/* key is looked up, whether it is cached or not */
+void cache_policy_access(cache_policy_state *state, const cache_key *key);
+
+/* element was cached, with its final mem_size */
+void cache_policy_insert(cache_policy_state *state, cache_element *element);
+
+/* A lookup found element */
+void cache_policy_hit(cache_policy_state *state, cache_element *element);
+
+/* element is not cached anymore, evicted or not */
+void cache_policy_remove(cache_policy_state *state, cache_element *element);
+
+/* The element to evict next, NULL if none is cached. The caller must remove
+ * it right away: the policy may already have moved other elements around,
+ * or remembered it as evicted. */
+cache_element *cache_policy_victim(cache_policy_state *state);
+
+#endif
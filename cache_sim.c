@@ -0,0 +1,238 @@
+/*
+  cache_sim.c -- replays a trace of requests against the eviction policies.
+
+  Usage: cache_sim [-c megabytes] [-s shards] [-p policy] [trace...]
+
+  Every line of a trace (standard input if none is given) is a url, optionally
+  followed by the size of its response in bytes. The cache is split into
+  shards like the memory cache of the proxy, every request is a hit or a miss,
+  and a miss caches the response at once. The hit ratio and byte hit ratio of
+  every policy (or only of the one given with -p) are printed at the end. The
+  urls and sizes of a common or combined access log are fields 7 and 10:
+
+      awk '{ print $7, $10 }' access.log | ./cache_sim -c 64
+*/
+
+#include "cache_policy.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SIM_LINE_MAX 8192
+#define SIM_DEFAULT_SIZE 16384 // bytes of a response the trace gives no size for
+#define SIM_ITEM_SIZE 4096     // elements are accounted in slab items of at least this size
+
+typedef struct
+{
+    char *url;
+    size_t size;
+} sim_request;
+
+typedef struct
+{
+    cache_policy_state *policy;
+    cache_element **buckets;
+    size_t mask;
+    size_t cache_size;
+    size_t max_size;
+} sim_shard;
+
+// reads the requests of a trace into *requests, returns -1 if it could not be read
+static int read_trace(FILE *file, sim_request **requests, size_t *count, size_t *capacity)
+{
+    char line[SIM_LINE_MAX];
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        char *url = strtok(line, " \t\r\n");
+        if (url == NULL)
+            continue;
+        char *size = strtok(NULL, " \t\r\n");
+        long bytes = size != NULL ? atol(size) : 0;
+        if (*count == *capacity)
+        {
+            size_t grown = *capacity ? *capacity * 2 : 4096;
+            sim_request *more = (sim_request *)realloc(*requests, grown * sizeof(sim_request));
+            if (more == NULL)
+                return -1;
+            *requests = more;
+            *capacity = grown;
+        }
+        sim_request *request = &(*requests)[(*count)++];
+        request->url = strdup(url);
+        request->size = bytes > 0 ? (size_t)bytes : SIM_DEFAULT_SIZE;
+        if (request->url == NULL)
+            return -1;
+    }
+    return ferror(file) ? -1 : 0;
+}
+
+static cache_element **find_bucket(sim_shard *shard, const cache_key *key)
+{
+    cache_element **link = &shard->buckets[key->lo & shard->mask];
+    while (*link != NULL && !CACHE_KEY_EQ((*link)->key, *key))
+    {
+        link = &(*link)->hnext;
+    }
+    return link;
+}
+
+/*
+    The simulate function replays the requests against the policy in a cache of max_size bytes split into nshards shards, the way
+    cache_lookup() and cache_fill_commit() use the policy: every lookup is counted, a hit is reported, and a miss evicts what the
+    policy picks until the response fits, then caches it.
+*/
+static int simulate(const cache_policy *policy, const sim_request *requests, size_t count, size_t max_size, int nshards)
+{
+    sim_shard *shards = (sim_shard *)calloc(nshards, sizeof(sim_shard));
+    if (shards == NULL)
+        return -1;
+    size_t buckets = 64;
+    while (buckets < max_size / nshards / SIM_ITEM_SIZE)
+    {
+        buckets *= 2;
+    }
+    for (int i = 0; i < nshards; i++)
+    {
+        shards[i].max_size = max_size / nshards;
+        shards[i].policy = cache_policy_create(policy, shards[i].max_size);
+        shards[i].buckets = (cache_element **)calloc(buckets, sizeof(cache_element *));
+        shards[i].mask = buckets - 1;
+        if (shards[i].policy == NULL || shards[i].buckets == NULL)
+            return -1;
+    }
+
+    size_t hits = 0;
+    size_t bytes = 0, hit_bytes = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        cache_key key = cache_key_digest(requests[i].url, strlen(requests[i].url));
+        sim_shard *shard = &shards[key.hi & (nshards - 1)];
+        size_t size = requests[i].size;
+        bytes += size;
+
+        cache_policy_access(shard->policy, &key);
+        cache_element **link = find_bucket(shard, &key);
+        if (*link != NULL)
+        {
+            cache_policy_hit(shard->policy, *link);
+            hits++;
+            hit_bytes += size;
+            continue;
+        }
+
+        size_t mem_size = sizeof(cache_element) + (size + SIM_ITEM_SIZE - 1) / SIM_ITEM_SIZE * SIM_ITEM_SIZE;
+        if (mem_size > shard->max_size)
+            continue; // too large to cache at all
+        while (shard->cache_size + mem_size > shard->max_size)
+        {
+            cache_element *victim = cache_policy_victim(shard->policy);
+            if (victim == NULL)
+                break;
+            cache_policy_remove(shard->policy, victim);
+            *find_bucket(shard, &victim->key) = victim->hnext;
+            shard->cache_size -= victim->mem_size;
+            free(victim);
+        }
+        cache_element *element = (cache_element *)calloc(1, sizeof(cache_element));
+        if (element == NULL)
+            return -1;
+        element->key = key;
+        element->mem_size = mem_size;
+        link = find_bucket(shard, &key); // evictions may have unlinked what it pointed to
+        *link = element;
+        shard->cache_size += mem_size;
+        cache_policy_insert(shard->policy, element);
+    }
+
+    printf("%-8s %10zu requests %10zu hits  hit ratio %6.2f%%  byte hit ratio %6.2f%%\n", cache_policy_name(policy), count, hits,
+           count ? 100.0 * hits / count : 0.0, bytes ? 100.0 * hit_bytes / bytes : 0.0);
+
+    for (int i = 0; i < nshards; i++)
+    {
+        for (size_t b = 0; b <= shards[i].mask; b++)
+        {
+            while (shards[i].buckets[b] != NULL)
+            {
+                cache_element *element = shards[i].buckets[b];
+                shards[i].buckets[b] = element->hnext;
+                free(element);
+            }
+        }
+        free(shards[i].buckets);
+        cache_policy_destroy(shards[i].policy);
+    }
+    free(shards);
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s [-c megabytes] [-s shards] [-p policy] [trace...]\n", prog);
+    printf("  -c megabytes  size of the simulated cache (default: %d)\n", MAX_SIZE >> 20);
+    printf("  -s shards     number of shards, rounded up to a power of two (default: 1)\n");
+    printf("  -p policy     only simulate policy, one of %s (default: all of them)\n", CACHE_POLICY_NAMES);
+}
+
+int main(int argc, char *const argv[])
+{
+    size_t max_size = (size_t)(MAX_SIZE);
+    int nshards = 1;
+    const char *only = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "c:s:p:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'c':
+            max_size = (size_t)atol(optarg) << 20;
+            break;
+        case 's':
+            while (nshards < atoi(optarg))
+                nshards *= 2;
+            break;
+        case 'p':
+            only = optarg;
+            if (cache_policy_find(only) == NULL)
+            {
+                printf("Unknown policy %s, use one of %s\n", only, CACHE_POLICY_NAMES);
+                exit(1);
+            }
+            break;
+        default:
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+
+    sim_request *requests = NULL;
+    size_t count = 0, capacity = 0;
+    if (optind == argc && read_trace(stdin, &requests, &count, &capacity) < 0)
+    {
+        printf("Failed to read the trace from standard input\n");
+        exit(1);
+    }
+    for (int i = optind; i < argc; i++)
+    {
+        FILE *file = fopen(argv[i], "r");
+        if (file == NULL || read_trace(file, &requests, &count, &capacity) < 0)
+        {
+            printf("Failed to read the trace %s\n", argv[i]);
+            exit(1);
+        }
+        fclose(file);
+    }
+
+    const char *names[] = {"lru", "slru", "arc", "tinylfu"};
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+    {
+        if (only != NULL && strcmp(only, names[i]) != 0)
+            continue;
+        if (simulate(cache_policy_find(names[i]), requests, count, max_size, nshards) < 0)
+        {
+            printf("Out of memory simulating %s\n", names[i]);
+            exit(1);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,329 @@
+/*
+  cache_stress.c -- drives lookups, fills and eviction of the memory cache
+  from many threads at once.
+
+  Usage: cache_stress [-t threads] [-n iterations] [-k keys] [-s shards] [-p policy]
+
+  The cache is built into this program with a small MAX_SIZE, so the working
+  set of keys is many times what fits and nearly every fill evicts. Every
+  response is derived from its key, so a reader can tell when it got the
+  bytes of another response, or bytes freed under it. A quarter of the keys
+  end with one of a few bodies, which the cache shares between them. Once
+  every thread is done, the shards are checked: each one must account
+  exactly for the elements it holds, stay within its share of MAX_SIZE and
+  have nothing left in flight, and every cached element must be complete and
+  referenced by the cache alone. Every shared body must be referenced by the
+  elements ending with it alone, and accounted for once. The exit status is 1
+  if anything was wrong.
+*/
+
+#define MAX_SIZE (32 * (1 << 20)) // about a thousand responses, for thousands of keys
+#define MAX_ELEMENT_SIZE (1 << 20) // far above the largest response, and small enough for up to 32 shards
+#include "cache.c"
+
+#define STRESS_MIN_LEN 512
+#define STRESS_MAX_LEN (60 * 1024)
+#define STRESS_PIECE 1500 // bytes appended at once, like the payload of a packet
+#define STRESS_HEAD 256   // bytes of the response before a shared body
+#define STRESS_BODIES 64  // distinct bodies shared by the keys that are multiples of 4
+
+typedef struct
+{
+    int iterations;
+    int nkeys;
+    unsigned int seed;
+    size_t hits, fills, follows, errors;
+} stress_thread;
+
+// which body the response of key i ends with, -1 if it has one of its own
+static int shared_body(int i)
+{
+    return i % 4 == 0 ? i / 4 % STRESS_BODIES : -1;
+}
+
+// the length of the response of key i, from a few hundred bytes to the largest chunk
+static size_t response_len(int i)
+{
+    int body = shared_body(i);
+    if (body >= 0)
+        return STRESS_HEAD + CACHE_BODY_MIN + (size_t)body * 512;
+    return STRESS_MIN_LEN + (size_t)i * 7919 % (STRESS_MAX_LEN - STRESS_MIN_LEN);
+}
+
+static char response_byte(int i, size_t pos)
+{
+    int body = shared_body(i);
+    if (body >= 0 && pos >= STRESS_HEAD) // the same for every key ending with the body
+        return (char)((body * 31 + pos * 7) & 0xff);
+    return (char)((i * 131 + pos) & 0xff);
+}
+
+static cache_key response_key(int i)
+{
+    char url[32];
+    int len = snprintf(url, sizeof(url), "stress/%d", i);
+    return cache_key_digest(url, len);
+}
+
+// checks the published bytes of element against the response of key i, returns -1 if one differs
+static int check_element(cache_element *element, int i)
+{
+    int complete = cache_element_state(element) == CACHE_COMPLETE; // before the data, see cache_element_state()
+    cache_cursor cursor;
+    struct iovec iov[8];
+    int iovcnt;
+    cache_cursor_init(&cursor, element);
+    while ((iovcnt = cache_cursor_iov(&cursor, iov, 8)) > 0)
+    {
+        for (int v = 0; v < iovcnt; v++)
+        {
+            const char *data = (const char *)iov[v].iov_base;
+            for (size_t j = 0; j < iov[v].iov_len; j++)
+            {
+                if (data[j] != response_byte(i, cursor.pos + j))
+                    return -1;
+            }
+            cache_cursor_advance(&cursor, iov[v].iov_len);
+        }
+    }
+    return complete && cursor.pos != response_len(i) ? -1 : 0;
+}
+
+// fills element with the response of key i, commits it or once in a while gives up on it
+static void fill_element(stress_thread *t, cache_element *element, int i)
+{
+    char piece[STRESS_PIECE];
+    size_t len = response_len(i);
+    size_t n;
+    for (size_t pos = 0; pos < len; pos += n)
+    {
+        n = len - pos < STRESS_PIECE ? len - pos : STRESS_PIECE;
+        if (shared_body(i) >= 0 && pos < STRESS_HEAD) // the head alone, then the body is marked
+            n = STRESS_HEAD - pos;
+        else if (shared_body(i) >= 0 && pos == STRESS_HEAD)
+            cache_fill_body(element);
+        for (size_t j = 0; j < n; j++)
+            piece[j] = response_byte(i, pos + j);
+        if (cache_fill_append(element, piece, n) < 0)
+        {
+            cache_fill_abandon(element);
+            return;
+        }
+    }
+    if (rand_r(&t->seed) % 32 == 0) // the remote server failed at the last moment
+    {
+        cache_fill_abandon(element);
+        return;
+    }
+    time_t now = time(NULL);
+    cache_freshness freshness;
+    int stale = rand_r(&t->seed) % 8 == 0; // served stale right away, and revalidated
+    freshness.expires = stale ? now - 1 : now + 3600;
+    freshness.stale_until = now + 3600;
+    freshness.error_until = 0;
+    freshness.received = now;
+    cache_fill_freshness(element, &freshness);
+    cache_fill_validators(element, "\"stress\"", -1);
+    cache_fill_commit(element);
+}
+
+static void *stress_thread_main(void *arg)
+{
+    stress_thread *t = (stress_thread *)arg;
+    for (int n = 0; n < t->iterations; n++)
+    {
+        // a skewed popularity: the low keys are asked for far more often than the high ones
+        int r = rand_r(&t->seed) % t->nkeys;
+        int i = rand_r(&t->seed) % 2 ? r : r % (t->nkeys / 16 + 1);
+        cache_key key = response_key(i);
+        int status;
+        cache_element *stale;
+        cache_element *element = cache_lookup(&key, &status, &stale);
+        if (stale != NULL)
+            release_cache_element(stale);
+        if (element == NULL)
+            continue; // no memory for an element, the response would be relayed without caching it
+        if (status == CACHE_FILL)
+        {
+            t->fills++;
+            fill_element(t, element, i);
+            continue;
+        }
+        if (status == CACHE_FOLLOW)
+            t->follows++;
+        else
+            t->hits++;
+        if (check_element(element, i) < 0)
+            t->errors++;
+        release_cache_element(element);
+        if (status == CACHE_STALE)
+        {
+            cache_element *fill = cache_refresh(&key, &stale, 0);
+            if (fill != NULL)
+            {
+                release_cache_element(stale);
+                t->fills++;
+                fill_element(t, fill, i);
+            }
+        }
+    }
+    return NULL;
+}
+
+// checks the accounting of every shard once no thread uses the cache anymore, returns the number of problems found
+static int check_shards()
+{
+    int problems = 0;
+    for (size_t s = 0; s < nshards; s++)
+    {
+        cache_shard *shard = &shards[s];
+        size_t mem_size = 0, count = 0;
+        for (size_t b = 0; b < shard->nbuckets; b++)
+        {
+            for (cache_element *element = shard->buckets[b]; element != NULL; element = element->hnext)
+            {
+                if (element->refcount != 1 || element->state != CACHE_COMPLETE)
+                {
+                    fprintf(stderr, "shard %zu: element with %d references in state %d\n", s, element->refcount, element->state);
+                    problems++;
+                }
+                mem_size += element->mem_size;
+                count++;
+            }
+        }
+        for (size_t b = 0; b < INFLIGHT_BUCKETS; b++)
+        {
+            if (shard->inflight[b] != NULL)
+            {
+                fprintf(stderr, "shard %zu: a fill is still in flight\n", s);
+                problems++;
+            }
+        }
+        if (mem_size != shard->cache_size || count != shard->nelements || shard->cache_size > shard->max_size)
+        {
+            fprintf(stderr, "shard %zu: %zu elements of %zu bytes, accounted as %zu elements of %zu bytes out of %zu\n", s, count, mem_size,
+                    shard->nelements, shard->cache_size, shard->max_size);
+            problems++;
+        }
+    }
+    return problems;
+}
+
+// checks the shared bodies against the elements ending with them, returns the number of problems found
+static int check_bodies()
+{
+    int problems = 0;
+    size_t mem_size = 0;
+    for (size_t b = 0; b < BODY_BUCKETS; b++)
+    {
+        for (cache_body *body = bodies.buckets[b]; body != NULL; body = body->hnext)
+        {
+            int refs = 0;
+            for (size_t s = 0; s < nshards; s++)
+            {
+                for (size_t e = 0; e < shards[s].nbuckets; e++)
+                {
+                    for (cache_element *element = shards[s].buckets[e]; element != NULL; element = element->hnext)
+                        refs += element->body == body;
+                }
+            }
+            if (refs != body->refcount)
+            {
+                fprintf(stderr, "body of %zu bytes with %d references, %d elements end with it\n", body->len, body->refcount, refs);
+                problems++;
+            }
+            mem_size += body->mem_size;
+        }
+    }
+    if (mem_size != bodies.mem_size)
+    {
+        fprintf(stderr, "bodies of %zu bytes, accounted as %zu bytes\n", mem_size, bodies.mem_size);
+        problems++;
+    }
+    return problems;
+}
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s [-t threads] [-n iterations] [-k keys] [-s shards] [-p policy]\n", prog);
+    printf("  -t threads     threads using the cache at once (default: 16)\n");
+    printf("  -n iterations  lookups per thread (default: 5000)\n");
+    printf("  -k keys        distinct keys looked up (default: 4096)\n");
+    printf("  -s shards      number of shards, rounded up to a power of two (default: 8)\n");
+    printf("  -p policy      eviction policy, one of %s (default: %s)\n", CACHE_POLICY_NAMES, CACHE_POLICY_DEFAULT);
+}
+
+int main(int argc, char *const argv[])
+{
+    int nthreads = 16, iterations = 5000, nkeys = 4096, count = 8;
+    const char *policy = CACHE_POLICY_DEFAULT;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:n:k:s:p:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        case 'n':
+            iterations = atoi(optarg);
+            break;
+        case 'k':
+            nkeys = atoi(optarg);
+            break;
+        case 's':
+            count = atoi(optarg);
+            break;
+        case 'p':
+            policy = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+    if (nthreads < 1 || iterations < 1 || nkeys < 1 || count < 1 || cache_init(count, policy) < 0)
+    {
+        usage(argv[0]);
+        exit(1);
+    }
+    if (freopen("/dev/null", "w", stdout) == NULL) // the cache logs every lookup
+    {
+        perror("Error in silencing the log of the cache");
+        exit(1);
+    }
+
+    stress_thread *threads = (stress_thread *)calloc(nthreads, sizeof(stress_thread));
+    pthread_t *tids = (pthread_t *)calloc(nthreads, sizeof(pthread_t));
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < nthreads; i++)
+    {
+        threads[i].iterations = iterations;
+        threads[i].nkeys = nkeys;
+        threads[i].seed = 12345 + i;
+        if (pthread_create(&tids[i], NULL, stress_thread_main, &threads[i]) != 0)
+        {
+            perror("Error in creating a thread");
+            exit(1);
+        }
+    }
+    size_t hits = 0, fills = 0, follows = 0, errors = 0;
+    for (int i = 0; i < nthreads; i++)
+    {
+        pthread_join(tids[i], NULL);
+        hits += threads[i].hits;
+        fills += threads[i].fills;
+        follows += threads[i].follows;
+        errors += threads[i].errors;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    int problems = check_shards() + check_bodies();
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stderr, "%d threads, %zu hits, %zu followers, %zu fills in %.2fs, %zu bad responses, %d accounting problems\n", nthreads, hits,
+            follows, fills, seconds, errors, problems);
+    free(tids);
+    free(threads);
+    return errors > 0 || problems > 0 ? 1 : 0;
+}
@@ -0,0 +1,497 @@
+/*
+  disk_cache.c -- second tier of the cache, kept on disk.
+*/
+
+#include "disk_cache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#define INDEX_BUCKETS 65536 // must be a power of two
+#define RECORD_MAGIC 0x35435850u // "PXC5"
+#define RECORD_FILLING 0   // the response is being written, or the fill was abandoned
+#define RECORD_COMPLETE 1  // the response is whole
+#define RECORD_KEEP_ALIVE 1 // flag: the response leaves the connection open
+
+typedef struct disk_entry disk_entry;
+
+/*
+  Every record of a segment is a header, the key and the response, one after
+  the other. The state is rewritten once the response is complete, a record
+  still filling when the proxy stopped is skipped by the scan, and so is a
+  record gone stale.
+*/
+struct disk_record
+{
+    uint32_t magic;   // RECORD_MAGIC
+    uint32_t state;   // RECORD_FILLING or RECORD_COMPLETE
+    uint32_t key_len; // bytes of the key following the header, the size of a cache_key
+    uint32_t flags;   // RECORD_KEEP_ALIVE
+    uint64_t len;     // bytes of the response following the key
+    int64_t expires;  // time the response stops being fresh
+    int64_t received; // time its Age counts from
+};
+
+struct disk_segment
+{
+    unsigned id;           // number of the segment, the file is <dir>/<id>.seg
+    int fd;
+    off_t size;            // bytes of the file reserved by records
+    int refcount;          // objects pointing into the segment
+    int deleted;           // the file was unlinked, the segment is freed with its last object
+    disk_entry *entries;   // records of the segment in the index
+    disk_segment *newer;   // segments of the log, oldest first
+};
+
+struct disk_entry
+{
+    cache_key key;
+    disk_segment *segment;
+    off_t record;         // offset of the record in the segment
+    size_t len;           // length of the response
+    int keep_alive;
+    time_t expires;       // the response is stale from then on, a lookup then drops it
+    time_t received;      // its Age counts from then
+    disk_entry *hnext;    // next entry in the same bucket
+    disk_entry *seg_prev; // entries of the same segment
+    disk_entry *seg_next;
+};
+
+static struct
+{
+    pthread_mutex_t lock;   // protects everything below and the segments
+    int enabled;
+    char *dir;
+    size_t max_size;
+    size_t size;            // bytes reserved by all segments
+    unsigned next_id;       // number of the next segment
+    disk_segment *oldest;   // deleted first
+    disk_segment *newest;   // receives new records
+    disk_entry **buckets;   // index of the complete records
+} disk = {PTHREAD_MUTEX_INITIALIZER};
+
+static off_t data_offset(off_t record)
+{
+    return record + sizeof(struct disk_record) + sizeof(cache_key);
+}
+
+/*
+  Index helpers, the caller holds disk.lock
+*/
+
+static disk_entry **index_find(const cache_key *key)
+{
+    disk_entry **link = &disk.buckets[key->lo & (INDEX_BUCKETS - 1)];
+    while (*link != NULL && !CACHE_KEY_EQ((*link)->key, *key))
+    {
+        link = &(*link)->hnext;
+    }
+    return link;
+}
+
+// removes the entry from the index and from its segment, and frees it
+static void index_remove(disk_entry **link)
+{
+    disk_entry *entry = *link;
+    *link = entry->hnext;
+    if (entry->seg_prev != NULL)
+        entry->seg_prev->seg_next = entry->seg_next;
+    else
+        entry->segment->entries = entry->seg_next;
+    if (entry->seg_next != NULL)
+        entry->seg_next->seg_prev = entry->seg_prev;
+    free(entry);
+}
+
+// indexes a complete record, replacing an older response for the same key
+static void index_insert(const cache_key *key, disk_segment *segment, off_t record, size_t len, int keep_alive, time_t expires, time_t received)
+{
+    disk_entry **link = index_find(key);
+    if (*link != NULL)
+    {
+        index_remove(link);
+    }
+
+    disk_entry *entry = (disk_entry *)malloc(sizeof(disk_entry));
+    if (entry == NULL)
+        return;
+    entry->key = *key;
+    entry->segment = segment;
+    entry->record = record;
+    entry->len = len;
+    entry->keep_alive = keep_alive;
+    entry->expires = expires;
+    entry->received = received;
+    entry->hnext = disk.buckets[key->lo & (INDEX_BUCKETS - 1)];
+    disk.buckets[key->lo & (INDEX_BUCKETS - 1)] = entry;
+    entry->seg_prev = NULL;
+    entry->seg_next = segment->entries;
+    if (segment->entries != NULL)
+        segment->entries->seg_prev = entry;
+    segment->entries = entry;
+}
+
+/*
+  Segment helpers, the caller holds disk.lock
+*/
+
+static void segment_path(char *path, size_t size, unsigned id)
+{
+    snprintf(path, size, "%s/%08u.seg", disk.dir, id);
+}
+
+// appends a segment to the log
+static disk_segment *segment_add(unsigned id, int fd, off_t size)
+{
+    disk_segment *segment = (disk_segment *)calloc(1, sizeof(disk_segment));
+    if (segment == NULL)
+        return NULL;
+    segment->id = id;
+    segment->fd = fd;
+    segment->size = size;
+    if (disk.newest != NULL)
+        disk.newest->newer = segment;
+    else
+        disk.oldest = segment;
+    disk.newest = segment;
+    disk.size += size;
+    if (id >= disk.next_id)
+        disk.next_id = id + 1;
+    return segment;
+}
+
+// creates the file of a new segment that receives the next records
+static disk_segment *segment_create()
+{
+    char path[4096];
+    segment_path(path, sizeof(path), disk.next_id);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        perror("Error in creating a disk cache segment");
+        return NULL;
+    }
+    disk_segment *segment = segment_add(disk.next_id, fd, 0);
+    if (segment == NULL)
+    {
+        close(fd);
+        unlink(path);
+    }
+    return segment;
+}
+
+// deletes the oldest segment and forgets the responses it holds, objects reading it keep it open
+static void segment_delete_oldest()
+{
+    disk_segment *segment = disk.oldest;
+    disk.oldest = segment->newer;
+    if (disk.oldest == NULL)
+        disk.newest = NULL;
+    disk.size -= segment->size;
+
+    while (segment->entries != NULL)
+    {
+        disk_entry *entry = segment->entries;
+        index_remove(index_find(&entry->key));
+    }
+    char path[4096];
+    segment_path(path, sizeof(path), segment->id);
+    unlink(path);
+    segment->deleted = 1;
+    if (segment->refcount == 0)
+    {
+        close(segment->fd);
+        free(segment);
+    }
+}
+
+// indexes the complete records of a segment read at startup, stops at the first damaged one
+static void segment_scan(disk_segment *segment)
+{
+    off_t pos = 0;
+    time_t now = time(NULL);
+    while (pos + (off_t)sizeof(struct disk_record) <= segment->size)
+    {
+        struct disk_record header;
+        if (pread(segment->fd, &header, sizeof(header), pos) != (ssize_t)sizeof(header) || header.magic != RECORD_MAGIC ||
+            header.key_len != sizeof(cache_key))
+            break;
+        off_t end = data_offset(pos) + (off_t)header.len;
+        if (end > segment->size)
+            break; // cut short by a crash
+        if (header.state == RECORD_COMPLETE && header.expires > now)
+        {
+            cache_key key;
+            if (pread(segment->fd, &key, sizeof(key), pos + sizeof(header)) == (ssize_t)sizeof(key))
+            {
+                index_insert(&key, segment, pos, header.len, (header.flags & RECORD_KEEP_ALIVE) != 0, header.expires, header.received); // later records replace earlier ones
+            }
+        }
+        pos = end;
+    }
+}
+
+static int compare_ids(const void *a, const void *b)
+{
+    unsigned x = *(const unsigned *)a, y = *(const unsigned *)b;
+    return x < y ? -1 : x > y;
+}
+
+// opens the segments found in the directory, oldest first, and indexes their records
+static void load_segments()
+{
+    DIR *dir = opendir(disk.dir);
+    if (dir == NULL)
+        return;
+    unsigned *ids = NULL;
+    size_t count = 0, capacity = 0;
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL)
+    {
+        unsigned id;
+        char suffix[8];
+        if (sscanf(ent->d_name, "%u.%7s", &id, suffix) != 2 || strcmp(suffix, "seg") != 0)
+            continue;
+        if (count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 64;
+            unsigned *grown = (unsigned *)realloc(ids, capacity * sizeof(unsigned));
+            if (grown == NULL)
+                break;
+            ids = grown;
+        }
+        ids[count++] = id;
+    }
+    closedir(dir);
+    qsort(ids, count, sizeof(unsigned), compare_ids);
+
+    size_t responses = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        char path[4096];
+        segment_path(path, sizeof(path), ids[i]);
+        int fd = open(path, O_RDWR | O_CLOEXEC);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) < 0)
+        {
+            if (fd >= 0)
+                close(fd);
+            continue;
+        }
+        disk_segment *segment = segment_add(ids[i], fd, st.st_size);
+        if (segment == NULL)
+        {
+            close(fd);
+            continue;
+        }
+        segment_scan(segment);
+        for (disk_entry *entry = segment->entries; entry != NULL; entry = entry->seg_next)
+            responses++;
+    }
+    free(ids);
+
+    while (disk.oldest != NULL && disk.size > disk.max_size) // the limit may have been lowered since
+    {
+        segment_delete_oldest();
+    }
+    printf("Disk cache: %zu responses in %zu MB\n", responses, disk.size >> 20);
+}
+
+int disk_cache_init(const char *dir, size_t max_size)
+{
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+    {
+        perror("Error in creating the disk cache directory");
+        return -1;
+    }
+    disk.buckets = (disk_entry **)calloc(INDEX_BUCKETS, sizeof(disk_entry *));
+    disk.dir = strdup(dir);
+    if (disk.buckets == NULL || disk.dir == NULL)
+        return -1;
+    disk.max_size = max_size;
+    load_segments();
+    disk.enabled = 1;
+    return 0;
+}
+
+int disk_cache_enabled()
+{
+    return disk.enabled;
+}
+
+int disk_cache_lookup(const cache_key *key, disk_object *object)
+{
+    if (!disk.enabled)
+        return -1;
+    pthread_mutex_lock(&disk.lock);
+    disk_entry **link = index_find(key);
+    disk_entry *entry = *link;
+    if (entry != NULL && entry->expires <= time(NULL)) // stale, it is fetched again and the new response replaces it
+    {
+        index_remove(link);
+        entry = NULL;
+    }
+    if (entry != NULL)
+    {
+        entry->segment->refcount++;
+        object->segment = entry->segment;
+        object->fd = entry->segment->fd;
+        object->record = entry->record;
+        object->offset = data_offset(entry->record);
+        object->len = entry->len;
+        object->written = entry->len;
+        object->keep_alive = entry->keep_alive;
+        object->expires = entry->expires;
+        object->received = entry->received;
+    }
+    pthread_mutex_unlock(&disk.lock);
+    return entry != NULL ? 0 : -1;
+}
+
+void disk_cache_release(disk_object *object)
+{
+    disk_segment *segment = object->segment;
+    if (segment == NULL)
+        return;
+    object->segment = NULL;
+    pthread_mutex_lock(&disk.lock);
+    if (--segment->refcount == 0 && segment->deleted)
+    {
+        close(segment->fd);
+        free(segment);
+    }
+    pthread_mutex_unlock(&disk.lock);
+}
+
+/*
+    The disk_cache_reserve function sets aside room at the end of the log for the record of a response and writes its header. Old
+    segments are deleted until the log fits its limit again. The header is written as RECORD_FILLING, so a record that never completes
+    is skipped by the next scan; its room is only reclaimed with its segment.
+*/
+int disk_cache_reserve(const cache_key *key, size_t len, int keep_alive, time_t expires, time_t received, disk_object *object)
+{
+    object->segment = NULL;
+    size_t key_len = sizeof(cache_key);
+    size_t record_len = sizeof(struct disk_record) + key_len + len;
+    if (!disk.enabled || record_len > disk.max_size / 4)
+        return -1;
+
+    pthread_mutex_lock(&disk.lock);
+    disk_segment *segment = disk.newest;
+    if (segment == NULL || (segment->size > 0 && segment->size + record_len > DISK_SEGMENT_SIZE))
+    {
+        segment = segment_create();
+    }
+    while (segment != NULL && disk.oldest != segment && disk.size + record_len > disk.max_size)
+    {
+        segment_delete_oldest();
+    }
+    if (segment != NULL)
+    {
+        object->record = segment->size;
+        segment->size += record_len;
+        disk.size += record_len;
+        segment->refcount++;
+    }
+    pthread_mutex_unlock(&disk.lock);
+    if (segment == NULL)
+        return -1;
+
+    object->segment = segment;
+    object->fd = segment->fd;
+    object->offset = data_offset(object->record);
+    object->len = len;
+    object->written = 0;
+    object->keep_alive = keep_alive;
+    object->expires = expires;
+    object->received = received;
+
+    struct disk_record header = {RECORD_MAGIC, RECORD_FILLING, (uint32_t)key_len, keep_alive ? RECORD_KEEP_ALIVE : 0u, len, expires, received};
+    if (pwrite(object->fd, &header, sizeof(header), object->record) != (ssize_t)sizeof(header) ||
+        pwrite(object->fd, key, key_len, object->record + sizeof(header)) != (ssize_t)key_len)
+    {
+        perror("Error in writing to the disk cache");
+        disk_cache_release(object);
+        return -1;
+    }
+    return 0;
+}
+
+int disk_cache_write(disk_object *object, const char *data, size_t len)
+{
+    if (object->written + len > object->len)
+        return -1;
+    while (len > 0)
+    {
+        ssize_t n = pwrite(object->fd, data, len, object->offset + object->written);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("Error in writing to the disk cache");
+            return -1;
+        }
+        object->written += n;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int disk_cache_splice(disk_object *object, int pipe_fd, size_t len)
+{
+    if (object->written + len > object->len)
+        return -1;
+    while (len > 0)
+    {
+        loff_t offset = object->offset + object->written;
+        ssize_t n = splice(pipe_fd, NULL, object->fd, &offset, len, SPLICE_F_MOVE);
+        if (n <= 0)
+        {
+            if (n < 0 && errno == EINTR)
+                continue;
+            perror("Error in writing to the disk cache");
+            return -1;
+        }
+        object->written += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int disk_cache_commit(disk_object *object, const cache_key *key)
+{
+    if (object->written != object->len)
+    {
+        disk_cache_abandon(object);
+        return -1;
+    }
+    uint32_t state = RECORD_COMPLETE;
+    if (pwrite(object->fd, &state, sizeof(state), object->record + offsetof(struct disk_record, state)) != (ssize_t)sizeof(state))
+    {
+        disk_cache_abandon(object);
+        return -1;
+    }
+
+    pthread_mutex_lock(&disk.lock);
+    if (!object->segment->deleted) // the log may have wrapped around while the response was written
+    {
+        index_insert(key, object->segment, object->record, object->len, object->keep_alive, object->expires, object->received);
+    }
+    pthread_mutex_unlock(&disk.lock);
+    disk_cache_release(object);
+    return 0;
+}
+
+void disk_cache_abandon(disk_object *object)
+{
+    disk_cache_release(object);
+}
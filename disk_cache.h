@@ -0,0 +1,77 @@
+/*
+ * disk_cache.h -- second tier of the cache, kept on disk.
+ *
+ * Large responses are written to a log of segment files while they are
+ * relayed, and stay there after they are evicted from memory or the proxy
+ * restarts. The memory cache holds the hot set, the disk holds the long tail,
+ * which is sent to clients with sendfile() straight from the page cache.
+ *
+ * Records are only ever appended to the newest segment. When the log outgrows
+ * its size limit, the oldest segment is deleted with every response in it. An
+ * index of the records lives in memory and is rebuilt by scanning the
+ * segments when the proxy starts. The store is shared by every worker, its
+ * index is protected by a lock that is never held during disk I/O.
+ */
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <time.h>
+#include "cache_key.h"
+
+#ifndef DISK_CACHE
+#define DISK_CACHE
+
+#define DISK_MIN_ELEMENT_SIZE (64 * 1024)     // smaller responses only live in memory
+#define DISK_SEGMENT_SIZE (64 * (1 << 20))    // the log starts a new segment file past this size
+#define DISK_MAX_SIZE 1024                    // default size of the log, in megabytes
+
+typedef struct disk_segment disk_segment;
+typedef struct disk_object disk_object;
+
+/*
+   A response stored in the log, read or written through a file descriptor of
+   the segment holding it. The segment stays open while an object points into
+   it, even if it is deleted meanwhile.
+ */
+struct disk_object
+{
+   disk_segment *segment; // segment of the response, NULL when the object is unused
+   int fd;                // descriptor of the segment file
+   off_t record;          // offset of the record of the response in the file
+   off_t offset;          // offset of the first byte of the response
+   size_t len;            // length of the response
+   size_t written;        // bytes of the response written so far, for a fill
+   int keep_alive;        // the response leaves the connection open
+   time_t expires;        // time the response stops being fresh
+   time_t received;       // time the Age of the response counts from
+};
+
+/* Open the log in directory dir, creating it if needed, and index the
+ * responses it holds. max_size is in bytes. Returns -1 on failure, the proxy
+ * then runs with the memory cache only. */
+int disk_cache_init(const char *dir, size_t max_size);
+
+/* Returns 1 if disk_cache_init() succeeded */
+int disk_cache_enabled();
+
+/* Look up key, returns 0 and pins the response in *object if it is stored
+ * and still fresh, -1 otherwise. The object is handed back with
+ * disk_cache_release(). */
+int disk_cache_lookup(const cache_key *key, disk_object *object);
+void disk_cache_release(disk_object *object);
+
+/*
+   A fill reserves room for a response of len bytes, fresh until expires and
+   aging from received, with disk_cache_reserve() (-1 if the log is disabled or the response too
+   big), writes all of it in order with disk_cache_write() or, from a pipe,
+   with disk_cache_splice(), and ends with disk_cache_commit(), which
+   indexes the response under key, or disk_cache_abandon(). The write
+   functions return -1 on failure, the fill must then be abandoned.
+ */
+int disk_cache_reserve(const cache_key *key, size_t len, int keep_alive, time_t expires, time_t received, disk_object *object);
+int disk_cache_write(disk_object *object, const char *data, size_t len);
+int disk_cache_splice(disk_object *object, int pipe_fd, size_t len);
+int disk_cache_commit(disk_object *object, const cache_key *key);
+void disk_cache_abandon(disk_object *object);
+
+#endif
@@ -0,0 +1,137 @@
+/*
+  event_loop.c -- a small edge-triggered epoll reactor.
+*/
+
+#include "event_loop.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define MAX_EVENTS 256
+#define DEFAULT_NDEFERRED 64
+
+typedef struct deferred_call deferred_call;
+
+struct deferred_call
+{
+    deferred_fn fn;
+    void *arg;
+};
+
+struct event_loop
+{
+    int epoll_fd;
+    int running;
+    deferred_call *deferred; // calls to run after the current batch
+    int deferredused;
+    int deferredlen;
+};
+
+event_loop *event_loop_create()
+{
+    event_loop *loop = (event_loop *)malloc(sizeof(event_loop));
+    if (loop == NULL)
+        return NULL;
+
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd < 0)
+    {
+        perror("epoll_create1 failed");
+        free(loop);
+        return NULL;
+    }
+    loop->running = 0;
+    loop->deferred = (deferred_call *)malloc(sizeof(deferred_call) * DEFAULT_NDEFERRED);
+    loop->deferredused = 0;
+    loop->deferredlen = DEFAULT_NDEFERRED;
+    return loop;
+}
+
+void event_loop_destroy(event_loop *loop)
+{
+    close(loop->epoll_fd);
+    free(loop->deferred);
+    free(loop);
+}
+
+static int event_loop_ctl(event_loop *loop, int op, event_watcher *w, uint32_t events)
+{
+    struct epoll_event ev;
+    ev.events = events | EPOLLET;
+    ev.data.ptr = w;
+    return epoll_ctl(loop->epoll_fd, op, w->fd, &ev);
+}
+
+int event_loop_add(event_loop *loop, event_watcher *w, uint32_t events)
+{
+    return event_loop_ctl(loop, EPOLL_CTL_ADD, w, events);
+}
+
+int event_loop_modify(event_loop *loop, event_watcher *w, uint32_t events)
+{
+    return event_loop_ctl(loop, EPOLL_CTL_MOD, w, events);
+}
+
+int event_loop_remove(event_loop *loop, event_watcher *w)
+{
+    if (w->fd < 0)
+        return -1;
+    return epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, w->fd, NULL);
+}
+
+int event_loop_defer(event_loop *loop, deferred_fn fn, void *arg)
+{
+    if (loop->deferredused == loop->deferredlen)
+    {
+        deferred_call *grown = (deferred_call *)realloc(loop->deferred,
+                                                        sizeof(deferred_call) * loop->deferredlen * 2);
+        if (grown == NULL)
+            return -1;
+        loop->deferred = grown;
+        loop->deferredlen *= 2;
+    }
+    loop->deferred[loop->deferredused].fn = fn;
+    loop->deferred[loop->deferredused].arg = arg;
+    loop->deferredused++;
+    return 0;
+}
+
+void event_loop_run(event_loop *loop)
+{
+    struct epoll_event events[MAX_EVENTS];
+
+    loop->running = 1;
+    while (loop->running)
+    {
+        int n = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, -1);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait failed");
+            break;
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+            event_watcher *w = (event_watcher *)events[i].data.ptr;
+            if (w->fd >= 0) // the watcher may have been closed earlier in this batch
+            {
+                w->cb(loop, w, events[i].events);
+            }
+        }
+
+        // deferred calls may defer more work, so the count is re-read every iteration
+        for (int i = 0; i < loop->deferredused; i++)
+        {
+            loop->deferred[i].fn(loop->deferred[i].arg);
+        }
+        loop->deferredused = 0;
+    }
+}
+
+void event_loop_stop(event_loop *loop)
+{
+    loop->running = 0;
+}
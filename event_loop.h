@@ -0,0 +1,53 @@
+/*
+ * event_loop.h -- a small edge-triggered epoll reactor.
+ *
+ * Every file descriptor driven by the loop is described by an event_watcher.
+ * The watcher is usually embedded in a bigger object (a client connection for
+ * example) and its callback is invoked with the epoll events whenever the
+ * descriptor changes state. Descriptors are always registered edge-triggered,
+ * so a callback has to read/write until EAGAIN before it returns.
+ */
+
+#include <stdint.h>
+#include <sys/epoll.h>
+
+#ifndef EVENT_LOOP
+#define EVENT_LOOP
+
+typedef struct event_loop event_loop;
+typedef struct event_watcher event_watcher;
+
+typedef void (*event_callback)(event_loop *loop, event_watcher *w, uint32_t events);
+typedef void (*deferred_fn)(void *arg);
+
+struct event_watcher
+{
+   int fd;            // watched file descriptor, -1 when not registered
+   event_callback cb; // called with the ready epoll events
+   void *data;        // owner of the watcher
+};
+
+/* Create an event loop, returns NULL if epoll could not be set up */
+event_loop *event_loop_create();
+
+/* Destroy an event loop, the watched descriptors are not closed */
+void event_loop_destroy(event_loop *loop);
+
+/* Register, change and unregister a watcher, events are EPOLLIN, EPOLLOUT, ...
+ * (EPOLLET is always added). All return 0 on success and -1 on failure. */
+int event_loop_add(event_loop *loop, event_watcher *w, uint32_t events);
+int event_loop_modify(event_loop *loop, event_watcher *w, uint32_t events);
+int event_loop_remove(event_loop *loop, event_watcher *w);
+
+/*
+   Run fn(arg) once the current batch of events has been dispatched. Objects
+   that embed watchers are released this way, so that an event of the same
+   batch never touches freed memory.
+ */
+int event_loop_defer(event_loop *loop, deferred_fn fn, void *arg);
+
+/* Dispatch events until event_loop_stop() is called */
+void event_loop_run(event_loop *loop);
+void event_loop_stop(event_loop *loop);
+
+#endif
@@ -0,0 +1,330 @@
+/*
+  http_cache.c -- HTTP caching rules of a shared cache.
+*/
+
+#include "http_cache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#define DELTA_MAX 2147483648L // larger delta-seconds are taken as this, RFC 9111 section 1.2.2
+
+void http_cache_headers_init(http_cache_headers *h)
+{
+    memset(h, 0, sizeof(*h));
+    h->max_age = -1;
+    h->s_maxage = -1;
+    h->stale_while_revalidate = -1;
+    h->stale_if_error = -1;
+    h->date = -1;
+    h->expires = -1;
+    h->last_modified = -1;
+}
+
+// returns 1 if the len bytes at name are s, ignoring case
+static int name_is(const char *name, size_t len, const char *s)
+{
+    return strlen(s) == len && strncasecmp(name, s, len) == 0;
+}
+
+// delta-seconds, -1 if value does not start with a digit
+static long parse_delta(const char *value)
+{
+    if (!isdigit((unsigned char)*value))
+        return -1;
+    long delta = 0;
+    while (isdigit((unsigned char)*value))
+    {
+        delta = delta * 10 + (*value++ - '0');
+        if (delta >= DELTA_MAX)
+            return DELTA_MAX;
+    }
+    return delta;
+}
+
+// one directive of Cache-Control, arg is NULL if it has none
+static void cache_directive(http_cache_headers *h, const char *name, size_t len, const char *arg)
+{
+    if (name_is(name, len, "no-store"))
+        h->no_store = 1;
+    else if (name_is(name, len, "no-cache")) // with or without a list of fields, the whole response is revalidated
+        h->no_cache = 1;
+    else if (name_is(name, len, "private"))
+        h->is_private = 1;
+    else if (name_is(name, len, "public"))
+        h->is_public = 1;
+    else if (name_is(name, len, "must-revalidate") || name_is(name, len, "proxy-revalidate"))
+        h->must_revalidate = 1;
+    else if (name_is(name, len, "max-age") || name_is(name, len, "s-maxage"))
+    {
+        long delta = arg != NULL ? parse_delta(arg) : -1;
+        if (delta < 0) // an invalid lifetime makes the response stale
+            delta = 0;
+        if (len == 7)
+            h->max_age = delta;
+        else
+            h->s_maxage = delta;
+    }
+    else if (name_is(name, len, "stale-while-revalidate") || name_is(name, len, "stale-if-error"))
+    {
+        long delta = arg != NULL ? parse_delta(arg) : -1;
+        if (delta < 0) // an invalid window is ignored
+            return;
+        if (len == 22)
+            h->stale_while_revalidate = delta;
+        else
+            h->stale_if_error = delta;
+    }
+}
+
+// splits a Cache-Control value into its directives, quoted arguments may contain commas
+static void parse_cache_control(http_cache_headers *h, const char *p)
+{
+    while (*p != '\0')
+    {
+        while (*p == ' ' || *p == '\t' || *p == ',')
+            p++;
+        const char *name = p;
+        while (*p != '\0' && *p != ',' && *p != '=' && *p != ' ' && *p != '\t')
+            p++;
+        size_t len = p - name;
+        const char *arg = NULL;
+        while (*p == ' ' || *p == '\t')
+            p++;
+        if (*p == '=')
+        {
+            p++;
+            if (*p == '"')
+            {
+                arg = ++p;
+                while (*p != '\0' && *p != '"')
+                    p++;
+            }
+            else
+            {
+                arg = p;
+            }
+        }
+        while (*p != '\0' && *p != ',')
+            p++;
+        if (len > 0)
+            cache_directive(h, name, len, arg);
+    }
+}
+
+// appends the field names of a Vary value to h->vary, in lower case
+static void parse_vary(http_cache_headers *h, const char *p)
+{
+    size_t used = strlen(h->vary);
+    while (*p != '\0' && !h->vary_any)
+    {
+        while (*p == ' ' || *p == '\t' || *p == ',')
+            p++;
+        const char *name = p;
+        while (*p != '\0' && *p != ',' && *p != ' ' && *p != '\t')
+            p++;
+        size_t len = p - name;
+        while (*p != '\0' && *p != ',')
+            p++;
+        if (len == 0)
+            continue;
+        if ((len == 1 && name[0] == '*') || used + (used > 0) + len >= HTTP_VARY_MAX)
+        {
+            h->vary_any = 1;
+            break;
+        }
+        if (used > 0)
+            h->vary[used++] = ',';
+        for (size_t i = 0; i < len; i++)
+        {
+            h->vary[used++] = tolower((unsigned char)name[i]);
+        }
+        h->vary[used] = '\0';
+    }
+}
+
+void http_cache_header(http_cache_headers *h, const char *name, size_t name_len, const char *value)
+{
+    switch (name_len)
+    {
+    case 3:
+        if (name_is(name, name_len, "Age"))
+        {
+            long age = parse_delta(value);
+            if (age >= 0)
+                h->age = age;
+        }
+        break;
+    case 4:
+        if (name_is(name, name_len, "Date"))
+            h->date = http_parse_date(value);
+        else if (name_is(name, name_len, "Vary"))
+            parse_vary(h, value);
+        else if (name_is(name, name_len, "ETag") && strlen(value) < HTTP_ETAG_MAX) // sent back as it is in If-None-Match
+            strcpy(h->etag, value);
+        break;
+    case 7:
+        if (name_is(name, name_len, "Expires"))
+        {
+            h->expires = http_parse_date(value);
+            if (h->expires < 0) // "0" and other invalid dates are in the past
+                h->expires = 0;
+        }
+        break;
+    case 10:
+        if (name_is(name, name_len, "Set-Cookie"))
+            h->set_cookie = 1;
+        break;
+    case 13:
+        if (name_is(name, name_len, "Cache-Control"))
+            parse_cache_control(h, value);
+        else if (name_is(name, name_len, "Last-Modified"))
+            h->last_modified = http_parse_date(value);
+        break;
+    }
+}
+
+time_t http_parse_date(const char *value)
+{
+    static const char *const formats[] = {
+        "%a, %d %b %Y %H:%M:%S GMT", // IMF-fixdate, "Sun, 06 Nov 1994 08:49:37 GMT"
+        "%A, %d-%b-%y %H:%M:%S GMT", // obsolete RFC 850 format, "Sunday, 06-Nov-94 08:49:37 GMT"
+        "%a %b %e %H:%M:%S %Y",      // asctime() format, "Sun Nov  6 08:49:37 1994"
+    };
+    for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++)
+    {
+        struct tm tm;
+        memset(&tm, 0, sizeof(tm));
+        const char *end = strptime(value, formats[i], &tm);
+        if (end == NULL)
+            continue;
+        while (*end == ' ' || *end == '\t')
+            end++;
+        if (*end == '\0')
+            return timegm(&tm);
+    }
+    return -1;
+}
+
+// status codes a response can be reused for, RFC 9110 section 15.1 lists those that are heuristically cacheable
+static int heuristic_status(int status)
+{
+    switch (status)
+    {
+    case 200: case 203: case 204: case 300: case 301: case 308:
+    case 404: case 405: case 410: case 414: case 501:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+void http_cache_header_cut(http_cache_headers *h, const char *name, size_t name_len)
+{
+    // a private or no-store may be in what was dropped, and a date or lifetime read from the start of a value may be wrong
+    static const char *const names[] = {"Cache-Control", "Expires", "Date", "Age", "Last-Modified", "Vary"};
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+    {
+        if (name_is(name, name_len, names[i]))
+            h->cut = 1;
+    }
+}
+
+int http_cache_storable(int status, const http_cache_headers *h, int authorized)
+{
+    if (h->no_store || h->is_private || h->set_cookie || h->vary_any || h->cut)
+        return 0;
+    if (authorized && !h->is_public && h->s_maxage < 0 && !h->must_revalidate) // RFC 9111 section 3.5
+        return 0;
+    return heuristic_status(status) || status == 302 || status == 307; // redirects that are only fresh with explicit freshness
+}
+
+time_t http_cache_expires(int status, const http_cache_headers *h, time_t request_time, time_t response_time)
+{
+    if (h->no_cache)
+        return response_time;
+
+    time_t date = h->date >= 0 ? h->date : response_time;
+    long lifetime = 0;
+    if (h->s_maxage >= 0)
+        lifetime = h->s_maxage;
+    else if (h->max_age >= 0)
+        lifetime = h->max_age;
+    else if (h->expires >= 0)
+        lifetime = h->expires - date;
+    else if (h->last_modified >= 0 && h->last_modified < date && heuristic_status(status)) // a tenth of the time since the last change
+    {
+        lifetime = (date - h->last_modified) / 10;
+        if (lifetime > HTTP_HEURISTIC_MAX)
+            lifetime = HTTP_HEURISTIC_MAX;
+    }
+
+    return response_time + lifetime - http_cache_initial_age(h, request_time, response_time);
+}
+
+long http_cache_initial_age(const http_cache_headers *h, time_t request_time, time_t response_time)
+{
+    // RFC 9111 section 4.2.3
+    time_t date = h->date >= 0 ? h->date : response_time;
+    long apparent_age = response_time > date ? response_time - date : 0;
+    long corrected_age = h->age + (response_time - request_time);
+    return apparent_age > corrected_age ? apparent_age : corrected_age;
+}
+
+int http_cache_request_no_cache(http_request *request)
+{
+    http_cache_headers h; // the directives of a request are spelled like those of a response
+    http_cache_headers_init(&h);
+    int pragma = 0;
+    for (size_t i = 0; i < request->nheaders; i++)
+    {
+        http_header *header = &request->headers[i];
+        if (header->known == HTTP_PRAGMA && http_view_has_token(header->value, "no-cache"))
+        {
+            pragma = 1;
+        }
+        else if (header->known == HTTP_CACHE_CONTROL)
+        {
+            char value[256]; // directives past it are ignored
+            size_t len = header->value.len < sizeof(value) ? header->value.len : sizeof(value) - 1;
+            memcpy(value, header->value.data, len);
+            value[len] = '\0';
+            parse_cache_control(&h, value);
+        }
+    }
+    return h.no_cache || h.max_age == 0 || pragma;
+}
+
+long http_cache_stale_window(const http_cache_headers *h, long window)
+{
+    if (window <= 0 || h->must_revalidate || h->no_cache) // RFC 9111 section 4.2.4
+        return 0;
+    return window;
+}
+
+size_t http_cache_variant(http_request *request, const char *vary, char *out, size_t size)
+{
+    size_t len = 0;
+    const char *p = vary;
+    while (*p != '\0')
+    {
+        const char *comma = strchr(p, ',');
+        size_t name_len = comma != NULL ? (size_t)(comma - p) : strlen(p);
+        char name[HTTP_VARY_MAX];
+        memcpy(name, p, name_len);
+        name[name_len] = '\0';
+        p += name_len + (comma != NULL);
+
+        http_header *header = http_request_header(request, name);
+        const char *value = header != NULL ? header->value.data : "";
+        int value_len = header != NULL ? (int)header->value.len : 0;
+        int n = snprintf(len < size ? out + len : NULL, len < size ? size - len : 0, "\n%s:%.*s", name, value_len, value);
+        if (n > 0)
+            len += n;
+    }
+    if (len == 0 && size > 0)
+        out[0] = '\0';
+    return len;
+}
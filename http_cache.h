@@ -0,0 +1,107 @@
+/*
+ * http_cache.h -- HTTP caching rules of a shared cache.
+ *
+ * The response parser hands every header of a response to
+ * http_cache_header(), which keeps what decides whether the response may be
+ * stored and for how long: Cache-Control, Expires, Date, Age, Last-Modified,
+ * Set-Cookie and Vary, as well as the validators a stale response is
+ * revalidated with: ETag and Last-Modified. http_cache_storable() then tells
+ * whether a shared cache may store the response at all, and
+ * http_cache_expires() when it stops being fresh, following the age
+ * calculation of RFC 9111.
+ *
+ * A response that carries Vary is only a valid answer to requests sending the
+ * same values for the headers it names. http_cache_variant() writes those
+ * values as a secondary key, appended to the key of the url.
+ */
+
+#include <stddef.h>
+#include <time.h>
+#include "http_request.h"
+
+#ifndef HTTP_CACHE
+#define HTTP_CACHE
+
+#define HTTP_VARY_MAX 128        // longer Vary lists make the response uncacheable
+#define HTTP_HEURISTIC_MAX 86400 // longest heuristic freshness, in seconds
+#define HTTP_ETAG_MAX 128        // longer entity tags are not kept
+
+typedef struct http_cache_headers http_cache_headers;
+
+struct http_cache_headers
+{
+   int no_store;         // Cache-Control: no-store
+   int no_cache;         // Cache-Control: no-cache, the response is stale right away
+   int is_private;       // Cache-Control: private, only meant for the client's own cache
+   int is_public;        // Cache-Control: public
+   int must_revalidate;  // must-revalidate or proxy-revalidate
+   long max_age;         // seconds of max-age, -1 if there is none
+   long s_maxage;        // seconds of s-maxage, -1 if there is none
+   long stale_while_revalidate; // seconds of stale-while-revalidate, -1 if there is none
+   long stale_if_error;  // seconds of stale-if-error, -1 if there is none
+   long age;             // value of Age, 0 if there is none
+   time_t date;          // value of Date, -1 if there is none
+   time_t expires;       // value of Expires, -1 if there is none, 0 if it is not a valid date
+   time_t last_modified; // value of Last-Modified, -1 if there is none
+   int set_cookie;       // the response sets a cookie
+   int vary_any;         // Vary: *, or a list longer than vary, no request can be matched with the response
+   int cut;              // a header deciding whether or how long the response is stored was too long to be read whole
+   char vary[HTTP_VARY_MAX]; // names of the request headers the response varies on, in lower case, comma separated
+   char etag[HTTP_ETAG_MAX]; // value of ETag, empty if there is none or it is too long
+};
+
+/* Forget every header seen so far */
+void http_cache_headers_init(http_cache_headers *h);
+
+/* Take note of a header of the response, value is NUL terminated */
+void http_cache_header(http_cache_headers *h, const char *name, size_t name_len, const char *value);
+
+/* The header line was longer than the parser keeps, only the start of its
+ * value was handed to http_cache_header(). If it is one of the headers the
+ * caching rules read, the response may not be stored. */
+void http_cache_header_cut(http_cache_headers *h, const char *name, size_t name_len);
+
+/* Parse an HTTP date in any of its three formats, -1 if it is not one */
+time_t http_parse_date(const char *value);
+
+/* Returns 1 if a shared cache may store a response with status and headers
+ * h, authorized is set if the request carried credentials */
+int http_cache_storable(int status, const http_cache_headers *h, int authorized);
+
+/*
+   Time at which the response stops being fresh. request_time is when the
+   request was sent, response_time when the response arrived. The result is
+   not after response_time for a response that is stale already, including
+   a response without explicit freshness that no heuristic applies to.
+ */
+time_t http_cache_expires(int status, const http_cache_headers *h, time_t request_time, time_t response_time);
+
+/*
+   Age the response already had when it arrived at response_time, from its
+   Age and Date and the round trip of the request sent at request_time.
+ */
+long http_cache_initial_age(const http_cache_headers *h, time_t request_time, time_t response_time);
+
+/*
+   Returns 1 if the client asks for a response validated with the remote
+   server rather than one served from the cache: "Cache-Control: no-cache",
+   "max-age=0" or "Pragma: no-cache".
+ */
+int http_cache_request_no_cache(http_request *request);
+
+/*
+   Seconds a response that expired may still be served stale: window is
+   its stale-while-revalidate or stale-if-error (RFC 5861). 0 if it has
+   none, or if must-revalidate or no-cache forbid serving it stale.
+ */
+long http_cache_stale_window(const http_cache_headers *h, long window);
+
+/*
+   Write the secondary key of request for a response that varies on the
+   headers named in vary (as in http_cache_headers.vary) to out, NUL
+   terminated and truncated to size bytes. Returns the length of the whole
+   key, like snprintf().
+ */
+size_t http_cache_variant(http_request *request, const char *vary, char *out, size_t size);
+
+#endif
@@ -0,0 +1,327 @@
+/*
+  http_request.c -- incremental, zero-copy parser of an HTTP request head.
+*/
+
+#include "http_request.h"
+#include "scan.h"
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+
+// what the next line of the request is
+enum
+{
+    STAGE_REQUEST_LINE,
+    STAGE_HEADER_LINE,
+    STAGE_DONE
+};
+
+static const char root_path[] = "/";
+
+void http_request_init(http_request *r)
+{
+    memset(r, 0, offsetof(http_request, headers)); // the headers are overwritten as they are parsed
+    r->stage = STAGE_REQUEST_LINE;
+    r->port_number = 80;
+}
+
+static http_view view(const char *data, size_t len)
+{
+    http_view v = {data, len};
+    return v;
+}
+
+// splits the authority of an absolute target into host and port
+static int parse_authority(http_request *r, const char *p, size_t len)
+{
+    const char *colon = NULL;
+    if (len > 0 && p[0] == '[') // IPv6 literal, the port follows the bracket
+    {
+        const char *bracket = (const char *)memchr(p, ']', len);
+        if (bracket == NULL)
+            return -1;
+        if (bracket + 1 < p + len)
+        {
+            if (bracket[1] != ':')
+                return -1;
+            colon = bracket + 1;
+        }
+    }
+    else
+    {
+        colon = (const char *)memchr(p, ':', len);
+    }
+
+    r->host = view(p, colon != NULL ? (size_t)(colon - p) : len);
+    if (r->host.len == 0)
+        return -1;
+    if (colon == NULL)
+        return 0;
+
+    r->port = view(colon + 1, p + len - colon - 1);
+    if (r->port.len == 0) // "host:" means the default port
+        return 0;
+    if (r->port.len > 5)
+        return -1;
+    int port = 0;
+    for (size_t i = 0; i < r->port.len; i++)
+    {
+        if (r->port.data[i] < '0' || r->port.data[i] > '9')
+            return -1;
+        port = port * 10 + (r->port.data[i] - '0');
+    }
+    if (port == 0 || port > 65535)
+        return -1;
+    r->port_number = port;
+    return 0;
+}
+
+// splits the target, an absolute URI or a path, into its parts
+static int parse_target(http_request *r)
+{
+    const char *p = r->target.data;
+    size_t len = r->target.len;
+    const char *sep = NULL;
+    for (size_t i = 0; i + 2 < len; i++) // "://" before any slash ends the scheme
+    {
+        if (p[i] == ':' && p[i + 1] == '/' && p[i + 2] == '/')
+        {
+            sep = p + i;
+            break;
+        }
+        if (p[i] == '/' || p[i] == '?')
+            break;
+    }
+    if (sep == NULL) // origin form "/path?query", or another form the caller rejects
+    {
+        r->path = r->target;
+        return 0;
+    }
+
+    r->scheme = view(p, sep - p);
+    if (r->scheme.len == 0)
+        return -1;
+    const char *authority = sep + 3;
+    const char *end = p + len;
+    const char *path = authority;
+    while (path < end && *path != '/' && *path != '?')
+        path++;
+    if (parse_authority(r, authority, path - authority) < 0)
+        return -1;
+    if (path == end)
+        r->path = view(root_path, 1);
+    else if (*path == '/')
+        r->path = view(path, end - path);
+    else // a query right after the authority, the path would have to be rewritten
+        return -1;
+    return 0;
+}
+
+// "METHOD target HTTP/1.x"
+static int parse_request_line(http_request *r, const char *line, size_t len)
+{
+    const char *end = line + len;
+    const char *sp1 = (const char *)memchr(line, ' ', len);
+    if (sp1 == NULL || sp1 == line)
+        return -1;
+    const char *target = sp1 + 1;
+    const char *sp2 = (const char *)memchr(target, ' ', end - target);
+    if (sp2 == NULL || sp2 == target)
+        return -1;
+    const char *version = sp2 + 1;
+
+    r->method = view(line, sp1 - line);
+    r->target = view(target, sp2 - target);
+    r->version = view(version, end - version);
+    if (r->version.len != 8 || memcmp(version, "HTTP/1.", 7) != 0 || version[7] < '0' || version[7] > '9')
+        return -1;
+    r->version_minor = version[7] - '0';
+    return parse_target(r);
+}
+
+uint32_t http_header_hash(const char *name, size_t len)
+{
+    uint32_t hash = 2166136261u; // FNV-1a of the name in lower case
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= (unsigned char)name[i] | 0x20; // folds letters, names that collide otherwise are told apart by the comparison that follows
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// which well-known header name is, told apart by its length first
+static http_known known_header(http_view name)
+{
+    switch (name.len)
+    {
+    case 4:
+        return http_view_caseeq(name, "Host") ? HTTP_HOST : HTTP_OTHER;
+    case 6:
+        return http_view_caseeq(name, "Pragma") ? HTTP_PRAGMA : HTTP_OTHER;
+    case 10:
+        if (http_view_caseeq(name, "Connection"))
+            return HTTP_CONNECTION;
+        return http_view_caseeq(name, "Keep-Alive") ? HTTP_KEEP_ALIVE : HTTP_OTHER;
+    case 13:
+        if (http_view_caseeq(name, "Cache-Control"))
+            return HTTP_CACHE_CONTROL;
+        if (http_view_caseeq(name, "If-None-Match"))
+            return HTTP_IF_NONE_MATCH;
+        return http_view_caseeq(name, "Authorization") ? HTTP_AUTHORIZATION : HTTP_OTHER;
+    case 14:
+        return http_view_caseeq(name, "Content-Length") ? HTTP_CONTENT_LENGTH : HTTP_OTHER;
+    case 15:
+        return http_view_caseeq(name, "Accept-Encoding") ? HTTP_ACCEPT_ENCODING : HTTP_OTHER;
+    case 16:
+        return http_view_caseeq(name, "Proxy-Connection") ? HTTP_PROXY_CONNECTION : HTTP_OTHER;
+    case 17:
+        if (http_view_caseeq(name, "If-Modified-Since"))
+            return HTTP_IF_MODIFIED_SINCE;
+        return http_view_caseeq(name, "Transfer-Encoding") ? HTTP_TRANSFER_ENCODING : HTTP_OTHER;
+    default:
+        return HTTP_OTHER;
+    }
+}
+
+// "Name: value", the value without the whitespace around it
+static int parse_header_line(http_request *r, const char *line, size_t len)
+{
+    if (line[0] == ' ' || line[0] == '\t') // obsolete line folding
+        return -1;
+    if (r->nheaders == HTTP_MAX_HEADERS)
+        return -1;
+    const char *colon = scan_any(line, len, ": \t", 3); // whitespace before the colon is not allowed
+    if (colon == NULL || colon == line || *colon != ':')
+        return -1;
+
+    const char *value = colon + 1;
+    const char *end = line + len;
+    while (value < end && (*value == ' ' || *value == '\t'))
+        value++;
+    while (end > value && (end[-1] == ' ' || end[-1] == '\t'))
+        end--;
+
+    http_header *h = &r->headers[r->nheaders++];
+    h->name = view(line, colon - line);
+    h->value = view(value, end - value);
+    h->hash = http_header_hash(h->name.data, h->name.len);
+    h->known = known_header(h->name);
+    if (h->known != HTTP_OTHER && r->slots[h->known] == 0)
+        r->slots[h->known] = r->nheaders;
+    return 0;
+}
+
+int http_request_parse(http_request *r, const char *buf, size_t len)
+{
+    while (r->stage != STAGE_DONE)
+    {
+        const char *nl = r->pos < len ? (const char *)memchr(buf + r->pos, '\n', len - r->pos) : NULL;
+        if (nl == NULL) // the line is not complete, the next call goes on from here
+        {
+            r->pos = len;
+            return HTTP_REQUEST_PARTIAL;
+        }
+        r->pos = nl + 1 - buf;
+
+        const char *line = buf + r->line;
+        size_t line_len = nl - line;
+        if (line_len > 0 && line[line_len - 1] == '\r')
+            line_len--;
+        r->line = r->pos;
+
+        if (r->stage == STAGE_REQUEST_LINE)
+        {
+            if (line_len == 0) // empty lines before the request line are ignored
+                continue;
+            if (parse_request_line(r, line, line_len) < 0)
+                return HTTP_REQUEST_ERROR;
+            r->stage = STAGE_HEADER_LINE;
+        }
+        else if (line_len == 0) // end of the head
+        {
+            r->headers_end = line - buf;
+            r->len = r->pos;
+            r->stage = STAGE_DONE;
+        }
+        else if (parse_header_line(r, line, line_len) < 0)
+        {
+            return HTTP_REQUEST_ERROR;
+        }
+    }
+    return HTTP_REQUEST_DONE;
+}
+
+// moves v from old to buf, unless it points to a constant
+static void rebase(http_view *v, const char *old, const char *buf)
+{
+    if (v->data != NULL && v->data != root_path)
+        v->data = buf + (v->data - old);
+}
+
+void http_request_rebase(http_request *r, const char *old, const char *buf)
+{
+    rebase(&r->method, old, buf);
+    rebase(&r->target, old, buf);
+    rebase(&r->scheme, old, buf);
+    rebase(&r->host, old, buf);
+    rebase(&r->port, old, buf);
+    rebase(&r->path, old, buf);
+    rebase(&r->version, old, buf);
+    for (size_t i = 0; i < r->nheaders; i++)
+    {
+        rebase(&r->headers[i].name, old, buf);
+        rebase(&r->headers[i].value, old, buf);
+    }
+}
+
+http_header *http_request_header(http_request *r, const char *name)
+{
+    size_t len = strlen(name);
+    uint32_t hash = http_header_hash(name, len);
+    for (size_t i = 0; i < r->nheaders; i++)
+    {
+        http_header *h = &r->headers[i];
+        if (h->hash == hash && h->name.len == len && strncasecmp(h->name.data, name, len) == 0)
+            return h;
+    }
+    return NULL;
+}
+
+http_header *http_request_known(http_request *r, http_known known)
+{
+    return r->slots[known] != 0 ? &r->headers[r->slots[known] - 1] : NULL;
+}
+
+int http_view_eq(http_view v, const char *s)
+{
+    return strlen(s) == v.len && memcmp(v.data, s, v.len) == 0;
+}
+
+int http_view_caseeq(http_view v, const char *s)
+{
+    return strlen(s) == v.len && strncasecmp(v.data, s, v.len) == 0;
+}
+
+int http_view_has_token(http_view v, const char *token)
+{
+    size_t token_len = strlen(token);
+    const char *p = v.data;
+    const char *end = v.data + v.len;
+    while (p < end)
+    {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+            p++;
+        if (p == end)
+            break;
+        const char *item = p;
+        const char *comma = (const char *)memchr(p, ',', end - p);
+        p = comma != NULL ? comma : end;
+        const char *last = p;
+        while (last > item && (last[-1] == ' ' || last[-1] == '\t'))
+            last--;
+        if ((size_t)(last - item) == token_len && strncasecmp(item, token, token_len) == 0)
+            return 1;
+    }
+    return 0;
+}
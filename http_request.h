@@ -0,0 +1,118 @@
+/*
+ * http_request.h -- incremental, zero-copy parser of an HTTP request head.
+ *
+ * The parser is given the buffer the request is being received into, every
+ * time more bytes arrived, and goes on from where it stopped: each byte is
+ * looked at once, however many reads the request takes. Nothing is copied or
+ * allocated, the request line and the headers are views pointing into the
+ * caller's buffer, which must not move or change until the request is done
+ * with.
+ *
+ * Only the head is parsed, the request line and the headers up to the empty
+ * line that ends them.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef HTTP_REQUEST
+#define HTTP_REQUEST
+
+#define HTTP_MAX_HEADERS 64 // requests with more headers are rejected
+
+/* Headers the proxy looks at, found in constant time */
+typedef enum
+{
+   HTTP_HOST,
+   HTTP_CONNECTION,
+   HTTP_PROXY_CONNECTION,
+   HTTP_KEEP_ALIVE,
+   HTTP_CACHE_CONTROL,
+   HTTP_PRAGMA,
+   HTTP_IF_NONE_MATCH,
+   HTTP_IF_MODIFIED_SINCE,
+   HTTP_ACCEPT_ENCODING,
+   HTTP_AUTHORIZATION,
+   HTTP_CONTENT_LENGTH,
+   HTTP_TRANSFER_ENCODING,
+   HTTP_KNOWN_HEADERS, // number of well-known headers
+   HTTP_OTHER = HTTP_KNOWN_HEADERS
+} http_known;
+
+typedef struct http_view http_view;
+typedef struct http_header http_header;
+typedef struct http_request http_request;
+
+// bytes of the buffer a request was parsed from, not NUL terminated
+struct http_view
+{
+   const char *data;
+   size_t len;
+};
+
+struct http_header
+{
+   http_view name;  // as sent, compare it ignoring case
+   http_view value; // without the whitespace around it
+   uint32_t hash;   // http_header_hash() of name
+   http_known known; // which well-known header it is, HTTP_OTHER for the rest
+};
+
+struct http_request
+{
+   int stage;            // what the next line is, internal to the parser
+   size_t pos;           // bytes of the buffer already scanned
+   size_t line;          // offset of the line being received
+   size_t len;           // length of the head, final empty line included, once it is parsed
+   size_t headers_end;   // offset of the empty line that ends the head, the header lines are before it
+   http_view method;
+   http_view target;     // request target as sent
+   http_view scheme;     // parts of an absolute target, empty for other forms
+   http_view host;
+   http_view port;       // empty if the target has none
+   int port_number;      // value of port, 80 if there is none
+   http_view path;       // path and query, "/" if the target has none
+   http_view version;    // "HTTP/1.x"
+   int version_minor;    // 0 for HTTP/1.0, 1 for HTTP/1.1
+   unsigned char slots[HTTP_KNOWN_HEADERS]; // 1 + index of the first header of each well-known name, 0 if it was not sent
+   size_t nheaders;
+   http_header headers[HTTP_MAX_HEADERS]; // in the order they were sent
+};
+
+/* Prepare r for a new request */
+void http_request_init(http_request *r);
+
+/*
+   Parse the request at the start of buf, of which len bytes were received.
+   buf is the same buffer every time, grown at its end. Returns
+   HTTP_REQUEST_DONE once the head is complete, r->len is then its length and
+   the bytes after it are not looked at. Returns HTTP_REQUEST_PARTIAL while
+   more is expected and HTTP_REQUEST_ERROR for a malformed request.
+ */
+#define HTTP_REQUEST_ERROR -1
+#define HTTP_REQUEST_PARTIAL 0
+#define HTTP_REQUEST_DONE 1
+int http_request_parse(http_request *r, const char *buf, size_t len);
+
+/* The bytes parsed so far were copied from old to buf, at the same offsets:
+ * point the views at buf. Parsing goes on in buf. */
+void http_request_rebase(http_request *r, const char *old, const char *buf);
+
+/* First header called name, ignoring case, NULL if there is none. The
+ * hashes of the names are compared before the names themselves. */
+http_header *http_request_header(http_request *r, const char *name);
+
+/* First well-known header of kind known, NULL if there is none */
+http_header *http_request_known(http_request *r, http_known known);
+
+/* Hash of a header name that ignores its case */
+uint32_t http_header_hash(const char *name, size_t len);
+
+/* Returns 1 if v is s, respecting or ignoring case */
+int http_view_eq(http_view v, const char *s);
+int http_view_caseeq(http_view v, const char *s);
+
+/* Returns 1 if the comma separated list v contains token, ignoring case */
+int http_view_has_token(http_view v, const char *token);
+
+#endif
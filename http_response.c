@@ -0,0 +1,340 @@
+/*
+  http_response.c -- incremental parser of the framing of an HTTP response.
+*/
+
+#include "http_response.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <limits.h>
+
+// what the next byte of the response belongs to
+enum
+{
+    STAGE_STATUS_LINE,
+    STAGE_HEADER_LINE,
+    STAGE_BODY,           // Content-Length body
+    STAGE_CHUNK_SIZE,     // line holding the size of the next chunk
+    STAGE_CHUNK_DATA,     // data of a chunk
+    STAGE_CHUNK_DATA_END, // CRLF after the data of a chunk
+    STAGE_TRAILER,        // trailer lines after the last chunk
+    STAGE_BODY_CLOSE,     // body read until the connection is closed
+    STAGE_DONE
+};
+
+// resets what is known about the headers, a 1xx response is followed by the headers of the real one
+static void reset_headers(http_response *r)
+{
+    r->status = 0;
+    r->version_minor = 0;
+    r->keep_alive = 0;
+    r->body = HTTP_BODY_CLOSE;
+    r->remaining = 0;
+    r->content_length = -1;
+    r->chunked = 0;
+    r->conn_close = 0;
+    r->conn_keep_alive = 0;
+    r->content_encoded = 0;
+    r->textual = 0;
+    r->headers_done = 0;
+    r->head_len = -1;
+    http_cache_headers_init(&r->cache);
+}
+
+void http_response_init(http_response *r)
+{
+    reset_headers(r);
+    r->stage = STAGE_STATUS_LINE;
+    r->line_len = 0;
+    r->line_cut = 0;
+    r->fed = 0;
+}
+
+// gives up on the framing, the response then ends when the connection is closed
+static void invalid(http_response *r)
+{
+    r->body = HTTP_BODY_CLOSE;
+    r->keep_alive = 0;
+    r->stage = STAGE_BODY_CLOSE;
+}
+
+// checks whether the comma separated list value contains token, ignoring case
+static int has_token(const char *value, const char *token)
+{
+    size_t token_len = strlen(token);
+    while (*value != '\0')
+    {
+        while (*value == ' ' || *value == '\t' || *value == ',')
+            value++;
+        const char *end = value;
+        while (*end != '\0' && *end != ',')
+            end++;
+        const char *last = end;
+        while (last > value && (last[-1] == ' ' || last[-1] == '\t'))
+            last--;
+        if ((size_t)(last - value) == token_len && strncasecmp(value, token, token_len) == 0)
+            return 1;
+        value = end;
+    }
+    return 0;
+}
+
+// checks whether the last coding of a Transfer-Encoding value is chunked
+static int ends_chunked(const char *value)
+{
+    size_t len = strlen(value);
+    while (len > 0 && (value[len - 1] == ' ' || value[len - 1] == '\t'))
+        len--;
+    return len >= 7 && strncasecmp(value + len - 7, "chunked", 7) == 0 && (len == 7 || value[len - 8] == ',' || value[len - 8] == ' ');
+}
+
+// checks whether a Content-Type value is a textual media type, parameters after it are ignored
+static int is_textual(const char *value)
+{
+    static const char *const types[] = {"text/", "application/json", "application/javascript", "application/xml", "image/svg+xml"};
+    for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++)
+    {
+        if (strncasecmp(value, types[i], strlen(types[i])) == 0)
+            return 1;
+    }
+    size_t len = strcspn(value, "; \t"); // application/ld+json, application/atom+xml...
+    return (len >= 5 && strncasecmp(value + len - 5, "+json", 5) == 0) || (len >= 4 && strncasecmp(value + len - 4, "+xml", 4) == 0);
+}
+
+static void parse_header(http_response *r, char *line)
+{
+    char *colon = strchr(line, ':');
+    if (colon == NULL)
+        return;
+    size_t name_len = colon - line;
+    char *value = colon + 1;
+    while (*value == ' ' || *value == '\t')
+        value++;
+    http_cache_header(&r->cache, line, name_len, value);
+    if (r->line_cut)
+        http_cache_header_cut(&r->cache, line, name_len);
+
+    if (name_len == 14 && strncasecmp(line, "Content-Length", 14) == 0)
+    {
+        char *end;
+        long length = strtol(value, &end, 10);
+        if (end == value || length < 0 || (r->content_length >= 0 && r->content_length != length))
+        {
+            invalid(r);
+            return;
+        }
+        r->content_length = length;
+    }
+    else if (name_len == 17 && strncasecmp(line, "Transfer-Encoding", 17) == 0)
+    {
+        r->chunked = ends_chunked(value);
+    }
+    else if (name_len == 16 && strncasecmp(line, "Content-Encoding", 16) == 0)
+    {
+        r->content_encoded = value[0] != '\0' && strcasecmp(value, "identity") != 0;
+    }
+    else if (name_len == 12 && strncasecmp(line, "Content-Type", 12) == 0)
+    {
+        r->textual = is_textual(value);
+    }
+    else if (name_len == 10 && strncasecmp(line, "Connection", 10) == 0)
+    {
+        if (has_token(value, "close"))
+            r->conn_close = 1;
+        if (has_token(value, "keep-alive"))
+            r->conn_keep_alive = 1;
+    }
+}
+
+// the empty line after the headers was reached, decides how the body ends
+static void end_headers(http_response *r)
+{
+    if (r->status >= 100 && r->status < 200 && r->status != 101) // interim response, the real one follows
+    {
+        reset_headers(r);
+        r->stage = STAGE_STATUS_LINE;
+        return;
+    }
+
+    r->headers_done = 1;
+    if (r->version_minor >= 1)
+        r->keep_alive = !r->conn_close;
+    else
+        r->keep_alive = r->conn_keep_alive && !r->conn_close;
+
+    if (r->status == 101) // the connection switches to another protocol
+    {
+        invalid(r);
+    }
+    else if (r->status == 204 || r->status == 304)
+    {
+        r->body = HTTP_BODY_NONE;
+        r->stage = STAGE_DONE;
+    }
+    else if (r->chunked)
+    {
+        r->body = HTTP_BODY_CHUNKED;
+        r->stage = STAGE_CHUNK_SIZE;
+    }
+    else if (r->content_length >= 0)
+    {
+        r->body = HTTP_BODY_LENGTH;
+        r->remaining = r->content_length;
+        r->stage = r->remaining > 0 ? STAGE_BODY : STAGE_DONE;
+    }
+    else
+    {
+        invalid(r); // no framing, the body runs until the connection is closed
+    }
+}
+
+// handles a complete line, without its CRLF
+static void end_line(http_response *r, char *line)
+{
+    switch (r->stage)
+    {
+    case STAGE_STATUS_LINE:
+        if (line[0] == '\0') // tolerate empty lines before the status line
+            break;
+        if (sscanf(line, "HTTP/1.%d %d", &r->version_minor, &r->status) != 2)
+        {
+            invalid(r);
+            break;
+        }
+        r->stage = STAGE_HEADER_LINE;
+        break;
+
+    case STAGE_HEADER_LINE:
+        if (line[0] == '\0')
+            end_headers(r);
+        else
+            parse_header(r, line);
+        break;
+
+    case STAGE_CHUNK_SIZE:
+    {
+        char *end;
+        long size = strtol(line, &end, 16); // chunk extensions after the size are ignored
+        if (end == line || size < 0)
+        {
+            invalid(r);
+            break;
+        }
+        if (size == 0)
+        {
+            r->stage = STAGE_TRAILER;
+        }
+        else
+        {
+            r->remaining = size;
+            r->stage = STAGE_CHUNK_DATA;
+        }
+        break;
+    }
+
+    case STAGE_CHUNK_DATA_END:
+        if (line[0] != '\0')
+            invalid(r);
+        else
+            r->stage = STAGE_CHUNK_SIZE;
+        break;
+
+    case STAGE_TRAILER:
+        if (line[0] == '\0')
+            r->stage = STAGE_DONE;
+        break;
+    }
+}
+
+/*
+    The collect_line function appends the bytes of data up to the next LF to r->line. It returns 1 when the line is complete, with the
+    CRLF stripped, and 0 when all of data was consumed without reaching its end.
+*/
+static int collect_line(http_response *r, const char *data, size_t len, size_t *pos)
+{
+    const char *start = data + *pos;
+    const char *lf = (const char *)memchr(start, '\n', len - *pos);
+    size_t n = lf != NULL ? (size_t)(lf - start) : len - *pos;
+    size_t room = HTTP_LINE_MAX - 1 - r->line_len;
+    if (n > room)
+        r->line_cut = 1;
+    else
+        room = n;
+    memcpy(r->line + r->line_len, start, room);
+    r->line_len += room;
+    if (lf == NULL)
+    {
+        *pos = len;
+        return 0;
+    }
+    *pos += n + 1;
+    if (r->line_len > 0 && r->line[r->line_len - 1] == '\r')
+        r->line_len--;
+    r->line[r->line_len] = '\0';
+    r->line_len = 0;
+    return 1;
+}
+
+// consumes up to len bytes of a Content-Length body or of the data of a chunk, returns how many belong to it
+static size_t consume_body(http_response *r, size_t len)
+{
+    if (len > (size_t)r->remaining)
+        len = r->remaining;
+    r->remaining -= len;
+    if (r->remaining == 0)
+        r->stage = r->stage == STAGE_BODY ? STAGE_DONE : STAGE_CHUNK_DATA_END;
+    return len;
+}
+
+int http_response_feed(http_response *r, const char *data, size_t len, size_t *used)
+{
+    size_t pos = 0;
+    while (pos < len && r->stage != STAGE_DONE)
+    {
+        if (r->stage == STAGE_BODY_CLOSE)
+        {
+            pos = len;
+        }
+        else if (r->stage == STAGE_BODY || r->stage == STAGE_CHUNK_DATA)
+        {
+            pos += consume_body(r, len - pos);
+        }
+        else if (collect_line(r, data, len, &pos))
+        {
+            end_line(r, r->line);
+            r->line_cut = 0;
+            if (r->headers_done && r->head_len < 0) // the line was the empty one after the final headers
+                r->head_len = r->fed + pos;
+        }
+    }
+    r->fed += pos;
+    *used = pos;
+    return r->stage == STAGE_DONE ? HTTP_RESPONSE_DONE : HTTP_RESPONSE_PARTIAL;
+}
+
+int http_response_done(http_response *r)
+{
+    return r->stage == STAGE_DONE;
+}
+
+int http_response_eof(http_response *r)
+{
+    return r->stage == STAGE_BODY_CLOSE;
+}
+
+long http_response_opaque(http_response *r)
+{
+    if (r->stage == STAGE_BODY_CLOSE)
+        return LONG_MAX;
+    if (r->stage == STAGE_BODY || r->stage == STAGE_CHUNK_DATA)
+        return r->remaining;
+    return 0;
+}
+
+int http_response_skip(http_response *r, size_t len)
+{
+    if (r->stage == STAGE_BODY || r->stage == STAGE_CHUNK_DATA)
+        r->fed += consume_body(r, len);
+    return r->stage == STAGE_DONE ? HTTP_RESPONSE_DONE : HTTP_RESPONSE_PARTIAL;
+}
@@ -0,0 +1,88 @@
+/*
+ * http_response.h -- incremental parser of the framing of an HTTP response.
+ *
+ * The proxy relays responses byte for byte, it only has to know where a
+ * response ends so that the connection it arrived on can carry the next
+ * request. The parser is fed the bytes as they are received, in pieces of any
+ * size, and finds the end of the response from its status code and its
+ * Content-Length, Transfer-Encoding and Connection headers. The headers that
+ * decide whether the response may be cached are collected on the way, see
+ * http_cache.h.
+ *
+ * A response the parser does not understand is treated as ending when the
+ * remote server closes the connection, which is how every response was read
+ * before connections were reused.
+ */
+
+#include <stddef.h>
+#include "http_cache.h"
+
+#ifndef HTTP_RESPONSE
+#define HTTP_RESPONSE
+
+#define HTTP_LINE_MAX 512 // longer header lines are truncated, the headers the parser needs are short, see http_cache_header_cut()
+
+typedef struct http_response http_response;
+
+typedef enum
+{
+   HTTP_BODY_NONE,    // the response ends with its headers (204, 304)
+   HTTP_BODY_LENGTH,  // Content-Length bytes follow the headers
+   HTTP_BODY_CHUNKED, // the body uses the chunked transfer coding
+   HTTP_BODY_CLOSE    // the body ends when the remote server closes the connection
+} http_body;
+
+struct http_response
+{
+   int stage;                // what the next byte belongs to, internal to the parser
+   int status;               // status code, 0 until the status line is parsed
+   int version_minor;        // 0 for HTTP/1.0, 1 for HTTP/1.1
+   int keep_alive;           // the remote server keeps the connection open after the response
+   http_body body;           // how the end of the body is found, known once the headers are parsed
+   long remaining;           // bytes of the body, or of the current chunk, still to come
+   long content_length;      // value of Content-Length, -1 if there is none
+   int chunked;              // Transfer-Encoding ends with chunked
+   int conn_close;           // Connection: close
+   int conn_keep_alive;      // Connection: keep-alive
+   int content_encoded;      // Content-Encoding names a coding, the body is compressed already
+   int textual;              // Content-Type is text, JSON, JavaScript, XML or SVG, which compresses well
+   int headers_done;         // the headers of the final response were all parsed
+   long head_len;            // bytes from the start of the response to the end of the final headers, -1 until they are parsed
+   long fed;                 // bytes of the response consumed so far
+   http_cache_headers cache; // caching headers of the response
+   int line_len;             // bytes of line in use
+   int line_cut;             // the line being received did not fit into line, its end was dropped
+   char line[HTTP_LINE_MAX]; // header line being received
+};
+
+/* Prepare r for a new response */
+void http_response_init(http_response *r);
+
+/*
+   Feed len bytes of the response. *used is set to the number of them that
+   belong to the response, anything after the end of the response is not
+   consumed. Returns HTTP_RESPONSE_DONE once the last byte of the response
+   was consumed and HTTP_RESPONSE_PARTIAL while more is expected.
+ */
+#define HTTP_RESPONSE_PARTIAL 0
+#define HTTP_RESPONSE_DONE 1
+int http_response_feed(http_response *r, const char *data, size_t len, size_t *used);
+
+/*
+   Returns how many of the next bytes are body data the parser does not need
+   to look at, LONG_MAX for a body that ends when the connection is closed and
+   0 when the next bytes must go through http_response_feed(). Up to that many
+   bytes can be relayed without ever being copied to user space and accounted
+   for with http_response_skip(), which returns like http_response_feed().
+ */
+long http_response_opaque(http_response *r);
+int http_response_skip(http_response *r, size_t len);
+
+/* Returns 1 once the last byte of the response was consumed */
+int http_response_done(http_response *r);
+
+/* Returns 1 if the response is complete when the remote server closes the
+ * connection now, 0 if it was cut short */
+int http_response_eof(http_response *r);
+
+#endif
@@ -0,0 +1,279 @@
+/*
+  pool_bench.c -- latency of misses with and without the upstream pool.
+
+  Usage: pool_bench [-n requests] [-p port] [-x proxy]
+
+  Starts a local origin server, then runs the proxy twice: once keeping its
+  connections to the origin open between requests (-t 30) and once closing
+  them after every response (-t 0). Each time, a client sends the same
+  number of requests for distinct urls one after the other over a single
+  keep-alive connection. The origin marks its responses no-store, so every
+  request is a miss that goes to the origin, and the latency percentiles of
+  both runs are printed. The proxy binary is ./proxy unless -x names another.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#define BENCH_BUF 16384
+#define BENCH_WARMUP 100 // requests sent before measuring, so both runs start with their buffers and pools warm
+#define BENCH_BODY "<html><body>a small page from the origin</body></html>\n"
+
+// finds the end of the head in buf, returns its length with the empty line or 0 if it is not all there
+static size_t head_len(const char *buf, size_t len)
+{
+    for (size_t i = 0; i + 4 <= len; i++)
+    {
+        if (memcmp(buf + i, "\r\n\r\n", 4) == 0)
+            return i + 4;
+    }
+    return 0;
+}
+
+// answers the requests of one connection to the origin until the proxy closes it
+static void *origin_conn_main(void *arg)
+{
+    int fd = (int)(long)arg;
+    char buf[BENCH_BUF];
+    size_t len = 0;
+    char response[256];
+    int response_len = snprintf(response, sizeof(response),
+                                "HTTP/1.1 200 OK\r\nContent-Type: text/html\r\nCache-Control: no-store\r\nContent-Length: %zu\r\n\r\n%s",
+                                strlen(BENCH_BODY), BENCH_BODY);
+    for (;;)
+    {
+        size_t head = head_len(buf, len);
+        if (head == 0)
+        {
+            ssize_t n = len < sizeof(buf) ? recv(fd, buf + len, sizeof(buf) - len, 0) : -1;
+            if (n <= 0)
+                break;
+            len += n;
+            continue;
+        }
+        if (send(fd, response, response_len, MSG_NOSIGNAL) != response_len)
+            break;
+        memmove(buf, buf + head, len - head); // requests carry no body
+        len -= head;
+    }
+    close(fd);
+    return NULL;
+}
+
+static void *origin_main(void *arg)
+{
+    int listener = (int)(long)arg;
+    for (;;)
+    {
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0)
+            continue;
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, origin_conn_main, (void *)(long)fd) != 0)
+        {
+            close(fd);
+            continue;
+        }
+        pthread_detach(tid);
+    }
+    return NULL;
+}
+
+// starts the origin on a port of its own, returns the port or -1
+static int start_origin()
+{
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addr_len = sizeof(addr);
+    if (listener < 0 || bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listener, 1024) < 0 ||
+        getsockname(listener, (struct sockaddr *)&addr, &addr_len) < 0)
+        return -1;
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, origin_main, (void *)(long)listener) != 0)
+        return -1;
+    pthread_detach(tid);
+    return ntohs(addr.sin_port);
+}
+
+static int connect_local(int port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+// runs the proxy with the given idle timeout, returns its pid once it accepts connections, or -1
+static pid_t start_proxy(const char *proxy, int port, const char *idle_timeout)
+{
+    char port_arg[16];
+    snprintf(port_arg, sizeof(port_arg), "%d", port);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO); // the proxy logs every request
+        execl(proxy, proxy, "-w", "1", "-t", idle_timeout, port_arg, (char *)NULL);
+        perror("Error in running the proxy");
+        _exit(1);
+    }
+    for (int tries = 0; pid > 0 && tries < 100; tries++)
+    {
+        int fd = connect_local(port);
+        if (fd >= 0)
+        {
+            close(fd);
+            return pid;
+        }
+        usleep(20000);
+    }
+    if (pid > 0)
+        kill(pid, SIGKILL);
+    return -1;
+}
+
+// sends one request over fd and reads its whole response, returns -1 on failure
+static int exchange(int fd, int origin_port, int i)
+{
+    char buf[BENCH_BUF];
+    int len = snprintf(buf, sizeof(buf), "GET http://127.0.0.1:%d/bench/%d HTTP/1.1\r\nHost: 127.0.0.1:%d\r\n\r\n", origin_port, i, origin_port);
+    if (send(fd, buf, len, MSG_NOSIGNAL) != len)
+        return -1;
+    size_t got = 0, head = 0;
+    long content_length = -1;
+    while (head == 0 || got < head + content_length)
+    {
+        ssize_t n = recv(fd, buf + got, sizeof(buf) - got, 0);
+        if (n <= 0)
+            return -1;
+        got += n;
+        if (head == 0 && (head = head_len(buf, got)) > 0)
+        {
+            buf[head - 1] = '\0';
+            const char *cl = strcasestr(buf, "\r\nContent-Length:");
+            if (strncmp(buf, "HTTP/1.1 200", 12) != 0 || cl == NULL)
+                return -1;
+            content_length = atol(cl + 17);
+        }
+    }
+    return 0;
+}
+
+static int compare_ns(const void *a, const void *b)
+{
+    long x = *(const long *)a, y = *(const long *)b;
+    return x < y ? -1 : x > y;
+}
+
+static long now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// measures count requests through a proxy started with idle_timeout, fills latencies in nanoseconds and returns -1 on failure
+static int run(const char *proxy, int port, int origin_port, const char *idle_timeout, long *latencies, int count)
+{
+    pid_t pid = start_proxy(proxy, port, idle_timeout);
+    if (pid < 0)
+        return -1;
+    int fd = connect_local(port);
+    int failed = fd < 0;
+    for (int i = 0; i < BENCH_WARMUP + count && !failed; i++)
+    {
+        long start = now_ns();
+        failed = exchange(fd, origin_port, i) < 0;
+        if (i >= BENCH_WARMUP)
+            latencies[i - BENCH_WARMUP] = now_ns() - start;
+    }
+    if (fd >= 0)
+        close(fd);
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    return failed ? -1 : 0;
+}
+
+static void report(const char *name, long *latencies, int count)
+{
+    qsort(latencies, count, sizeof(long), compare_ns);
+    printf("%-10s p50 %8.1f us  p90 %8.1f us  p99 %8.1f us\n", name, latencies[count / 2] / 1e3, latencies[count * 9 / 10] / 1e3,
+           latencies[count * 99 / 100] / 1e3);
+}
+
+int main(int argc, char *const argv[])
+{
+    int count = 5000, port = 18080;
+    const char *proxy = "./proxy";
+    int opt;
+    while ((opt = getopt(argc, argv, "n:p:x:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            count = atoi(optarg);
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'x':
+            proxy = optarg;
+            break;
+        default:
+            printf("Usage: %s [-n requests] [-p port] [-x proxy]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (count < 1)
+        count = 1;
+
+    int origin_port = start_origin();
+    long *pooled = (long *)malloc(count * sizeof(long));
+    long *unpooled = (long *)malloc(count * sizeof(long));
+    if (origin_port < 0 || pooled == NULL || unpooled == NULL)
+    {
+        perror("Error in starting the origin");
+        exit(1);
+    }
+    printf("%d misses through %s to an origin on port %d\n", count, proxy, origin_port);
+    if (run(proxy, port, origin_port, "30", pooled, count) < 0 || run(proxy, port + 1, origin_port, "0", unpooled, count) < 0)
+    {
+        printf("The requests through the proxy failed\n");
+        exit(1);
+    }
+    report("pooled", pooled, count);
+    report("unpooled", unpooled, count);
+    printf("p50 drop   %.1f%%\n", 100.0 * (unpooled[count / 2] - pooled[count / 2]) / unpooled[count / 2]);
+    free(pooled);
+    free(unpooled);
+    return 0;
+}
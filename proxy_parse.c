@@ -4,13 +4,13 @@
 */
 
 #include "proxy_parse.h"
+#include "http_request.h"
+#include <strings.h>
 
 #define DEFAULT_NHDRS 8
 #define MAX_REQ_LEN 65535
 #define MIN_REQ_LEN 4
 
-static const char *root_abs_path = "/";
-
 /* private function declartions */
 int ParsedRequest_printRequestLine(struct ParsedRequest *pr,
                                    char *buf, size_t buflen,
@@ -38,12 +38,18 @@ void debug(const char *format, ...)
  *  ParsedHeader Public Methods
  */
 
-/* Set a header with key and value */
-int ParsedHeader_set(struct ParsedRequest *pr,
-                     const char *key, const char *value)
+/* Set a header with a key and a value of the given lengths, neither NUL terminated */
+static int ParsedHeader_setn(struct ParsedRequest *pr,
+                             const char *key, size_t keylen,
+                             const char *value, size_t valuelen)
 {
     struct ParsedHeader *ph;
-    ParsedHeader_remove(pr, key);
+    char *k = (char *)malloc(keylen + 1);
+    if (!k)
+        return -1;
+    memcpy(k, key, keylen);
+    k[keylen] = '\0';
+    ParsedHeader_remove(pr, k);
 
     if (pr->headerslen <= pr->headersused + 1)
     {
@@ -52,35 +58,46 @@ int ParsedHeader_set(struct ParsedRequest *pr,
             (struct ParsedHeader *)realloc(pr->headers,
                                            pr->headerslen * sizeof(struct ParsedHeader));
         if (!pr->headers)
+        {
+            free(k);
             return -1;
+        }
     }
 
     ph = pr->headers + pr->headersused;
     pr->headersused += 1;
 
-    ph->key = (char *)malloc(strlen(key) + 1);
-    memcpy(ph->key, key, strlen(key));
-    ph->key[strlen(key)] = '\0';
-
-    ph->value = (char *)malloc(strlen(value) + 1);
-    memcpy(ph->value, value, strlen(value));
-    ph->value[strlen(value)] = '\0';
+    ph->key = k;
+    ph->value = (char *)malloc(valuelen + 1);
+    memcpy(ph->value, value, valuelen);
+    ph->value[valuelen] = '\0';
 
-    ph->keylen = strlen(key) + 1;
-    ph->valuelen = strlen(value) + 1;
+    ph->keylen = keylen + 1;
+    ph->valuelen = valuelen + 1;
+    ph->hash = http_header_hash(key, keylen);
     return 0;
 }
 
+/* Set a header with key and value */
+int ParsedHeader_set(struct ParsedRequest *pr,
+                     const char *key, const char *value)
+{
+    return ParsedHeader_setn(pr, key, strlen(key), value, strlen(value));
+}
+
 /* get the parsedHeader with the specified key or NULL */
 struct ParsedHeader *ParsedHeader_get(struct ParsedRequest *pr,
                                       const char *key)
 {
     size_t i = 0;
     struct ParsedHeader *tmp;
+    if (!key)
+        return NULL;
+    uint32_t hash = http_header_hash(key, strlen(key));
     while (pr->headersused > i)
     {
         tmp = pr->headers + i;
-        if (tmp->key && key && strcmp(tmp->key, key) == 0)
+        if (tmp->key && tmp->hash == hash && strcasecmp(tmp->key, key) == 0)
         {
             return tmp;
         }
@@ -142,7 +159,7 @@ size_t ParsedHeader_lineLen(struct ParsedHeader *ph)
 {
     if (ph->key != NULL)
     {
-        return strlen(ph->key) + strlen(ph->value) + 4;
+        return ph->keylen - 1 + ph->valuelen - 1 + 4;
     }
     return 0;
 }
@@ -181,13 +198,13 @@ int ParsedHeader_printHeaders(struct ParsedRequest *pr, char *buf,
         ph = pr->headers + i;
         if (ph->key)
         {
-            memcpy(current, ph->key, strlen(ph->key));
-            memcpy(current + strlen(ph->key), ": ", 2);
-            memcpy(current + strlen(ph->key) + 2, ph->value,
-                   strlen(ph->value));
-            memcpy(current + strlen(ph->key) + 2 + strlen(ph->value),
-                   "\r\n", 2);
-            current += strlen(ph->key) + strlen(ph->value) + 4;
+            size_t keylen = ph->keylen - 1;
+            size_t valuelen = ph->valuelen - 1;
+            memcpy(current, ph->key, keylen);
+            memcpy(current + keylen, ": ", 2);
+            memcpy(current + keylen + 2, ph->value, valuelen);
+            memcpy(current + keylen + 2 + valuelen, "\r\n", 2);
+            current += keylen + valuelen + 4;
         }
         i++;
     }
@@ -222,35 +239,6 @@ void ParsedHeader_destroy(struct ParsedRequest *pr)
     pr->headerslen = 0;
 }
 
-int ParsedHeader_parse(struct ParsedRequest *pr, char *line)
-{
-    char *key;
-    char *value;
-    char *index1;
-    char *index2;
-
-    index1 = index(line, ':');
-    if (index1 == NULL)
-    {
-        debug("No colon found\n");
-        return -1;
-    }
-    key = (char *)malloc((index1 - line + 1) * sizeof(char));
-    memcpy(key, line, index1 - line);
-    key[index1 - line] = '\0';
-
-    index1 += 2;
-    index2 = strstr(index1, "\r\n");
-    value = (char *)malloc((index2 - index1 + 1) * sizeof(char));
-    memcpy(value, index1, (index2 - index1));
-    value[index2 - index1] = '\0';
-
-    ParsedHeader_set(pr, key, value);
-    free(key);
-    free(value);
-    return 0;
-}
-
 /*
   ParsedRequest Public Methods
 */
@@ -332,6 +320,16 @@ size_t ParsedRequest_totalLen(struct ParsedRequest *pr)
     return ParsedRequest_requestLineLen(pr) + ParsedHeader_headersLen(pr);
 }
 
+/* copies a field of the request line to *p, NUL terminated, and moves *p past it */
+static char *ParsedRequest_copyField(char **p, http_view field)
+{
+    char *copy = *p;
+    memcpy(copy, field.data, field.len);
+    copy[field.len] = '\0';
+    *p += field.len + 1;
+    return copy;
+}
+
 /*
    Parse request buffer
 
@@ -344,14 +342,14 @@ size_t ParsedRequest_totalLen(struct ParsedRequest *pr)
    Return values:
    -1: failure
    0: success
+
+   The request is parsed by http_request_parse(), the fields are then copied
+   into the ParsedRequest, which owns them.
 */
 int ParsedRequest_parse(struct ParsedRequest *parse, const char *buf,
                         int buflen)
 {
-    char *full_addr;
-    char *saveptr;
-    char *index;
-    char *currentHeader;
+    http_request req;
 
     if (parse->buf != NULL)
     {
@@ -365,192 +363,50 @@ int ParsedRequest_parse(struct ParsedRequest *parse, const char *buf,
         return -1;
     }
 
-    /* Create NUL terminated tmp buffer */
-    char *tmp_buf = (char *)malloc(buflen + 1); /* including NUL */
-    memcpy(tmp_buf, buf, buflen);
-    tmp_buf[buflen] = '\0';
-
-    index = strstr(tmp_buf, "\r\n\r\n");
-    if (index == NULL)
-    {
-        debug("invalid request line, no end of header\n");
-        free(tmp_buf);
-        return -1;
-    }
-
-    /* Copy request line into parse->buf */
-    index = strstr(tmp_buf, "\r\n");
-    if (parse->buf == NULL)
-    {
-        parse->buf = (char *)malloc((index - tmp_buf) + 1);
-        parse->buflen = (index - tmp_buf) + 1;
-    }
-    memcpy(parse->buf, tmp_buf, index - tmp_buf);
-    parse->buf[index - tmp_buf] = '\0';
-
-    /* Parse request line */
-    parse->method = strtok_r(parse->buf, " ", &saveptr);
-    if (parse->method == NULL)
-    {
-        debug("invalid request line, no whitespace\n");
-        free(tmp_buf);
-        free(parse->buf);
-        parse->buf = NULL;
-        return -1;
-    }
-    if (strcmp(parse->method, "GET"))
-    {
-        debug("invalid request line, method not 'GET': %s\n",
-              parse->method);
-        free(tmp_buf);
-        free(parse->buf);
-        parse->buf = NULL;
-        return -1;
-    }
-
-    full_addr = strtok_r(NULL, " ", &saveptr);
-
-    if (full_addr == NULL)
+    http_request_init(&req);
+    if (http_request_parse(&req, buf, buflen) != HTTP_REQUEST_DONE)
     {
-        debug("invalid request line, no full address\n");
-        free(tmp_buf);
-        free(parse->buf);
-        parse->buf = NULL;
+        debug("invalid request, malformed or no end of header\n");
         return -1;
     }
-
-    parse->version = full_addr + strlen(full_addr) + 1;
-
-    if (parse->version == NULL)
+    if (!http_view_eq(req.method, "GET"))
     {
-        debug("invalid request line, missing version\n");
-        free(tmp_buf);
-        free(parse->buf);
-        parse->buf = NULL;
+        debug("invalid request line, method not 'GET': %.*s\n",
+              (int)req.method.len, req.method.data);
         return -1;
     }
-    if (strncmp(parse->version, "HTTP/", 5))
-    {
-        debug("invalid request line, unsupported version %s\n",
-              parse->version);
-        free(tmp_buf);
-        free(parse->buf);
-        parse->buf = NULL;
-        return -1;
-    }
-
-    parse->protocol = strtok_r(full_addr, "://", &saveptr);
-    if (parse->protocol == NULL)
+    if (req.host.len == 0)
     {
         debug("invalid request line, missing host\n");
-        free(tmp_buf);
-        free(parse->buf);
-        parse->buf = NULL;
         return -1;
     }
 
-    const char *rem = full_addr + strlen(parse->protocol) + strlen("://");
-    size_t abs_uri_len = strlen(rem);
-
-    parse->host = strtok_r(NULL, "/", &saveptr);
-    if (parse->host == NULL)
-    {
-        debug("invalid request line, missing host\n");
-        free(tmp_buf);
-        free(parse->buf);
-        parse->buf = NULL;
+    /* The fields of the request line, one after the other in parse->buf */
+    parse->buflen = req.method.len + req.scheme.len + req.host.len +
+                    req.port.len + req.version.len + 5;
+    parse->buf = (char *)malloc(parse->buflen);
+    parse->path = (char *)malloc(req.path.len + 1);
+    if (!parse->buf || !parse->path)
         return -1;
-    }
 
-    if (strlen(parse->host) == abs_uri_len)
-    {
-        debug("invalid request line, missing absolute path\n");
-        free(tmp_buf);
-        free(parse->buf);
-        parse->buf = NULL;
-        return -1;
-    }
-
-    parse->path = strtok_r(NULL, " ", &saveptr);
-    if (parse->path == NULL)
-    { // replace empty abs_path with "/"
-        int rlen = strlen(root_abs_path);
-        parse->path = (char *)malloc(rlen + 1);
-        strncpy(parse->path, root_abs_path, rlen + 1);
-    }
-    else if (strncmp(parse->path, root_abs_path, strlen(root_abs_path)) == 0)
-    {
-        debug("invalid request line, path cannot begin "
-              "with two slash characters\n");
-        free(tmp_buf);
-        free(parse->buf);
-        parse->buf = NULL;
-        parse->path = NULL;
-        return -1;
-    }
-    else
-    {
-        // copy parse->path, prefix with a slash
-        char *tmp_path = parse->path;
-        int rlen = strlen(root_abs_path);
-        int plen = strlen(parse->path);
-        parse->path = (char *)malloc(rlen + plen + 1);
-        strncpy(parse->path, root_abs_path, rlen);
-        strncpy(parse->path + rlen, tmp_path, plen + 1);
-    }
-
-    parse->host = strtok_r(parse->host, ":", &saveptr);
-    parse->port = strtok_r(NULL, "/", &saveptr);
-
-    if (parse->host == NULL)
-    {
-        debug("invalid request line, missing host\n");
-        free(tmp_buf);
-        free(parse->buf);
-        free(parse->path);
-        parse->buf = NULL;
-        parse->path = NULL;
-        return -1;
-    }
-
-    if (parse->port != NULL)
-    {
-        int port = strtol(parse->port, (char **)NULL, 10);
-        if (port == 0 && errno == EINVAL)
-        {
-            debug("invalid request line, bad port: %s\n", parse->port);
-            free(tmp_buf);
-            free(parse->buf);
-            free(parse->path);
-            parse->buf = NULL;
-            parse->path = NULL;
-            return -1;
-        }
-    }
+    char *p = parse->buf;
+    parse->method = ParsedRequest_copyField(&p, req.method);
+    parse->protocol = ParsedRequest_copyField(&p, req.scheme);
+    parse->host = ParsedRequest_copyField(&p, req.host);
+    parse->port = req.port.len > 0 ? ParsedRequest_copyField(&p, req.port) : NULL;
+    parse->version = ParsedRequest_copyField(&p, req.version);
+    memcpy(parse->path, req.path.data, req.path.len);
+    parse->path[req.path.len] = '\0';
 
     /* Parse headers */
-    int ret = 0;
-    currentHeader = strstr(tmp_buf, "\r\n") + 2;
-    while (currentHeader[0] != '\0' &&
-           !(currentHeader[0] == '\r' && currentHeader[1] == '\n'))
+    for (size_t i = 0; i < req.nheaders; i++)
     {
-
-        // debug("line %s %s", parse->version, currentHeader);
-
-        if (ParsedHeader_parse(parse, currentHeader))
-        {
-            ret = -1;
-            break;
-        }
-
-        currentHeader = strstr(currentHeader, "\r\n");
-        if (currentHeader == NULL || strlen(currentHeader) < 2)
-            break;
-
-        currentHeader += 2;
+        http_header *h = &req.headers[i];
+        if (ParsedHeader_setn(parse, h->name.data, h->name.len,
+                              h->value.data, h->value.len) < 0)
+            return -1;
     }
-    free(tmp_buf);
-    return ret;
+    return 0;
 }
 
 /*
@@ -11,6 +11,7 @@
 #include <string.h>
 #include <stdarg.h>
 #include <errno.h>
+#include <stdint.h>
 
 #include <ctype.h>
 
@@ -53,7 +54,7 @@ struct ParsedRequest
 /*
    ParsedHeader: any header after the request line is a key-value pair with the
    format "key:value\r\n" and is maintained in the ParsedHeader linked list
-   within ParsedRequest
+   within ParsedRequest. Keys are compared ignoring case, their hashes first.
 */
 struct ParsedHeader
 {
@@ -61,6 +62,7 @@ struct ParsedHeader
    size_t keylen;
    char *value;
    size_t valuelen;
+   uint32_t hash; /* http_header_hash() of key */
 };
 
 /* Create an empty parsing object to be used exactly once for parsing a single
@@ -0,0 +1,563 @@
+/*
+  resolver.c -- non-blocking DNS resolver with a cache.
+*/
+
+#include "resolver.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#define DNS_PORT 53
+#define DNS_PACKET_MAX 512  // answers over UDP without EDNS never exceed it
+#define DNS_NAME_MAX 254    // longest name in dotted form, with its NUL
+#define ENTRY_BUCKETS 1024  // must be a power of two
+#define QUERY_TIMEOUT 1     // seconds without an answer before a query is sent again
+#define QUERY_TRIES 3       // queries sent for one lookup before it fails
+#define FAILURE_TTL 5       // seconds a lookup that got no usable answer is remembered
+#define NEGATIVE_TTL 30     // seconds a name that does not exist is remembered if the answer has no SOA record
+#define MAX_TTL 600         // longest time any answer is cached
+
+#define TYPE_A 1
+#define TYPE_CNAME 5
+#define TYPE_SOA 6
+#define CLASS_IN 1
+#define RCODE_NXDOMAIN 3
+
+typedef enum
+{
+    ENTRY_PENDING,  // a query was sent and waits for its answer
+    ENTRY_RESOLVED, // addr is the address of the name
+    ENTRY_FAILED    // the name does not exist or could not be resolved
+} entry_state;
+
+struct resolver_entry
+{
+    char *name;              // name being looked up, in lower case
+    entry_state state;
+    struct in_addr addr;     // address of the name once resolved
+    time_t expires;          // time the entry is dropped, -1 for entries of /etc/hosts
+    uint16_t id;             // id of the query in flight
+    int tries;               // queries sent for the current lookup
+    time_t sent_at;          // time the last query was sent
+    resolver_query *waiting; // queries waiting for the answer
+    resolver_entry *next;    // next entry in the same hash bucket
+};
+
+struct resolver
+{
+    event_loop *loop;
+    event_watcher socket;    // UDP socket connected to the nameserver
+    uint32_t seed;           // state of the generator of query ids
+    resolver_entry *entries[ENTRY_BUCKETS];
+};
+
+static time_t monotonic_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+// FNV-1a hash of a NUL terminated name
+static size_t hash_name(const char *name)
+{
+    size_t h = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)name; *p != '\0'; p++)
+    {
+        h ^= *p;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// xorshift generator, query ids only need to be hard to guess from outside
+static uint16_t next_id(resolver *r)
+{
+    r->seed ^= r->seed << 13;
+    r->seed ^= r->seed >> 17;
+    r->seed ^= r->seed << 5;
+    return (uint16_t)r->seed;
+}
+
+// copies name in lower case and without a trailing dot, returns -1 if it is too long or empty
+static int normalize(const char *name, char *out)
+{
+    size_t len = strlen(name);
+    if (len > 0 && name[len - 1] == '.')
+        len--;
+    if (len == 0 || len >= DNS_NAME_MAX)
+        return -1;
+    for (size_t i = 0; i < len; i++)
+        out[i] = tolower((unsigned char)name[i]);
+    out[len] = '\0';
+    return 0;
+}
+
+static resolver_entry *find_entry(resolver *r, const char *name)
+{
+    for (resolver_entry *e = r->entries[hash_name(name) & (ENTRY_BUCKETS - 1)]; e != NULL; e = e->next)
+    {
+        if (strcmp(e->name, name) == 0)
+            return e;
+    }
+    return NULL;
+}
+
+static resolver_entry *add_entry(resolver *r, const char *name)
+{
+    resolver_entry *e = (resolver_entry *)calloc(1, sizeof(resolver_entry));
+    if (e == NULL)
+        return NULL;
+    e->name = strdup(name);
+    if (e->name == NULL)
+    {
+        free(e);
+        return NULL;
+    }
+    resolver_entry **bucket = &r->entries[hash_name(name) & (ENTRY_BUCKETS - 1)];
+    e->next = *bucket;
+    *bucket = e;
+    return e;
+}
+
+/*
+    The finish function ends the lookup of e: it is cached for ttl seconds and every query waiting for it is told the outcome. A query
+    can cancel another one from its callback, so they are taken off the list one at a time.
+*/
+static void finish(resolver_entry *e, entry_state state, struct in_addr addr, long ttl)
+{
+    if (ttl > MAX_TTL)
+        ttl = MAX_TTL;
+    e->state = state;
+    e->addr = addr;
+    e->expires = monotonic_now() + ttl;
+
+    resolver_query *q;
+    while ((q = e->waiting) != NULL)
+    {
+        e->waiting = q->next;
+        if (e->waiting != NULL)
+            e->waiting->prev = NULL;
+        q->entry = NULL;
+        q->done(q, state == ENTRY_RESOLVED ? RESOLVER_DONE : -1, addr);
+    }
+}
+
+static void fail(resolver_entry *e, long ttl)
+{
+    struct in_addr none;
+    none.s_addr = INADDR_NONE;
+    finish(e, ENTRY_FAILED, none, ttl);
+}
+
+// writes an A query for name into pkt, returns its length or -1 if a label of name is too long
+static int build_query(uint16_t id, const char *name, unsigned char *pkt)
+{
+    unsigned char *p = pkt;
+    *p++ = id >> 8;
+    *p++ = id & 0xff;
+    *p++ = 0x01; // recursion desired
+    *p++ = 0x00;
+    *p++ = 0x00; // one question
+    *p++ = 0x01;
+    memset(p, 0, 6); // no answer, authority or additional records
+    p += 6;
+
+    while (*name != '\0')
+    {
+        const char *dot = strchr(name, '.');
+        size_t len = dot != NULL ? (size_t)(dot - name) : strlen(name);
+        if (len == 0 || len > 63)
+            return -1;
+        *p++ = len;
+        memcpy(p, name, len);
+        p += len;
+        name += len;
+        if (*name == '.')
+            name++;
+    }
+    *p++ = 0;
+    *p++ = 0;
+    *p++ = TYPE_A;
+    *p++ = 0;
+    *p++ = CLASS_IN;
+    return p - pkt;
+}
+
+// sends the next query for a pending entry, a lost query is sent again by resolver_sweep()
+static int send_query(resolver *r, resolver_entry *e)
+{
+    unsigned char pkt[DNS_PACKET_MAX];
+    e->id = next_id(r);
+    int len = build_query(e->id, e->name, pkt);
+    if (len < 0)
+        return -1;
+    e->tries++;
+    e->sent_at = monotonic_now();
+    if (send(r->socket.fd, pkt, len, 0) < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+    {
+        perror("Error in sending a DNS query");
+    }
+    return 0;
+}
+
+/*
+    The read_name function decodes the possibly compressed name at *pos of pkt into out, in lower case, and moves *pos past it. It
+    returns -1 if the name is malformed. out may be NULL when the name is only skipped.
+*/
+static int read_name(const unsigned char *pkt, int len, int *pos, char *out)
+{
+    int p = *pos;
+    int jumped = 0;
+    int hops = 0;
+    int out_len = 0;
+    while (1)
+    {
+        if (p >= len)
+            return -1;
+        int label = pkt[p];
+        if ((label & 0xc0) == 0xc0) // pointer to a name earlier in the packet
+        {
+            if (p + 1 >= len || ++hops > 16)
+                return -1;
+            if (!jumped)
+                *pos = p + 2;
+            jumped = 1;
+            p = ((label & 0x3f) << 8) | pkt[p + 1];
+            continue;
+        }
+        if (label > 63)
+            return -1;
+        p++;
+        if (label == 0)
+            break;
+        if (p + label > len || out_len + label + 1 >= DNS_NAME_MAX)
+            return -1;
+        if (out != NULL)
+        {
+            if (out_len > 0)
+                out[out_len++] = '.';
+            for (int i = 0; i < label; i++)
+                out[out_len++] = tolower(pkt[p + i]);
+        }
+        p += label;
+    }
+    if (!jumped)
+        *pos = p;
+    if (out != NULL)
+        out[out_len] = '\0';
+    return 0;
+}
+
+static unsigned int read_u16(const unsigned char *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static unsigned long read_u32(const unsigned char *p)
+{
+    return ((unsigned long)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+/*
+    The handle_answer function matches an answer to the pending lookup it belongs to, by name and query id, and ends that lookup. The TTL
+    of an address is the smallest TTL of the records leading to it (CNAMEs included), the TTL of a name that does not exist comes from
+    the SOA record of the authority section.
+*/
+static void handle_answer(resolver *r, const unsigned char *pkt, int len)
+{
+    if (len < 12 || !(pkt[2] & 0x80) || read_u16(pkt + 4) != 1) // not an answer to a single question
+        return;
+    uint16_t id = read_u16(pkt);
+    int rcode = pkt[3] & 0x0f;
+    int nanswers = read_u16(pkt + 6);
+    int nauthority = read_u16(pkt + 8);
+
+    char name[DNS_NAME_MAX];
+    int pos = 12;
+    if (read_name(pkt, len, &pos, name) < 0 || pos + 4 > len)
+        return;
+    pos += 4; // type and class of the question
+
+    resolver_entry *e = find_entry(r, name);
+    if (e == NULL || e->state != ENTRY_PENDING || e->id != id) // late, duplicated or forged
+        return;
+
+    if (rcode != 0 && rcode != RCODE_NXDOMAIN)
+    {
+        fail(e, FAILURE_TTL);
+        return;
+    }
+
+    long ttl = MAX_TTL;
+    long negative_ttl = NEGATIVE_TTL;
+    int found = 0;
+    struct in_addr addr;
+    for (int i = 0; i < nanswers + nauthority; i++)
+    {
+        if (read_name(pkt, len, &pos, NULL) < 0 || pos + 10 > len)
+            break;
+        int type = read_u16(pkt + pos);
+        int rclass = read_u16(pkt + pos + 2);
+        long record_ttl = read_u32(pkt + pos + 4) & 0x7fffffff;
+        int rdlen = read_u16(pkt + pos + 8);
+        pos += 10;
+        if (pos + rdlen > len)
+            break;
+
+        if (i < nanswers && rclass == CLASS_IN && (type == TYPE_A || type == TYPE_CNAME))
+        {
+            if (record_ttl < ttl)
+                ttl = record_ttl;
+            if (type == TYPE_A && rdlen == 4 && !found)
+            {
+                memcpy(&addr, pkt + pos, 4);
+                found = 1;
+            }
+        }
+        else if (i >= nanswers && type == TYPE_SOA) // the SOA minimum caps how long the name may be remembered as missing
+        {
+            int p = pos;
+            if (read_name(pkt, len, &p, NULL) == 0 && read_name(pkt, len, &p, NULL) == 0 && p + 20 <= pos + rdlen)
+            {
+                long minimum = read_u32(pkt + p + 16);
+                negative_ttl = minimum < record_ttl ? minimum : record_ttl;
+            }
+        }
+        pos += rdlen;
+    }
+
+    if (rcode == 0 && found)
+    {
+        finish(e, ENTRY_RESOLVED, addr, ttl);
+    }
+    else
+    {
+        printf("Host %s not found\n", e->name);
+        fail(e, negative_ttl);
+    }
+}
+
+// called by the event loop when answers arrived on the socket
+static void on_answer(event_loop *loop, event_watcher *w, uint32_t events)
+{
+    resolver *r = (resolver *)w->data;
+    unsigned char pkt[DNS_PACKET_MAX];
+    while (1)
+    {
+        ssize_t len = recv(w->fd, pkt, sizeof(pkt), 0);
+        if (len < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+            continue; // e.g. ECONNREFUSED when the nameserver is down, the lookups time out
+        }
+        handle_answer(r, pkt, len);
+    }
+}
+
+// adds the IPv4 entries of /etc/hosts to the cache, they never expire
+static void load_hosts(resolver *r)
+{
+    FILE *file = fopen("/etc/hosts", "r");
+    if (file == NULL)
+        return;
+    char line[512];
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        char *comment = strchr(line, '#');
+        if (comment != NULL)
+            *comment = '\0';
+        char *saveptr;
+        char *field = strtok_r(line, " \t\r\n", &saveptr);
+        struct in_addr addr;
+        if (field == NULL || inet_pton(AF_INET, field, &addr) != 1)
+            continue;
+        char name[DNS_NAME_MAX];
+        while ((field = strtok_r(NULL, " \t\r\n", &saveptr)) != NULL)
+        {
+            if (normalize(field, name) < 0 || find_entry(r, name) != NULL) // the first line naming a host wins
+                continue;
+            resolver_entry *e = add_entry(r, name);
+            if (e == NULL)
+                break;
+            e->state = ENTRY_RESOLVED;
+            e->addr = addr;
+            e->expires = -1;
+        }
+    }
+    fclose(file);
+}
+
+resolver *resolver_create(event_loop *loop, const struct sockaddr_in *nameserver)
+{
+    resolver *r = (resolver *)calloc(1, sizeof(resolver));
+    if (r == NULL)
+        return NULL;
+    r->loop = loop;
+    r->seed = (uint32_t)time(NULL) ^ (uint32_t)getpid() ^ (uint32_t)(size_t)r;
+    if (r->seed == 0)
+        r->seed = 1;
+
+    // connecting the socket makes the kernel drop datagrams that do not come from the nameserver
+    r->socket.fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (r->socket.fd < 0 || connect(r->socket.fd, (const struct sockaddr *)nameserver, sizeof(*nameserver)) < 0)
+    {
+        perror("Error in creating the DNS socket");
+        if (r->socket.fd >= 0)
+            close(r->socket.fd);
+        free(r);
+        return NULL;
+    }
+    r->socket.cb = on_answer;
+    r->socket.data = r;
+    if (event_loop_add(loop, &r->socket, EPOLLIN) < 0)
+    {
+        perror("Error in watching the DNS socket");
+        close(r->socket.fd);
+        free(r);
+        return NULL;
+    }
+    load_hosts(r);
+    return r;
+}
+
+void resolver_destroy(resolver *r)
+{
+    for (int i = 0; i < ENTRY_BUCKETS; i++)
+    {
+        resolver_entry *e = r->entries[i];
+        while (e != NULL)
+        {
+            resolver_entry *next = e->next;
+            free(e->name);
+            free(e);
+            e = next;
+        }
+    }
+    event_loop_remove(r->loop, &r->socket);
+    close(r->socket.fd);
+    free(r);
+}
+
+int resolver_lookup(resolver *r, const char *name, resolver_query *query, struct in_addr *addr)
+{
+    if (inet_pton(AF_INET, name, addr) == 1) // already an address
+        return RESOLVER_DONE;
+
+    char key[DNS_NAME_MAX];
+    if (normalize(name, key) < 0)
+        return -1;
+
+    resolver_entry *e = find_entry(r, key);
+    if (e != NULL && e->state != ENTRY_PENDING && (e->expires < 0 || monotonic_now() < e->expires))
+    {
+        if (e->state == ENTRY_FAILED)
+            return -1;
+        *addr = e->addr;
+        return RESOLVER_DONE;
+    }
+
+    if (e == NULL)
+    {
+        e = add_entry(r, key);
+        if (e == NULL)
+            return -1;
+    }
+    if (e->state != ENTRY_PENDING) // nobody is looking the name up yet
+    {
+        e->state = ENTRY_PENDING;
+        e->tries = 0;
+        if (send_query(r, e) < 0)
+        {
+            fail(e, FAILURE_TTL);
+            return -1;
+        }
+    }
+
+    query->entry = e;
+    query->prev = NULL;
+    query->next = e->waiting;
+    if (e->waiting != NULL)
+        e->waiting->prev = query;
+    e->waiting = query;
+    return RESOLVER_PENDING;
+}
+
+void resolver_cancel(resolver *r, resolver_query *query)
+{
+    resolver_entry *e = query->entry;
+    if (e == NULL)
+        return;
+    if (query->prev != NULL)
+        query->prev->next = query->next;
+    else
+        e->waiting = query->next;
+    if (query->next != NULL)
+        query->next->prev = query->prev;
+    query->entry = NULL;
+}
+
+void resolver_sweep(resolver *r)
+{
+    time_t now = monotonic_now();
+    for (int i = 0; i < ENTRY_BUCKETS; i++)
+    {
+        resolver_entry **link = &r->entries[i];
+        while (*link != NULL)
+        {
+            resolver_entry *e = *link;
+            if (e->state == ENTRY_PENDING)
+            {
+                if (now - e->sent_at >= QUERY_TIMEOUT)
+                {
+                    if (e->tries < QUERY_TRIES)
+                    {
+                        send_query(r, e);
+                    }
+                    else
+                    {
+                        printf("DNS lookup of %s timed out\n", e->name);
+                        fail(e, FAILURE_TTL);
+                    }
+                }
+            }
+            else if (e->expires >= 0 && now >= e->expires)
+            {
+                *link = e->next;
+                free(e->name);
+                free(e);
+                continue;
+            }
+            link = &e->next;
+        }
+    }
+}
+
+int resolver_system_nameserver(struct sockaddr_in *nameserver)
+{
+    bzero(nameserver, sizeof(*nameserver));
+    nameserver->sin_family = AF_INET;
+    nameserver->sin_port = htons(DNS_PORT);
+    nameserver->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    FILE *file = fopen("/etc/resolv.conf", "r");
+    if (file == NULL)
+        return -1;
+    char line[256];
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        char addr[64];
+        if (sscanf(line, " nameserver %63s", addr) == 1 && inet_pton(AF_INET, addr, &nameserver->sin_addr) == 1)
+            break; // only IPv4 nameservers are supported, the first one is used
+    }
+    fclose(file);
+    return 0;
+}
@@ -0,0 +1,78 @@
+/*
+ * resolver.h -- non-blocking DNS resolver with a cache.
+ *
+ * Host names are resolved to IPv4 addresses by sending A queries over UDP to
+ * a single nameserver, the answer is read by the event loop, so no worker
+ * ever blocks on a lookup. Every worker owns a resolver, which is only used by
+ * the thread running the worker's event loop and needs no locking.
+ *
+ * Answers are cached for the TTL the nameserver gave them. Names that do not
+ * exist are cached too, for the time the SOA record of the answer asks for,
+ * and failed lookups for a few seconds, so a burst of requests for a broken
+ * host does not turn into a burst of queries. Concurrent lookups of the same
+ * name share a single query. Entries of /etc/hosts are always answered from
+ * the cache.
+ */
+
+#include "event_loop.h"
+#include <netinet/in.h>
+
+#ifndef RESOLVER
+#define RESOLVER
+
+typedef struct resolver resolver;
+typedef struct resolver_entry resolver_entry;
+typedef struct resolver_query resolver_query;
+
+/* status is RESOLVER_DONE and addr the address of the name, or -1 if it could
+ * not be resolved */
+typedef void (*resolver_fn)(resolver_query *query, int status, struct in_addr addr);
+
+/*
+   A query waits for the answer to a lookup. It is embedded in the object
+   that needs the address (a client connection for example).
+ */
+struct resolver_query
+{
+   resolver_fn done;       // called with the outcome of a pending lookup
+   void *data;             // owner of the query
+   resolver_entry *entry;  // lookup the query waits for, NULL when it is not waiting
+   resolver_query *prev;   // queries waiting for the same lookup
+   resolver_query *next;
+};
+
+/* Create the resolver of the worker running loop, queries are sent to
+ * nameserver. Returns NULL on failure. */
+resolver *resolver_create(event_loop *loop, const struct sockaddr_in *nameserver);
+
+/* Free the resolver, no query may be waiting */
+void resolver_destroy(resolver *r);
+
+/*
+   Resolve name, returns:
+
+   RESOLVER_DONE:    *addr is the address of name, found in the cache or
+                     written as a numeric address.
+   RESOLVER_PENDING: a query was sent (or another lookup of the same name is
+                     under way), query->done() is called with the outcome.
+   -1:               name is known not to resolve, or the lookup could not be
+                     started.
+ */
+#define RESOLVER_DONE 0
+#define RESOLVER_PENDING 1
+int resolver_lookup(resolver *r, const char *name, resolver_query *query, struct in_addr *addr);
+
+/* Stop waiting for a pending lookup, query->done() will not be called. Does
+ * nothing if the query is not waiting. */
+void resolver_cancel(resolver *r, resolver_query *query);
+
+/* Resend the queries that got no answer, fail those that got none after a
+ * few tries and drop the expired entries. The owner calls it about once a
+ * second. */
+void resolver_sweep(resolver *r);
+
+/* Read the nameserver of /etc/resolv.conf into *nameserver, 127.0.0.1 if it
+ * has none. Returns 0 on success, -1 if the file could not be read. */
+int resolver_system_nameserver(struct sockaddr_in *nameserver);
+
+#endif
@@ -0,0 +1,149 @@
+/*
+  scan.c -- vectorised search for delimiter bytes.
+*/
+
+#include "scan.h"
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86
+#endif
+
+typedef const char *(*scan_fn)(const char *p, size_t len, const char *set, size_t set_len);
+
+// one byte at a time, against a bitmap of the set
+static const char *scan_scalar(const char *p, size_t len, const char *set, size_t set_len)
+{
+    uint32_t bits[8] = {0};
+    for (size_t k = 0; k < set_len; k++)
+    {
+        unsigned char c = set[k];
+        bits[c >> 5] |= 1u << (c & 31);
+    }
+    for (size_t i = 0; i < len; i++)
+    {
+        unsigned char c = p[i];
+        if (bits[c >> 5] & (1u << (c & 31)))
+            return p + i;
+    }
+    return NULL;
+}
+
+#ifdef SCAN_X86
+
+// a block of 16 bytes at p does not cross into the next page, reading it whole cannot fault even past the end of the bytes asked for
+#define SAME_PAGE(p) (((uintptr_t)(p) & 4095) <= 4096 - 16)
+
+/*
+    The search_sse42 function compares 16 bytes at a time with the whole set at once: pcmpestri takes the number of valid bytes of
+    both operands, so the last bytes of p are one more block, counted as fewer than 16, rather than a byte loop. Most header names
+    and list elements are shorter than a block, this is the whole search for them. It is inlined in the AVX2 kernel as well, so that
+    its instructions get the VEX encoding there and no switch between the two encodings is paid.
+*/
+__attribute__((target("sse4.2"), always_inline)) static inline const char *search_sse42(const char *p, size_t len, const char *set, size_t set_len)
+{
+    const int mode = _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_LEAST_SIGNIFICANT;
+    __m128i needles;
+    if (SAME_PAGE(set))
+    {
+        needles = _mm_loadu_si128((const __m128i *)set); // the bytes past set_len are not compared
+    }
+    else
+    {
+        char padded[16] = {0};
+        memcpy(padded, set, set_len);
+        needles = _mm_loadu_si128((const __m128i *)padded);
+    }
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(p + i));
+        int index = _mm_cmpestri(needles, (int)set_len, chunk, 16, mode);
+        if (index < 16)
+            return p + i + index;
+    }
+    if (i == len)
+        return NULL;
+    if (!SAME_PAGE(p + i))
+        return scan_scalar(p + i, len - i, set, set_len);
+    __m128i chunk = _mm_loadu_si128((const __m128i *)(p + i));
+    int index = _mm_cmpestri(needles, (int)set_len, chunk, (int)(len - i), mode);
+    return index < 16 ? p + i + index : NULL;
+}
+
+__attribute__((target("sse4.2"))) static const char *scan_sse42(const char *p, size_t len, const char *set, size_t set_len)
+{
+    return search_sse42(p, len, set, set_len);
+}
+
+// 32 bytes at a time, one comparison per delimiter
+__attribute__((target("avx2,sse4.2"))) static const char *scan_avx2(const char *p, size_t len, const char *set, size_t set_len)
+{
+    if (len < 32) // a block of 16 and the tail, without broadcasting the set
+        return search_sse42(p, len, set, set_len);
+    __m256i needles[SCAN_MAX_SET];
+    for (size_t k = 0; k < set_len; k++)
+    {
+        needles[k] = _mm256_set1_epi8(set[k]);
+    }
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32)
+    {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)(p + i));
+        __m256i hit = _mm256_cmpeq_epi8(chunk, needles[0]);
+        for (size_t k = 1; k < set_len; k++)
+        {
+            hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(chunk, needles[k]));
+        }
+        unsigned mask = (unsigned)_mm256_movemask_epi8(hit);
+        if (mask != 0)
+            return p + i + __builtin_ctz(mask);
+    }
+    return search_sse42(p + i, len - i, set, set_len);
+}
+
+#endif
+
+static const char *scan_resolve(const char *p, size_t len, const char *set, size_t set_len);
+
+static scan_fn kernel = scan_resolve; // replaced by the best kernel of the CPU on the first call
+static const char *kernel_name = "scalar";
+
+// picks the kernel, threads racing here all pick the same one
+static scan_fn pick_kernel()
+{
+    scan_fn fn = scan_scalar;
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        fn = scan_avx2;
+        kernel_name = "avx2";
+    }
+    else if (__builtin_cpu_supports("sse4.2"))
+    {
+        fn = scan_sse42;
+        kernel_name = "sse4.2";
+    }
+#endif
+    __atomic_store_n(&kernel, fn, __ATOMIC_RELAXED);
+    return fn;
+}
+
+static const char *scan_resolve(const char *p, size_t len, const char *set, size_t set_len)
+{
+    return pick_kernel()(p, len, set, set_len);
+}
+
+const char *scan_any(const char *p, size_t len, const char *set, size_t set_len)
+{
+    return __atomic_load_n(&kernel, __ATOMIC_RELAXED)(p, len, set, set_len);
+}
+
+const char *scan_kernel()
+{
+    pick_kernel();
+    return kernel_name;
+}
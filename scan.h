@@ -0,0 +1,27 @@
+/*
+ * scan.h -- vectorised search for delimiter bytes.
+ *
+ * The parsers look for the first of a few delimiters (':' or the whitespace
+ * that must not come before it in a header, the separators of a list) in
+ * lines that are mostly plain text. scan_any() compares 32 or 16 bytes at a
+ * time with AVX2 or SSE4.2 when the CPU has them, the kernel is chosen at
+ * runtime the first time it is called, and falls back to a byte loop
+ * elsewhere. Single bytes are best found with memchr(), which glibc already
+ * vectorises the same way, and the line ends of a request are found so.
+ */
+
+#include <stddef.h>
+
+#ifndef SCAN
+#define SCAN
+
+#define SCAN_MAX_SET 16 // delimiters scan_any() can look for at once
+
+/* First byte of p[0..len) that is one of the set_len bytes of set, NULL if
+ * there is none. set_len is at most SCAN_MAX_SET. */
+const char *scan_any(const char *p, size_t len, const char *set, size_t set_len);
+
+/* Name of the kernel scan_any() uses, for the log */
+const char *scan_kernel();
+
+#endif
@@ -1,338 +1,1915 @@
-#include "proxy_parse.h"
+#include "http_request.h"
+#include "scan.h"
+#include "event_loop.h"
+#include "cache.h"
+#include "cache_policy.h"
+#include "cache_encoding.h"
+#include "http_response.h"
+#include "http_cache.h"
+#include "upstream_pool.h"
+#include "resolver.h"
+#include "disk_cache.h"
+#include "buffer_pool.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <time.h>
+#include <errno.h>
+#include <signal.h>
 #include <pthread.h>
-#include <semaphore.h>
 #include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/sendfile.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
-#include <netdb.h>
+#include <fcntl.h>
 
-#define MAX_CLIENTS 10
 #define MAX_BYTES 4096
-#define MAX_ELEMENT_SIZE 10 * (1 << 10)
-#define MAX_SIZE 200 * (1 << 20)
+#define MAX_HEAD_BYTES (64 * 1024) // longest request head, heads longer than MAX_BYTES move to a buffer from the heap
+#define REQ_IOV (HTTP_MAX_HEADERS + 16) // pieces of a forwarded request: runs of the client's headers and the fragments patched in
+#define MAX_IOV 16 // chunks handed to one writev()
+#define AGE_HEAD_MAX 512 // bytes at the start of a cached response its Age header is added in, replacing the one of the remote server
+#define SPLICE_MIN MAX_BYTES       // bodies shorter than this are copied through buf, a pipe costs more than the copy
+#define SPLICE_BYTES (64 * 1024)   // bytes moved by one splice(), the default capacity of a pipe
+#define CACHE_SHARDS_PER_WORKER 16 // enough shards that workers rarely hit the same lock, cache_init() may use fewer
+#define UPSTREAM_CONNS_PER_HOST 32 // default limit of connections a worker opens to the same remote server
+#define UPSTREAM_IDLE_TIMEOUT 30   // default seconds an unused connection to a remote server is kept open
+#define UPSTREAM_WAIT_TIMEOUT 10   // seconds a request waits for a connection to a remote server at most
+#define UPSTREAM_TIMEOUT 30        // seconds a fetch may go without hearing from its remote server or client before it fails
+#define KEEP_ALIVE_TIMEOUT 15      // default seconds a client connection may wait for its next request
+#define SNAPSHOT_INTERVAL 60       // default seconds between two snapshots of the cache
+#define SPARE_BUFFERS 1024         // I/O buffers a worker keeps for its next connections
+#define SPARE_CONNS 256            // connection states a worker keeps for its next connections
+#define STATS_INTERVAL 60          // seconds between two reports of the request counters of a worker
+
+typedef struct client_conn client_conn;
+typedef struct worker worker;
 
-typedef struct cache_element cache_element;
-typedef struct ParsedRequest ParsedRequest;
+/*
+    A worker owns one listening socket, one event loop and one pool of connections to remote servers. Every worker binds its own socket
+    to the same port with SO_REUSEPORT, so the kernel spreads new connections over the workers and nothing is shared between them on the
+    accept path. A timer ticks every second to close the connections that stayed idle for too long.
+*/
+struct worker
+{
+    int id;             // index of the worker, also the CPU it prefers
+    pthread_t tid;      // thread running the worker
+    int proxy_socket_id; // listening socket of this worker
+    event_loop *loop;   // loop driving every socket accepted by this worker
+    upstream_pool *pool; // idle connections to remote servers, reused by the requests of this worker
+    resolver *dns;      // addresses of remote servers, looked up without blocking
+    event_watcher tick; // timerfd firing every second
+    client_conn *idle_head; // client connections waiting for a request, the one waiting the longest first
+    client_conn *idle_tail;
+    client_conn *fetch_head; // connections fetching a response, the one that made no progress for the longest first
+    client_conn *fetch_tail;
+    buffer_pool buffers; // I/O buffers and arena blocks, reused by the connections of this worker
+    client_conn *spare; // freed connection states, reused for the next connections
+    int nspare;
+    unsigned long requests; // requests read by the connections of this worker
+    unsigned long reported; // requests when the counters were last reported
+    int ticks;          // ticks since the counters were last reported
+};
 
-struct cache_element
+/*
+    Every client connection is a small state machine driven by the event loop. A connection first reads the request, then either
+    sends a cached response or gets a connection to the remote server from the pool, forwards the request and relays the response back.
+    Once the response is sent the connection reads the next request, unless the client or the response asked for it to be closed.
+    Requests the client pipelined wait in the buffer and are served one after the other, in order.
+*/
+typedef enum
 {
-    char *data;            // data stream
-    int len;               // size of data
-    char *url;             // request url
-    time_t lru_time_track; // how long this cache has been stored
-    cache_element *next;   // next element
+    CONN_READ_REQUEST, // reading the request from the client, or waiting for the next one
+    CONN_SEND_CACHED,  // sending a cached response to the client
+    CONN_SEND_STORED,  // sending a response from the disk cache to the client
+    CONN_WAIT_UPSTREAM, // waiting for a connection to the remote server, the worker has too many open to that host
+    CONN_RESOLVING,    // waiting for the address of the remote server
+    CONN_CONNECTING,   // waiting for the non-blocking connect to the remote server
+    CONN_RELAY,        // sending the request to the remote server and relaying its response to the client
+    CONN_CLOSED        // both sockets are closed, the connection is freed after the current batch of events
+} conn_state;
+
+struct client_conn
+{
+    conn_state state;
+    event_loop *loop;
+    event_watcher client; // client socket
+    event_watcher remote; // remote server socket, fd is -1 until the request is forwarded
+    worker *owner;        // worker whose loop drives the connection
+    char *buffer;         // requests received from the client, the current one first
+    int buffer_size;      // MAX_BYTES for a buffer of the pool, MAX_HEAD_BYTES once a long head moved it to the heap
+    int buffer_len;       // bytes received so far
+    int request_len;      // length of the current request in buffer, the bytes after it belong to pipelined requests
+    http_request request; // head of the current request, parsed as it is received, its fields point into buffer
+    int keep_alive;       // the client wants the connection kept open after the current response
+    int idle;             // the connection is waiting for a request, in the list of its worker
+    time_t idle_since;    // time the connection started waiting for a request
+    client_conn *idle_prev; // connections of the same worker waiting for a request
+    client_conn *idle_next;
+    int fetching;         // the connection is fetching a response, in the list of its worker
+    time_t fetch_since;   // time the fetch last made progress
+    client_conn *fetch_prev; // connections of the same worker fetching a response
+    client_conn *fetch_next;
+    arena scratch;        // memory that lives as long as the current request
+    char *url;            // canonical url of the request, in scratch
+    cache_key url_key;    // key of url alone, the Vary names of its responses are remembered under it
+    cache_key key;        // cache key of the response: url, followed by the values of the request headers named in vary
+    char vary[CACHE_VARY_MAX]; // names of the request headers the responses for the request vary on, empty if they do not
+    cache_element *cached; // pinned cache element being sent to the client, complete or still filled by another request
+    cache_cursor cursor;  // next byte of the cached element to send
+    cache_waiter waiter;  // registration with an element that is still filling
+    cache_decoder decoder; // inflates a gzip copy of the response for a client that does not accept gzip
+    int decoding;         // the response is sent through decoder
+    char age[AGE_HEAD_MAX + 32]; // start of the head of the cached response with its Age header, sent before the rest of it
+    size_t age_len;       // bytes of age in use, 0 when the response goes without Age
+    size_t age_pos;       // bytes of age already sent
+    event_watcher notify; // eventfd written by the cache when the followed element grows, fd is -1 when not following
+    upstream_lease lease; // connection to the remote server borrowed from the pool
+    resolver_query dns;   // lookup of the address of the remote server
+    int reused;           // the remote connection came from the pool, the server may have closed it meanwhile
+    time_t request_time;  // wall clock time the request was forwarded, the age of the response counts from then
+    cache_freshness freshness; // until when the response may be used, once its headers were checked
+    cache_element *stale; // pinned stale response the fetch revalidates, served instead if it turns out valid or the fetch fails
+    int conditional;      // the request carries the validators of stale, the remote server answers 304 if it did not change
+    struct iovec req[REQ_IOV]; // request forwarded to the remote server, pointing into buffer, kept to send it again if a reused connection fails
+    int req_iov;          // pieces of req in use
+    size_t req_len;       // length of req
+    size_t req_pos;       // number of bytes of req already sent
+    char *buf;            // chunk of the response waiting to be sent to the client
+    int buf_len;          // number of valid bytes in buf
+    int buf_pos;          // number of bytes of buf already sent
+    int pipe[2];          // pipe the body is spliced through from the remote server to the client, -1 until a body is big enough
+    int pipe_len;         // bytes in pipe not sent to the client yet
+    int tee[2];           // pipe the spliced bytes are duplicated into for the cache, -1 when the response is not cached
+    http_response response; // framing of the response, tells where it ends on a connection that stays open
+    int response_done;    // the whole response was received, the remote connection went back to the pool
+    long response_len;    // bytes of the response received from the remote server
+    cache_element *fill;  // element the response is cached into while it is relayed, NULL if it is not cacheable
+    cache_encoder encoder; // deflates the body of fill as it arrives, for the gzip copy cached instead once it is complete
+    int encoding;         // the body of fill goes through encoder
+    int share;            // the body of fill may be shared with other urls, until its start was marked
+    disk_object stored;   // response sent from the disk cache
+    off_t stored_pos;     // bytes of stored already sent
+    disk_object store;    // room in the disk cache the response is written to while it is relayed, segment is NULL if it is not
+    int headers_checked;  // the headers of the response were checked for whether and until when it is cached
 };
 
-cache_element *find(char *url);                         // to find a cached result
-int add_cache_element(char *data, int size, char *url); // to add a result to cache
-void remove_cache_element();                            // to remove the longest stored cache
+int sendErrorMessage(int socket, int status_code); // to send an HTTP error response
 
 int port_number = 8080; // port for our socket
-int proxy_socket_id;
-pthread_t tid[MAX_CLIENTS];
-sem_t semaphore;      // used for process synchronization
-pthread_mutex_t lock; // same as semaphore only two values - on and off
-
-cache_element *head;
-int cache_size;
+int upstream_conns_per_host = UPSTREAM_CONNS_PER_HOST; // limit of connections a worker opens to the same remote server
+int upstream_idle_timeout = UPSTREAM_IDLE_TIMEOUT;     // seconds an unused connection to a remote server is kept open
+int keep_alive_timeout = KEEP_ALIVE_TIMEOUT;           // seconds a client connection may wait for its next request
+const char *disk_cache_dir = NULL;                     // directory of the disk cache, NULL to cache in memory only
+long disk_cache_size = DISK_MAX_SIZE;                  // megabytes the disk cache may use
+const char *snapshot_path = NULL;                      // file the cache is saved to and restored from, NULL to start cold
+int snapshot_interval = SNAPSHOT_INTERVAL;             // seconds between two snapshots
+const char *eviction_policy = CACHE_POLICY_DEFAULT;    // name of the policy the memory cache evicts with
+int gzip_level = 0;                                    // zlib level text responses are cached compressed with, 0 caches them as they are
 
 /*
-    The connectRemoteServer function establishes a TCP connection to a remote server with host address host_addr and port number port_num and returns the socket descriptor on success, or -1 on failure.
+    The connectRemoteServer function starts a non-blocking TCP connection to a remote server with IPv4 address host_addr and port number port_num and returns the socket descriptor on success, or -1 on failure.
+    The connection is usually still in progress when it returns, the event loop reports the socket as writable once it is established.
+    The host name is resolved beforehand by the resolver of the worker, which never blocks.
 */
-int connectRemoteServer(char *host_addr, int port_num)
+int connectRemoteServer(struct in_addr host_addr, int port_num)
 {
-    int remoteSocket = socket(AF_INET, SOCK_STREAM, 0); // remote socket created by the socket() function
-    if (remoteSocket < 0)                               // if socket creation was not successfull
+    int remoteSocket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0); // remote socket created by the socket() function
+    if (remoteSocket < 0)                                                              // if socket creation was not successfull
     {
         printf("Error in create remote socket !\n");
         return -1;
     }
-    struct hostent *host = gethostbyname(host_addr); // a structure containing host information
-    if (host == NULL)                                // if the hostname resolution was unsuccessful
-    {
-        fprintf(stderr, "No such host exists\n");
-        return -1;
-    }
 
     struct sockaddr_in server_addr;                   // server address information
     bzero((char *)&server_addr, sizeof(server_addr)); // initializes the structure to zero
     server_addr.sin_family = AF_INET;                 // sets the address family to IPv4
     server_addr.sin_port = htons(port_num);           // sets the port number in network byte order
+    server_addr.sin_addr = host_addr;                 // the address is already in network byte order
 
-    bcopy((char *)&host->h_addr_list, (char *)&server_addr.sin_addr.s_addr, host->h_length);              // copies the IP address from host to the server_addr structure
-    if (connect(remoteSocket, (const struct sockaddr *)&server_addr, (socklen_t)sizeof(server_addr)) < 0) // attempts to connect to the server using the specified socket, address, and length
+    // a non-blocking connect returns EINPROGRESS while the handshake is still running
+    if (connect(remoteSocket, (const struct sockaddr *)&server_addr, (socklen_t)sizeof(server_addr)) < 0 && errno != EINPROGRESS)
     {
         fprintf(stderr, "Error in connecting\n"); // print error message if connection was unsuccessfull
+        close(remoteSocket);
         return -1;
     }
     return remoteSocket; // return the socket desciptor on success
 }
 
+static void on_client_event(event_loop *loop, event_watcher *w, uint32_t events);
+static void on_remote_event(event_loop *loop, event_watcher *w, uint32_t events);
+static void on_notify_event(event_loop *loop, event_watcher *w, uint32_t events);
+static void conn_close(client_conn *conn);
+static void fail_request(client_conn *conn);
+static void serve_stale(client_conn *conn, int reusable);
+static void send_cached(client_conn *conn);
+static void send_element(client_conn *conn);
+static void dispatch_request(client_conn *conn);
+static void read_request(client_conn *conn);
+static void on_upstream_ready(upstream_lease *lease, int status);
+static void on_resolved(resolver_query *query, int status, struct in_addr addr);
+
+static time_t monotonic_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+// the connection starts waiting for a request, the worker's tick closes it if the request takes too long to arrive
+static void start_waiting(client_conn *conn)
+{
+    worker *owner = conn->owner;
+    conn->state = CONN_READ_REQUEST;
+    conn->idle = 1;
+    conn->idle_since = monotonic_now();
+    conn->idle_next = NULL;
+    conn->idle_prev = owner->idle_tail;
+    if (owner->idle_tail != NULL)
+        owner->idle_tail->idle_next = conn;
+    else
+        owner->idle_head = conn;
+    owner->idle_tail = conn;
+}
+
+// the connection got its request or is being closed
+static void stop_waiting(client_conn *conn)
+{
+    worker *owner = conn->owner;
+    if (!conn->idle)
+        return;
+    if (conn->idle_prev != NULL)
+        conn->idle_prev->idle_next = conn->idle_next;
+    else
+        owner->idle_head = conn->idle_next;
+    if (conn->idle_next != NULL)
+        conn->idle_next->idle_prev = conn->idle_prev;
+    else
+        owner->idle_tail = conn->idle_prev;
+    conn->idle_prev = conn->idle_next = NULL;
+    conn->idle = 0;
+}
+
+// the fetch is over, or the connection is being closed
+static void stop_fetching(client_conn *conn)
+{
+    worker *owner = conn->owner;
+    if (!conn->fetching)
+        return;
+    if (conn->fetch_prev != NULL)
+        conn->fetch_prev->fetch_next = conn->fetch_next;
+    else
+        owner->fetch_head = conn->fetch_next;
+    if (conn->fetch_next != NULL)
+        conn->fetch_next->fetch_prev = conn->fetch_prev;
+    else
+        owner->fetch_tail = conn->fetch_prev;
+    conn->fetch_prev = conn->fetch_next = NULL;
+    conn->fetching = 0;
+}
+
+// a fetch starts or made progress, the worker's tick fails it once it makes none for UPSTREAM_TIMEOUT seconds
+static void start_fetching(client_conn *conn)
+{
+    worker *owner = conn->owner;
+    stop_fetching(conn); // moves to the end of the list
+    conn->fetching = 1;
+    conn->fetch_since = monotonic_now();
+    conn->fetch_next = NULL;
+    conn->fetch_prev = owner->fetch_tail;
+    if (owner->fetch_tail != NULL)
+        owner->fetch_tail->fetch_next = conn;
+    else
+        owner->fetch_head = conn;
+    owner->fetch_tail = conn;
+}
+
+// creates the state for a newly accepted client socket
+static client_conn *conn_create(worker *owner, int socket)
+{
+    client_conn *conn = owner->spare;
+    if (conn != NULL) // reuse the state of a closed connection
+    {
+        owner->spare = conn->idle_next;
+        owner->nspare--;
+        memset(conn, 0, sizeof(client_conn));
+    }
+    else
+    {
+        owner->buffers.heap_allocs++;
+        conn = (client_conn *)calloc(1, sizeof(client_conn));
+        if (conn == NULL)
+            return NULL;
+    }
+    conn->buffer = (char *)buffer_get(&owner->buffers); // buffer to store received data
+    if (conn->buffer == NULL)
+    {
+        free(conn);
+        return NULL;
+    }
+    conn->buffer[0] = '\0';
+    conn->buffer_size = MAX_BYTES;
+    http_request_init(&conn->request);
+    arena_init(&conn->scratch, &owner->buffers);
+    conn->loop = owner->loop;
+    conn->owner = owner;
+    conn->client.fd = socket;
+    conn->client.cb = on_client_event;
+    conn->client.data = conn;
+    conn->remote.fd = -1;
+    conn->remote.cb = on_remote_event;
+    conn->remote.data = conn;
+    conn->notify.fd = -1;
+    conn->notify.cb = on_notify_event;
+    conn->notify.data = conn;
+    conn->lease.ready = on_upstream_ready;
+    conn->lease.data = conn;
+    conn->dns.done = on_resolved;
+    conn->dns.data = conn;
+    conn->pipe[0] = conn->pipe[1] = -1;
+    conn->tee[0] = conn->tee[1] = -1;
+    start_waiting(conn);
+    return conn;
+}
+
+// releases a closed connection, called by the event loop after the batch of events it was closed in
+static void conn_free(void *arg)
+{
+    client_conn *conn = (client_conn *)arg;
+    worker *owner = conn->owner;
+    if (conn->buffer_size == MAX_BYTES)
+        buffer_put(&owner->buffers, conn->buffer);
+    else
+        free(conn->buffer);
+    buffer_put(&owner->buffers, conn->buf);
+    arena_reset(&conn->scratch);
+    if (owner->nspare < SPARE_CONNS)
+    {
+        conn->idle_next = owner->spare;
+        owner->spare = conn;
+        owner->nspare++;
+        return;
+    }
+    free(conn);
+}
+
+// starts streaming conn->cached while another request fills it, returns -1 on failure
+static int follow_element(client_conn *conn)
+{
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd < 0)
+    {
+        perror("Error in creating an eventfd");
+        return -1;
+    }
+    conn->notify.fd = fd;
+    if (event_loop_add(conn->loop, &conn->notify, EPOLLIN) < 0)
+    {
+        perror("Error in watching the eventfd");
+        close(fd);
+        conn->notify.fd = -1;
+        return -1;
+    }
+    conn->waiter.fd = fd;
+    cache_follow(conn->cached, &conn->waiter);
+    return 0;
+}
+
+// stops streaming conn->cached and drops the connection's reference to it
+static void stop_following(client_conn *conn)
+{
+    if (conn->notify.fd >= 0)
+    {
+        cache_unfollow(conn->cached, &conn->waiter); // the filler must not write the eventfd once it is closed
+        event_loop_remove(conn->loop, &conn->notify);
+        close(conn->notify.fd);
+        conn->notify.fd = -1;
+    }
+    if (conn->cached != NULL)
+    {
+        release_cache_element(conn->cached);
+        conn->cached = NULL;
+    }
+}
+
+// closes both ends of a pipe, if it is open
+static void close_pipe(int fds[2])
+{
+    if (fds[0] >= 0)
+    {
+        close(fds[0]);
+        close(fds[1]);
+        fds[0] = fds[1] = -1;
+    }
+}
+
+// releases what the current request holds: the element it follows, its lookup and connection to the remote server, its pipes and the element it fills
+static void end_exchange(client_conn *conn)
+{
+    stop_fetching(conn);
+    if (conn->decoding)
+    {
+        cache_decoder_end(&conn->decoder);
+        conn->decoding = 0;
+    }
+    if (conn->encoding)
+    {
+        cache_encoder_end(&conn->encoder);
+        conn->encoding = 0;
+    }
+    stop_following(conn);
+    close_pipe(conn->pipe); // bytes still in the pipes belong to a response that is given up
+    close_pipe(conn->tee);
+    conn->pipe_len = 0;
+    resolver_cancel(conn->owner->dns, &conn->dns);
+    if (conn->remote.fd >= 0)
+    {
+        event_loop_remove(conn->loop, &conn->remote);
+    }
+    upstream_release(conn->owner->pool, &conn->lease, conn->remote.fd, 0); // close the connection to the remote server, its response did not end
+    conn->remote.fd = -1;
+    if (conn->fill != NULL) // the response did not complete, requests following it are told so
+    {
+        cache_fill_abandon(conn->fill);
+        conn->fill = NULL;
+    }
+    disk_cache_abandon(&conn->store);
+    disk_cache_release(&conn->stored);
+    if (conn->stale != NULL)
+    {
+        release_cache_element(conn->stale);
+        conn->stale = NULL;
+    }
+}
+
+// closes both sockets of the connection and schedules the connection to be freed
+static void conn_close(client_conn *conn)
+{
+    if (conn->state == CONN_CLOSED)
+        return;
+    stop_waiting(conn);
+    conn->state = CONN_CLOSED;
+    end_exchange(conn);
+    event_loop_remove(conn->loop, &conn->client);
+    shutdown(conn->client.fd, SHUT_RDWR); // Shut down a socket, SHUT_RDWR -> terminate both reading and writing operations
+    close(conn->client.fd);               // close the socket
+    conn->client.fd = -1;
+    event_loop_defer(conn->loop, conn_free, conn);
+}
+
+// reads the next request of a kept-alive connection, which may already be waiting in the buffer
+static void next_request(void *arg)
+{
+    client_conn *conn = (client_conn *)arg;
+    if (conn->state == CONN_READ_REQUEST) // the connection may have been closed, or gone on with a request, in the meantime
+    {
+        read_request(conn);
+    }
+}
+
+/*
+    The end_response function is called once the whole response to the current request reached the client. The connection then waits
+    for the next request if both the client and the response allow it, otherwise it is closed. The next request is read after the current
+    batch of events, so a client pipelining many requests that are all cached does not make the calls nest deeper and deeper.
+*/
+static void end_response(client_conn *conn, int keep_alive)
+{
+    if (!keep_alive || !conn->keep_alive)
+    {
+        conn_close(conn);
+        return;
+    }
+    end_exchange(conn);
+    arena_reset(&conn->scratch); // frees url
+    buffer_put(&conn->owner->buffers, conn->buf); // an idle connection only holds the buffer it reads requests into
+    conn->url = conn->buf = NULL;
+    conn->req_iov = 0;
+    conn->req_len = conn->req_pos = 0;
+    conn->buf_len = conn->buf_pos = 0;
+    conn->reused = 0;
+    conn->response_done = 0;
+    conn->response_len = 0;
+    conn->stored_pos = 0;
+    conn->age_len = conn->age_pos = 0;
+    conn->headers_checked = 0;
+    conn->conditional = 0;
+    conn->share = 0;
+
+    // the requests the client pipelined behind the current one move to the front of the buffer
+    conn->buffer_len -= conn->request_len;
+    memmove(conn->buffer, conn->buffer + conn->request_len, conn->buffer_len + 1);
+    conn->request_len = 0;
+    http_request_init(&conn->request);
+    if (conn->buffer_size > MAX_BYTES && conn->buffer_len < MAX_BYTES) // the long head is done with, go back to a buffer of the pool
+    {
+        char *buffer = (char *)buffer_get(&conn->owner->buffers);
+        if (buffer != NULL)
+        {
+            memcpy(buffer, conn->buffer, conn->buffer_len + 1);
+            free(conn->buffer);
+            conn->buffer = buffer;
+            conn->buffer_size = MAX_BYTES;
+        }
+    }
+
+    start_waiting(conn);
+    if (event_loop_defer(conn->loop, next_request, conn) < 0)
+    {
+        conn_close(conn);
+    }
+}
+
+// watches the connection to the remote server the request is sent over, returns -1 on failure
+static int watch_remote(client_conn *conn, int fd)
+{
+    conn->req_pos = 0; // nothing sent yet
+    conn->remote.fd = fd;
+    if (event_loop_add(conn->loop, &conn->remote, EPOLLIN | EPOLLOUT) < 0)
+    {
+        perror("Error in watching the remote socket");
+        close(fd);
+        conn->remote.fd = -1;
+        return -1;
+    }
+    conn->state = conn->reused ? CONN_RELAY : CONN_CONNECTING; // a reused connection is writable right away
+    return 0;
+}
+
+// opens a new connection to the resolved address of the remote server, returns -1 on failure
+static int connect_upstream(client_conn *conn, struct in_addr addr)
+{
+    int fd = connectRemoteServer(addr, conn->lease.host->port); // connects to the remote server
+    if (fd < 0)
+        return -1;
+    return watch_remote(conn, fd);
+}
+
+// called by the resolver once the address of the remote server is known
+static void on_resolved(resolver_query *query, int status, struct in_addr addr)
+{
+    client_conn *conn = (client_conn *)query->data;
+    if (status < 0 || connect_upstream(conn, addr) < 0)
+    {
+        fail_request(conn);
+    }
+}
+
+/*
+    The start_upstream function sends the request over the connection held by conn->lease, or over a new connection when the pool had
+    no idle one. A new connection first needs the address of the remote server, which the resolver may have to ask the nameserver for.
+    It returns 0 once the socket is watched or the lookup is under way, the rest happens in relay_response(), and -1 on failure.
+*/
+static int start_upstream(client_conn *conn)
+{
+    conn->reused = conn->lease.fd >= 0;
+    if (conn->reused)
+        return watch_remote(conn, conn->lease.fd);
+
+    struct in_addr addr;
+    int status = resolver_lookup(conn->owner->dns, conn->lease.host->name, &conn->dns, &addr);
+    if (status < 0)
+        return -1;
+    if (status == RESOLVER_PENDING) // on_resolved() continues
+    {
+        conn->state = CONN_RESOLVING;
+        return 0;
+    }
+    return connect_upstream(conn, addr);
+}
+
+// called by the pool once a request that waited for a connection to its host got one, or waited too long
+static void on_upstream_ready(upstream_lease *lease, int status)
+{
+    client_conn *conn = (client_conn *)lease->data;
+    if (status < 0)
+        printf("Gave up waiting for a connection to the remote server\n");
+    if (status < 0 || start_upstream(conn) < 0)
+    {
+        fail_request(conn);
+    }
+}
+
+// adds n bytes to the request forwarded to the remote server, they must stay in place until the response is done
+static void add_piece(client_conn *conn, const char *data, size_t n)
+{
+    if (n == 0)
+        return;
+    conn->req[conn->req_iov].iov_base = (void *)data;
+    conn->req[conn->req_iov].iov_len = n;
+    conn->req_iov++;
+    conn->req_len += n;
+}
+
+static void add_view(client_conn *conn, http_view v)
+{
+    add_piece(conn, v.data, v.len);
+}
+
 /*
     The handle_request function handle's an incoming HTTP request, forwards it to a remote server and returns the response to the client. It also caches the response for potential future use.
     So basically client -> proxy_server -> server, back and forth
+    It only builds the request and gets a connection from the pool, the rest happens in relay_response() whenever one of the sockets is ready.
+*/
+int handle_request(client_conn *conn, http_request *request)
+{
+    start_fetching(conn); // from here on a remote server that stays silent fails the request
+    // a stale response is revalidated with its own validators, unless the client validates a copy of its own
+    cache_element *stale = conn->stale;
+    int own_validators = http_request_known(request, HTTP_IF_NONE_MATCH) != NULL || http_request_known(request, HTTP_IF_MODIFIED_SINCE) != NULL;
+    conn->conditional = stale != NULL && (stale->etag[0] != '\0' || stale->last_modified >= 0) && (conn->client.fd < 0 || !own_validators);
+
+    // the request line with the path alone, then the header lines of the client as they were received, except the ones only meant for the proxy
+    conn->req_iov = 0;
+    conn->req_len = 0;
+    add_piece(conn, "GET ", 4);
+    add_view(conn, request->path);
+    add_piece(conn, " ", 1);
+    add_view(conn, request->version);
+    add_piece(conn, "\r\n", 2);
+    const char *run = NULL; // start of the headers forwarded since the last one left out
+    for (size_t i = 0; i < request->nheaders; i++)
+    {
+        http_header *h = &request->headers[i];
+        int hop = h->known == HTTP_CONNECTION || h->known == HTTP_PROXY_CONNECTION || h->known == HTTP_KEEP_ALIVE ||
+                  (conn->conditional && (h->known == HTTP_IF_NONE_MATCH || h->known == HTTP_IF_MODIFIED_SINCE)); // replaced by those of stale
+        if (hop && run != NULL)
+        {
+            add_piece(conn, run, h->name.data - run);
+            run = NULL;
+        }
+        else if (!hop && run == NULL)
+        {
+            run = h->name.data;
+        }
+    }
+    if (run != NULL)
+        add_piece(conn, run, conn->buffer + request->headers_end - run);
+    if (http_request_known(request, HTTP_HOST) == NULL) // the remote server needs to know the host, it is in the target of the request
+    {
+        add_piece(conn, "Host: ", 6);
+        add_view(conn, request->host);
+        if (request->port.len > 0)
+        {
+            add_piece(conn, ":", 1);
+            add_view(conn, request->port);
+        }
+        add_piece(conn, "\r\n", 2);
+    }
+    if (conn->conditional && stale->etag[0] != '\0') // the element is pinned, its validators stay in place
+    {
+        add_piece(conn, "If-None-Match: ", 15);
+        add_piece(conn, stale->etag, strlen(stale->etag));
+        add_piece(conn, "\r\n", 2);
+    }
+    if (conn->conditional && stale->last_modified >= 0)
+    {
+        char *since = (char *)arena_alloc(&conn->scratch, 64);
+        struct tm tm;
+        if (since == NULL || gmtime_r(&stale->last_modified, &tm) == NULL)
+            return -1;
+        add_piece(conn, since, strftime(since, 64, "If-Modified-Since: %a, %d %b %Y %H:%M:%S GMT\r\n", &tm));
+    }
+    add_piece(conn, "Connection: keep-alive\r\n\r\n", 26); // asks the remote server to keep the connection open, it goes back to the pool after the response
+
+    char host[256]; // the pool and the resolver take the name as a string
+    if (request->host.len >= sizeof(host))
+        return -1;
+    memcpy(host, request->host.data, request->host.len);
+    host[request->host.len] = '\0';
+    int server_port = request->port_number;
+
+    conn->buf = (char *)buffer_get(&conn->owner->buffers); // chunks of the response pass through this buffer
+    if (conn->buf == NULL)
+        return -1;
+
+    int status = upstream_acquire(conn->owner->pool, &conn->lease, host, server_port);
+    if (status < 0)
+        return -1;
+    if (status == UPSTREAM_WAIT) // too many connections to this host are in use, on_upstream_ready() continues
+    {
+        printf("Waiting for a connection to %s\n", host);
+        conn->state = CONN_WAIT_UPSTREAM;
+        return 0;
+    }
+    return start_upstream(conn);
+};
+
+// caches the complete response conn->fill, as a gzip copy if it is worth one
+static void commit_fill(client_conn *conn)
+{
+    cache_element *encoded = NULL;
+    if (conn->encoding)
+    {
+        encoded = cache_encoder_finish(&conn->encoder);
+        cache_encoder_end(&conn->encoder);
+        conn->encoding = 0;
+    }
+    if (encoded != NULL)
+        cache_fill_replace(conn->fill, encoded);
+    else
+        cache_fill_commit(conn->fill); // adds the entire response to the cache
+    conn->fill = NULL;
+}
+
+// caches the complete response once the remote server closed the connection
+static void finish_response(client_conn *conn)
+{
+    if (conn->fill != NULL)
+    {
+        commit_fill(conn);
+    }
+    conn_close(conn);
+}
+
+// fails a request that could not be forwarded, the client gets the stale response or an error if nothing was relayed yet
+static void fail_request(client_conn *conn)
+{
+    if (conn->response_len == 0 && conn->stale != NULL && time(NULL) < conn->stale->freshness.error_until) // stale-if-error
+    {
+        serve_stale(conn, 0);
+        return;
+    }
+    if (conn->response_len == 0 && conn->client.fd >= 0)
+    {
+        sendErrorMessage(conn->client.fd, 500);
+        end_response(conn, 1); // the error has a Content-Length, the connection can carry the next request
+        return;
+    }
+    conn_close(conn);
+}
+
+// the last byte of the response arrived: it is cached, and the remote connection goes back to the pool while the client still receives the rest
+static void complete_response(client_conn *conn, int reusable)
+{
+    if (conn->fill != NULL)
+    {
+        commit_fill(conn);
+    }
+    if (conn->store.segment != NULL)
+    {
+        disk_cache_commit(&conn->store, &conn->key);
+    }
+    int fd = conn->remote.fd;
+    event_loop_remove(conn->loop, &conn->remote);
+    conn->remote.fd = -1;
+    upstream_release(conn->owner->pool, &conn->lease, fd, reusable && conn->response.keep_alive);
+    conn->response_done = 1;
+    stop_fetching(conn); // only the client is left to send the rest to
+}
+
+/*
+    The serve_stale function answers the request with the stale response conn->stale instead of the response of the remote server,
+    none of which reached the client: the server confirmed that the stale response is still valid, or failed while it may stand in.
+    reusable tells whether the server's response was received whole, its connection then goes back to the pool. A background refresh
+    has no client and just ends.
 */
-int handle_request(int clientSocketId, ParsedRequest *request, char *tempReq)
+static void serve_stale(client_conn *conn, int reusable)
+{
+    if (conn->fill != NULL) // the requests following the fill look the key up again
+    {
+        cache_fill_withdraw(conn->fill);
+        conn->fill = NULL;
+    }
+    disk_cache_abandon(&conn->store);
+    if (reusable && conn->remote.fd >= 0)
+        complete_response(conn, 1);
+    cache_element *stale = conn->stale;
+    conn->stale = NULL;
+    end_exchange(conn); // gives up what is left of the fetch
+    if (conn->client.fd < 0)
+    {
+        release_cache_element(stale);
+        conn_close(conn);
+        return;
+    }
+    conn->cached = stale;
+    http_response_init(&conn->response); // now tracks the stale response as it is sent
+    conn->buf_len = conn->buf_pos = 0;
+    printf("Serving the stale response\n");
+    send_element(conn);
+}
+
+// a connection reused from the pool was closed by the remote server before it answered, the request is sent again on a new one
+static void retry_request(client_conn *conn)
+{
+    printf("Pooled connection was closed by the remote server, reconnecting\n");
+    event_loop_remove(conn->loop, &conn->remote);
+    close(conn->remote.fd);
+    conn->remote.fd = -1;
+    conn->lease.fd = -1; // the lease keeps its place among the connections to the host
+    if (start_upstream(conn) < 0)
+    {
+        fail_request(conn);
+    }
+}
+
+// creates the pipe the body is spliced through, returns -1 if that failed and the body has to be copied through buf instead
+static int open_pipe(int fds[2])
+{
+    if (fds[0] < 0 && pipe2(fds, O_NONBLOCK | O_CLOEXEC) < 0)
+    {
+        fds[0] = fds[1] = -1;
+        return -1;
+    }
+    return 0;
+}
+
+// duplicates the n bytes in conn->pipe into conn->tee, which is empty, returns -1 on failure
+static int tee_pipe(client_conn *conn, size_t n)
 {
-    char *buf = (char *)malloc(sizeof(char) * MAX_BYTES); // buffer for storing the constructed HTTP request
+    if (open_pipe(conn->tee) < 0)
+        return -1;
+    return tee(conn->pipe[0], conn->tee[1], n, SPLICE_F_NONBLOCK) == (ssize_t)n ? 0 : -1; // the pages are shared, not copied
+}
 
-    // constructs the request line by concatenating "GET ", the request path, a space, the HTTP version, and a newline character into the buffer.
-    strcpy(buf, "GET ");
-    strcat(buf, request->path);
-    strcat(buf, " ");
-    strcat(buf, request->version);
-    strcat(buf, "\r\n");
+/*
+    The start_store function reserves room in the disk cache for a response whose headers were just parsed, if it is big enough to
+    belong there, and writes its first used bytes, which are in conn->buf. Only responses with a Content-Length are stored: the room
+    of a record is reserved up front. Headers that did not fit into the first chunk are rare enough not to be worth keeping around.
+*/
+static void start_store(client_conn *conn, size_t used)
+{
+    if (conn->response_len != 0)
+        return;
+    size_t len = used + http_response_opaque(&conn->response);
+    if (len < DISK_MIN_ELEMENT_SIZE || disk_cache_reserve(&conn->key, len, conn->response.keep_alive, conn->freshness.expires, conn->freshness.received, &conn->store) < 0)
+        return;
+    if (disk_cache_write(&conn->store, conn->buf, used) < 0)
+    {
+        disk_cache_abandon(&conn->store);
+    }
+}
 
-    size_t len = strlen(buf); // Length of the constructed request line.
+// sets conn->key to the key of the url followed by the values of the headers named in conn->vary, returns -1 if they could not be written out
+static int variant_key(client_conn *conn)
+{
+    if (conn->vary[0] == '\0')
+    {
+        conn->key = conn->url_key;
+        return 0;
+    }
+    size_t len = strlen(conn->url);
+    size_t variant_len = http_cache_variant(&conn->request, conn->vary, NULL, 0);
+    char *text = (char *)arena_alloc(&conn->scratch, len + variant_len + 1);
+    if (text == NULL)
+        return -1;
+    memcpy(text, conn->url, len);
+    http_cache_variant(&conn->request, conn->vary, text + len, variant_len + 1);
+    conn->key = cache_key_digest(text, len + variant_len);
+    return 0;
+}
 
-    if (ParsedHeader_set(request, "Connection", "close") < 0) // Sets the "Connection" header to "close" in the parsed request
+/*
+    The move_fill function is called when the response varies on other request headers than its key was built with. The names are
+    remembered for the url and the fill moves to the key they select, the requests that followed the old one look the url up again and
+    build the same key. It returns -1 if that key is already being filled or cached by another request.
+*/
+static int move_fill(client_conn *conn)
+{
+    cache_vary_set(&conn->url_key, conn->response.cache.vary);
+    if (conn->fill != NULL)
     {
-        printf("Set header key is not working !\n"); // Print error message if unsuccessfull
+        cache_fill_withdraw(conn->fill);
+        conn->fill = NULL;
     }
+    strcpy(conn->vary, conn->response.cache.vary);
+    if (variant_key(conn) < 0)
+        return -1;
+    int status;
+    cache_element *stale;
+    cache_element *element = cache_lookup(&conn->key, &status, &stale);
+    if (stale != NULL) // the response is already on its way
+        release_cache_element(stale);
+    if (status != CACHE_FILL)
+    {
+        if (element != NULL)
+            release_cache_element(element);
+        return -1;
+    }
+    conn->fill = element;
+    return 0;
+}
+
+// until when the response may be used, status is the one its freshness is reckoned for
+static void response_freshness(client_conn *conn, int status, time_t now, cache_freshness *freshness)
+{
+    http_cache_headers *h = &conn->response.cache;
+    freshness->expires = http_cache_expires(status, h, conn->request_time, now);
+    freshness->stale_until = freshness->expires + http_cache_stale_window(h, h->stale_while_revalidate);
+    freshness->error_until = freshness->expires + http_cache_stale_window(h, h->stale_if_error);
+    freshness->received = now - http_cache_initial_age(h, conn->request_time, now);
+}
+
+/*
+    The check_response function decides, once the first chunk of the response was parsed, whether the response is cached and until when.
+    A response a shared cache must not store is withdrawn from the fill and the requests following it fetch their own. So is a response
+    that is stale already, unless it can be revalidated. Headers that did not fit into the first chunk are rare enough not to wait for,
+    the response is then not cached either.
+    A 304 to the validators of a stale response, or an error while the stale response may stand in for it, is not relayed: the client
+    gets the stale response instead and the function returns -1. reusable tells whether the chunk holds the whole response.
+*/
+static int check_response(client_conn *conn, size_t used, int reusable)
+{
+    http_response *response = &conn->response;
+    http_header *cache_control = http_request_known(&conn->request, HTTP_CACHE_CONTROL);
+    int authorized = http_request_known(&conn->request, HTTP_AUTHORIZATION) != NULL;
+    time_t now = time(NULL);
 
-    if (ParsedHeader_get(request, "Host") == NULL) // Checks if the "Host" header exists in the parsed request
+    conn->headers_checked = 1;
+    if (conn->conditional && response->status == 304) // only the freshness of the stale response changes, its data is kept
     {
-        if (ParsedHeader_set(request, "Host", request->host) < 0) // If not, sets it to the value of request->host
+        if (response->headers_done)
         {
-            printf("Set Host header key is not working !\n"); // If unsuccessful, prints an error message.
+            if (response->cache.last_modified < 0) // a 304 need not repeat it, the heuristic goes by the stored one
+                response->cache.last_modified = conn->stale->last_modified;
+            response_freshness(conn, 200, now, &conn->freshness); // the status of the stored response is not kept, the heuristic assumes a 200
+            cache_revalidated(conn->stale, &conn->freshness);
         }
+        printf("The stale response is still valid\n");
+        serve_stale(conn, reusable);
+        return -1;
+    }
+    if (conn->stale != NULL && response->status >= 500 && now < conn->stale->freshness.error_until) // stale-if-error
+    {
+        serve_stale(conn, reusable);
+        return -1;
     }
 
-    if (ParsedRequest_unparse_headers(request, buf + len, (size_t)(MAX_BYTES - len))) // appends the headers from request object to buffer
+    int cacheable = response->headers_done && http_cache_storable(response->status, &response->cache, authorized) &&
+                    (cache_control == NULL || !http_view_has_token(cache_control->value, "no-store"));
+    if (cacheable)
+    {
+        response_freshness(conn, response->status, now, &conn->freshness);
+        int validated = response->cache.etag[0] != '\0' || response->cache.last_modified >= 0;
+        cacheable = conn->freshness.expires > now || conn->freshness.stale_until > now || validated;
+    }
+    if (cacheable && strcmp(response->cache.vary, conn->vary) != 0)
+    {
+        cacheable = move_fill(conn) == 0;
+    }
+    if (!cacheable)
     {
-        printf("Unparse Failed\n");
+        if (conn->fill != NULL)
+        {
+            cache_fill_withdraw(conn->fill);
+            conn->fill = NULL;
+        }
+        return 0;
     }
+    if (conn->fill != NULL)
+    {
+        cache_fill_freshness(conn->fill, &conn->freshness);
+        cache_fill_validators(conn->fill, response->cache.etag, response->cache.last_modified);
+        conn->encoding = gzip_level > 0 && cache_encoding_compressible(response) &&
+                         cache_encoder_init(&conn->encoder, conn->fill, response->head_len, response->content_length, gzip_level) == 0;
+        conn->share = response->body == HTTP_BODY_LENGTH && response->content_length >= CACHE_BODY_MIN;
+    }
+    if (response->body == HTTP_BODY_LENGTH && conn->freshness.expires > now) // the size of the response is known, the disk cache only keeps fresh ones
+        start_store(conn, used);
+    return 0;
+}
+
+/*
+    The spliced_response function accounts for the n bytes of body just spliced into conn->pipe. The memory cache and the disk cache each
+    get a copy of them through conn->tee, which is drained by one before it is filled again for the other.
+*/
+static void spliced_response(client_conn *conn, size_t n)
+{
+    if (conn->fill != NULL && (tee_pipe(conn, n) < 0 || cache_fill_read(conn->fill, conn->tee[0], n) < 0))
+    {
+        cache_fill_abandon(conn->fill); // too big to be cached and nobody follows, the rest stays in the kernel
+        conn->fill = NULL;
+        close_pipe(conn->tee);          // drops what was left in it
+    }
+    else if (conn->encoding && conn->fill != NULL)
+    {
+        cache_encoder_feed(&conn->encoder); // a pipe's worth at most, the worker never deflates a whole body at once
+    }
+    if (conn->store.segment != NULL && (tee_pipe(conn, n) < 0 || disk_cache_splice(&conn->store, conn->tee[0], n) < 0))
+    {
+        disk_cache_abandon(&conn->store);
+        close_pipe(conn->tee);
+    }
+    conn->pipe_len = n;
+    conn->response_len += n;
+    if (http_response_skip(&conn->response, n) == HTTP_RESPONSE_DONE)
+    {
+        complete_response(conn, 1); // splice() never reads past the body
+    }
+}
+
+// sends the pieces of the request not sent yet with one sendmsg(), returns what send() would
+static ssize_t send_request(client_conn *conn)
+{
+    struct iovec iov[REQ_IOV];
+    int n = 0;
+    size_t skip = conn->req_pos;
+    for (int i = 0; i < conn->req_iov; i++)
+    {
+        if (skip >= conn->req[i].iov_len) // already sent
+        {
+            skip -= conn->req[i].iov_len;
+            continue;
+        }
+        iov[n].iov_base = (char *)conn->req[i].iov_base + skip;
+        iov[n].iov_len = conn->req[i].iov_len - skip;
+        skip = 0;
+        n++;
+    }
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = n;
+    return sendmsg(conn->remote.fd, &msg, MSG_NOSIGNAL);
+}
+
+// appends the used bytes of buf to conn->fill, marking where the body starts if it may be shared
+static int fill_append(client_conn *conn, size_t used)
+{
+    long head_len = conn->response.head_len;
+    if (!conn->share || head_len < 0 || head_len > conn->response_len + (long)used)
+        return cache_fill_append(conn->fill, conn->buf, used);
+    size_t head = head_len - conn->response_len;
+    conn->share = 0;
+    if (cache_fill_append(conn->fill, conn->buf, head) < 0)
+        return -1;
+    cache_fill_body(conn->fill);
+    return cache_fill_append(conn->fill, conn->buf + head, used - head);
+}
+
+/*
+    The relay_response function sends the constructed request to the remote server and then moves the response to the client, chunk by chunk.
+    It is called whenever the client or the remote socket is ready and runs until one of them would block. A chunk is only read from
+    the remote server after the previous one reached the client, so a slow client slows down the remote server instead of filling our memory.
+    The framing of the response tells where it ends, so the remote connection can be handed back to the pool without waiting for it to close.
+    The headers go through buf, where the parser sees them. Long stretches of body the parser does not need to see are spliced from the
+    remote socket into a pipe and from the pipe to the client, so they never reach user space. If the response is cached, the pipe is
+    tee()d into a second one that is read straight into the cache element, which is the only copy made. Responses big enough for the
+    disk cache are written to it as they pass, spliced from the second pipe into the segment file.
+*/
+static void relay_response(client_conn *conn)
+{
+    if (!conn->response_done)
+        start_fetching(conn); // one of the sockets is ready, the deadline starts over
+    while (conn->req_pos < conn->req_len) // send the constructed HTTP request to the remote server
+    {
+        ssize_t bytes_sent = send_request(conn);
+        if (bytes_sent < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return; // wait until the remote socket is writable again
+            if (conn->reused)
+            {
+                retry_request(conn);
+                return;
+            }
+            perror("Error in sending the request to the remote server !");
+            fail_request(conn);
+            return;
+        }
+        conn->req_pos += bytes_sent;
+    }
+
+    // we are sending data to client and receiving data from server and on and on
+    while (1)
+    {
+        if (conn->buf_pos < conn->buf_len && conn->client.fd < 0) // a background refresh, the response only goes to the cache
+        {
+            conn->buf_pos = conn->buf_len;
+        }
+        if (conn->buf_pos < conn->buf_len) // the last chunk did not fully reach the client yet
+        {
+            int bytes_sent = send(conn->client.fd, conn->buf + conn->buf_pos, conn->buf_len - conn->buf_pos, MSG_NOSIGNAL);
+            if (bytes_sent < 0) // checking if sending data to client failed
+            {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    return; // wait until the client socket is writable again
+                perror("Error in sending data to the client !");
+                conn_close(conn);
+                return;
+            }
+            conn->buf_pos += bytes_sent;
+            continue;
+        }
+        if (conn->pipe_len > 0) // the last spliced bytes did not fully reach the client yet
+        {
+            ssize_t bytes_sent = splice(conn->pipe[0], NULL, conn->client.fd, NULL, conn->pipe_len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (bytes_sent < 0)
+            {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    return; // wait until the client socket is writable again
+                perror("Error in sending data to the client !");
+                conn_close(conn);
+                return;
+            }
+            conn->pipe_len -= bytes_sent;
+            continue;
+        }
+        if (conn->response_done) // all of the response reached the client
+        {
+            end_response(conn, conn->response.keep_alive);
+            return;
+        }
+
+        long opaque = http_response_opaque(&conn->response); // body bytes that can bypass the parser
+        int spliced = opaque >= SPLICE_MIN && conn->client.fd >= 0 && open_pipe(conn->pipe) == 0;
+        ssize_t bytes_recv;
+        if (spliced)
+            bytes_recv = splice(conn->remote.fd, NULL, conn->pipe[1], NULL, opaque < SPLICE_BYTES ? opaque : SPLICE_BYTES, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        else
+            bytes_recv = recv(conn->remote.fd, conn->buf, MAX_BYTES - 1, 0); // recieve more data from the remote server
+        if (bytes_recv < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return; // wait until the remote server sends more
+            if (conn->reused && conn->response_len == 0)
+            {
+                retry_request(conn);
+                return;
+            }
+            perror("Error in receiving data from the remote server !");
+            fail_request(conn);
+            return;
+        }
+        if (bytes_recv == 0) // the remote server closed the connection
+        {
+            if (conn->reused && conn->response_len == 0)
+            {
+                retry_request(conn);
+            }
+            else if (http_response_eof(&conn->response)) // the response ends with the connection
+            {
+                finish_response(conn);
+            }
+            else
+            {
+                printf("The remote server closed the connection before the end of the response\n");
+                fail_request(conn); // the truncated response is not cached
+            }
+            return;
+        }
+        if (spliced)
+        {
+            spliced_response(conn, bytes_recv);
+            continue;
+        }
+
+        size_t used; // bytes that belong to the response, a server sending more than its response cannot be reused
+        int done = http_response_feed(&conn->response, conn->buf, bytes_recv, &used) == HTTP_RESPONSE_DONE;
+
+        if (!conn->headers_checked) // the first chunk, its headers decide whether and where the response is cached
+        {
+            if (check_response(conn, used, done && used == (size_t)bytes_recv) < 0)
+                return; // the client gets the stale response instead
+        }
+        else if (conn->store.segment != NULL && disk_cache_write(&conn->store, conn->buf, used) < 0)
+        {
+            disk_cache_abandon(&conn->store);
+        }
+        if (conn->fill != NULL && fill_append(conn, used) < 0) // Copy the data from buf to the cache element, requests following it get it from there
+        {
+            cache_fill_abandon(conn->fill); // too big to be cached and nobody follows, keep relaying without it
+            conn->fill = NULL;
+        }
+        else if (conn->encoding && conn->fill != NULL)
+        {
+            cache_encoder_feed(&conn->encoder); // the bytes of this read only
+        }
+        conn->response_len += used;
+        conn->buf_pos = 0;
+        conn->buf_len = used;
+        if (done)
+        {
+            complete_response(conn, used == (size_t)bytes_recv);
+        }
+    }
+}
+
+// the fetch this connection followed failed
+static void follow_failed(client_conn *conn)
+{
+    if (conn->cursor.pos > 0) // the client already got part of the response
+    {
+        conn_close(conn);
+        return;
+    }
+    int retry = conn->cached->uncacheable;
+    stop_following(conn);
+    if (retry) // the response was too big to be shared or is served from elsewhere, look it up again
+    {
+        dispatch_request(conn);
+        return;
+    }
+    sendErrorMessage(conn->client.fd, 500);
+    end_response(conn, 1);
+}
+
+// runs the bytes just sent from the cache through the response parser, which tells whether the connection can stay open afterwards
+static void track_sent(client_conn *conn, struct iovec *iov, size_t bytes_sent)
+{
+    for (int i = 0; bytes_sent > 0; i++)
+    {
+        size_t len = iov[i].iov_len < bytes_sent ? iov[i].iov_len : bytes_sent;
+        size_t used;
+        http_response_feed(&conn->response, (const char *)iov[i].iov_base, len, &used);
+        bytes_sent -= len;
+    }
+}
+
+/*
+    The add_age function copies the start of the head of a cached response, whose first len bytes are at data, to conn->age with an Age
+    header: the seconds since received. That part of the head is then sent from conn->age instead of data. The Age the remote server
+    sent is replaced if it comes within AGE_HEAD_MAX bytes, the new one goes after the status line otherwise. It returns the bytes of
+    data replaced, 0 if the status line is too long and the response goes without Age.
+*/
+static size_t add_age(client_conn *conn, const char *data, size_t len, time_t received)
+{
+    const char *end = data + (len < AGE_HEAD_MAX ? len : AGE_HEAD_MAX);
+    const char *eol = (const char *)memchr(data, '\n', end - data);
+    conn->age_len = conn->age_pos = 0;
+    if (eol == NULL)
+        return 0;
+    size_t copied = eol + 1 - data; // bytes sent from conn->age before the new Age
+    size_t replaced = copied;       // bytes of data the new Age and what precedes it stand for
+    for (const char *line = eol + 1; (eol = (const char *)memchr(line, '\n', end - line)) != NULL && eol - line > 1; line = eol + 1)
+    {
+        if (eol - line >= 4 && strncasecmp(line, "Age:", 4) == 0)
+        {
+            copied = line - data;
+            replaced = eol + 1 - data;
+            break;
+        }
+    }
+    time_t now = time(NULL);
+    memcpy(conn->age, data, copied);
+    conn->age_len = copied + snprintf(conn->age + copied, sizeof(conn->age) - copied, "Age: %ld\r\n", now > received ? (long)(now - received) : 0L);
+    return replaced;
+}
+
+// sends what is left of conn->age, returns 1 once all of it was sent, 0 if the client socket is full and -1 on failure
+static int send_age(client_conn *conn)
+{
+    while (conn->age_pos < conn->age_len)
+    {
+        struct iovec iov;
+        iov.iov_base = conn->age + conn->age_pos;
+        iov.iov_len = conn->age_len - conn->age_pos;
+        ssize_t bytes_sent = send(conn->client.fd, iov.iov_base, iov.iov_len, MSG_NOSIGNAL);
+        if (bytes_sent < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0; // wait until the client socket is writable again
+            perror("Error in sending cached data to the client !");
+            return -1;
+        }
+        track_sent(conn, &iov, bytes_sent);
+        conn->age_pos += bytes_sent;
+    }
+    return 1;
+}
+
+// reads the start of the response in conn->stored to send it with an Age header, returns the bytes of the response it replaces
+static off_t stored_age(client_conn *conn)
+{
+    char line[AGE_HEAD_MAX];
+    size_t len = conn->stored.len < sizeof(line) ? conn->stored.len : sizeof(line);
+    ssize_t n = pread(conn->stored.fd, line, len, conn->stored.offset);
+    return n > 0 ? add_age(conn, line, n, conn->stored.received) : 0;
+}
+
+/*
+    The send_stored function sends a response from the disk cache with sendfile(), which hands the pages of the segment file to the
+    client socket without copying them through the proxy. The start of its head goes first, from conn->age, with the Age header.
+*/
+static void send_stored(client_conn *conn)
+{
+    int sent = send_age(conn);
+    if (sent <= 0)
+    {
+        if (sent < 0)
+            conn_close(conn);
+        return;
+    }
+    while (conn->stored_pos < (off_t)conn->stored.len)
+    {
+        off_t offset = conn->stored.offset + conn->stored_pos;
+        ssize_t bytes_sent = sendfile(conn->client.fd, conn->stored.fd, &offset, conn->stored.len - conn->stored_pos);
+        if (bytes_sent <= 0)
+        {
+            if (bytes_sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return; // wait until the client socket is writable again
+            perror("Error in sending stored data to the client !");
+            conn_close(conn);
+            return;
+        }
+        conn->stored_pos += bytes_sent;
+    }
+    end_response(conn, conn->stored.keep_alive); // only responses with a Content-Length are stored
+}
+
+/*
+    The send_decoded function sends a gzip copy to a client that does not accept gzip: the decoder inflates the next stretch of it into
+    conn->buf once the previous one reached the client. The client gets the response as it was received, only without its framing
+    headers, since the body is sent with a Content-Length.
+*/
+static void send_decoded(client_conn *conn)
+{
+    int sent = send_age(conn);
+    if (sent <= 0)
+    {
+        if (sent < 0)
+            conn_close(conn);
+        return;
+    }
+    while (1)
+    {
+        if (conn->buf_pos == conn->buf_len)
+        {
+            ssize_t n = cache_decoder_read(&conn->decoder, conn->buf, MAX_BYTES);
+            if (n < 0)
+            {
+                printf("The gzip copy of the cached response is damaged\n");
+                break;
+            }
+            if (n == 0) // all of it reached the client
+            {
+                end_response(conn, http_response_done(&conn->response) && conn->response.keep_alive);
+                return;
+            }
+            conn->buf_pos = 0;
+            conn->buf_len = n;
+        }
+        ssize_t bytes_sent = send(conn->client.fd, conn->buf + conn->buf_pos, conn->buf_len - conn->buf_pos, MSG_NOSIGNAL);
+        if (bytes_sent < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return; // wait until the client socket is writable again
+            perror("Error in sending cached data to the client !");
+            break;
+        }
+        struct iovec iov;
+        iov.iov_base = conn->buf + conn->buf_pos;
+        iov.iov_len = bytes_sent;
+        track_sent(conn, &iov, bytes_sent);
+        conn->buf_pos += bytes_sent;
+    }
+    conn_close(conn);
+}
+
+/*
+    The send_cached function sends a cached response straight from the chunks of the pinned element. If another request is still filling
+    the element, it sends whatever has arrived so far and sleeps until the cache writes conn->notify. Once all of the response reached the
+    client, the connection goes on with the next request if the response was self-delimiting.
+*/
+static void send_cached(client_conn *conn)
+{
+    struct iovec iov[MAX_IOV];
+    if (conn->decoding)
+    {
+        send_decoded(conn);
+        return;
+    }
+    while (1)
+    {
+        cache_state state = cache_element_state(conn->cached); // read before the data, a complete element then has all of it published
+        size_t age_left = conn->age_len - conn->age_pos; // the status line and Age go out with the first chunks
+        int aged = age_left > 0;
+        if (aged)
+        {
+            iov[0].iov_base = conn->age + conn->age_pos;
+            iov[0].iov_len = age_left;
+        }
+        int iovcnt = aged + cache_cursor_iov(&conn->cursor, iov + aged, MAX_IOV - aged);
+        if (iovcnt > 0)
+        {
+            ssize_t bytes_sent = writev(conn->client.fd, iov, iovcnt);
+            if (bytes_sent < 0)
+            {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    return; // wait until the client socket is writable again
+                perror("Error in sending cached data to the client !");
+                break;
+            }
+            track_sent(conn, iov, bytes_sent);
+            size_t from_age = (size_t)bytes_sent < age_left ? (size_t)bytes_sent : age_left;
+            conn->age_pos += from_age;
+            cache_cursor_advance(&conn->cursor, bytes_sent - from_age);
+            continue;
+        }
+        if (state == CACHE_COMPLETE) // all of it reached the client
+        {
+            end_response(conn, http_response_done(&conn->response) && conn->response.keep_alive);
+            return;
+        }
+        if (state == CACHE_ABORTED)
+        {
+            follow_failed(conn);
+            return;
+        }
+        if (cache_wait(conn->cached, &conn->waiter, conn->cursor.pos))
+            return; // sleep until the filler publishes more
+    }
+    conn_close(conn);
+}
+/*
+    The send_element function starts sending the complete element conn->cached. Of a gzip copy, a client that accepts gzip is sent the
+    encoded head and the gzip body, any other client the response decoded. Either way the head goes out with an Age header.
+*/
+static void send_element(client_conn *conn)
+{
+    cache_element *element = conn->cached;
+    struct iovec iov;
+    cache_cursor_init(&conn->cursor, element);
+    conn->state = CONN_SEND_CACHED;
+    if (element->encoded_head > 0 && cache_encoding_accepted(&conn->request))
+    {
+        cache_cursor_advance(&conn->cursor, element->identity_head);
+    }
+    else if (element->encoded_head > 0)
+    {
+        if (conn->buf == NULL)
+            conn->buf = (char *)buffer_get(&conn->owner->buffers);
+        if (conn->buf == NULL || cache_decoder_init(&conn->decoder, element) < 0)
+        {
+            conn_close(conn);
+            return;
+        }
+        conn->decoding = 1;
+        ssize_t n = cache_decoder_read(&conn->decoder, conn->buf, MAX_BYTES); // the identity head, which gets the Age header
+        if (n <= 0)
+        {
+            conn_close(conn);
+            return;
+        }
+        conn->buf_len = n;
+        conn->buf_pos = add_age(conn, conn->buf, n, element->freshness.received);
+        send_cached(conn);
+        return;
+    }
+    if (cache_cursor_iov(&conn->cursor, &iov, 1) > 0)
+        cache_cursor_advance(&conn->cursor, add_age(conn, (const char *)iov.iov_base, iov.iov_len, element->freshness.received));
+    send_cached(conn);
+}
+
+/*
+    The sendErrorMessage function constructs and sends an HTTP error response based on a given status code to a specified socket.
+*/
+int sendErrorMessage(int socket, int status_code)
+{
+    char str[1024];       // a buffer to store the error message
+    char currentTime[50]; // a buffer to store the current time in a formatted string
+    time_t now = time(0); // current time in seconds since the UNIX epoch
+
+    struct tm data = *gmtime(&now);                                                // converts the UNIX timestamp to a broken down structure tm
+    strftime(currentTime, sizeof(currentTime), "%a, %d %b %Y %H:%M:%S %Z", &data); // formats the broken down structure to a human readable format and stores it in currentTime
+
+    switch (status_code)
+    {
+    case 400:
+        snprintf(str, sizeof(str), "HTTP/1.1 400 Bad Request\r\nContent-Length: 95\r\nConnection: keep-alive\r\nContent-Type: text/html\r\nDate: %s\r\nServer: VaibhavN/14785\r\n\r\n<HTML><HEAD><TITLE>400 Bad Request</TITLE></HEAD>\n<BODY><H1>400 Bad Rqeuest</H1>\n</BODY></HTML>", currentTime);
+        printf("400 Bad Request\n");
+        send(socket, str, strlen(str), 0);
+        break;
+
+    case 403:
+        snprintf(str, sizeof(str), "HTTP/1.1 403 Forbidden\r\nContent-Length: 112\r\nContent-Type: text/html\r\nConnection: keep-alive\r\nDate: %s\r\nServer: VaibhavN/14785\r\n\r\n<HTML><HEAD><TITLE>403 Forbidden</TITLE></HEAD>\n<BODY><H1>403 Forbidden</H1><br>Permission Denied\n</BODY></HTML>", currentTime);
+        printf("403 Forbidden\n");
+        send(socket, str, strlen(str), 0);
+        break;
+
+    case 404:
+        snprintf(str, sizeof(str), "HTTP/1.1 404 Not Found\r\nContent-Length: 91\r\nContent-Type: text/html\r\nConnection: keep-alive\r\nDate: %s\r\nServer: VaibhavN/14785\r\n\r\n<HTML><HEAD><TITLE>404 Not Found</TITLE></HEAD>\n<BODY><H1>404 Not Found</H1>\n</BODY></HTML>", currentTime);
+        printf("404 Not Found\n");
+        send(socket, str, strlen(str), 0);
+        break;
+
+    case 500:
+        snprintf(str, sizeof(str), "HTTP/1.1 500 Internal Server Error\r\nContent-Length: 115\r\nConnection: keep-alive\r\nContent-Type: text/html\r\nDate: %s\r\nServer: VaibhavN/14785\r\n\r\n<HTML><HEAD><TITLE>500 Internal Server Error</TITLE></HEAD>\n<BODY><H1>500 Internal Server Error</H1>\n</BODY></HTML>", currentTime);
+        printf("500 Internal Server Error\n");
+        send(socket, str, strlen(str), 0);
+        break;
+
+    case 501:
+        snprintf(str, sizeof(str), "HTTP/1.1 501 Not Implemented\r\nContent-Length: 103\r\nConnection: keep-alive\r\nContent-Type: text/html\r\nDate: %s\r\nServer: VaibhavN/14785\r\n\r\n<HTML><HEAD><TITLE>404 Not Implemented</TITLE></HEAD>\n<BODY><H1>501 Not Implemented</H1>\n</BODY></HTML>", currentTime);
+        printf("501 Not Implemented\n");
+        send(socket, str, strlen(str), 0);
+        break;
+
+    case 505:
+        snprintf(str, sizeof(str), "HTTP/1.1 505 HTTP Version Not Supported\r\nContent-Length: 125\r\nConnection: keep-alive\r\nContent-Type: text/html\r\nDate: %s\r\nServer: VaibhavN/14785\r\n\r\n<HTML><HEAD><TITLE>505 HTTP Version Not Supported</TITLE></HEAD>\n<BODY><H1>505 HTTP Version Not Supported</H1>\n</BODY></HTML>", currentTime);
+        printf("505 HTTP Version Not Supported\n");
+        send(socket, str, strlen(str), 0);
+        break;
+
+    default:
+        return -1;
+    }
+    return 1;
+}
+
+// checks HTTP version
+int checkHTTPversion(const char *msg)
+{
+    int version = -1;
+    if (strncmp(msg, "HTTP/1.1", 8) == 0 || strncmp(msg, "HTTP/1.0", 8) == 0)
+    {
+        version = 1;
+    }
+    return version;
+}
+
+/*
+    The start_refresh function revalidates the stale response in conn->cached in the background while the client gets it as it is. The
+    refresh is a connection of its own without a client socket: it forwards a copy of the request with the validators of the stale
+    response and fills the cache with the answer, or only refreshes the freshness of the stale response on a 304. cache_refresh() lets
+    a single refresh run per response.
+*/
+static void start_refresh(client_conn *conn)
+{
+    if (conn->request_len >= MAX_BYTES) // the copy goes into a buffer of the pool
+        return;
+    cache_element *stale;
+    cache_element *fill = cache_refresh(&conn->key, &stale, 0);
+    if (fill == NULL)
+        return;
+    client_conn *refresh = conn_create(conn->owner, -1);
+    if (refresh == NULL)
+    {
+        cache_fill_withdraw(fill);
+        release_cache_element(stale);
+        return;
+    }
+    stop_waiting(refresh); // it is not waiting for a client
+    refresh->fill = fill;
+    refresh->stale = stale;
+    memcpy(refresh->buffer, conn->buffer, conn->request_len);
+    refresh->buffer[conn->request_len] = '\0';
+    refresh->buffer_len = refresh->request_len = conn->request_len;
+    size_t url_len = strlen(conn->url);
+    refresh->url = (char *)arena_alloc(&refresh->scratch, url_len + 1);
+    if (http_request_parse(&refresh->request, refresh->buffer, refresh->buffer_len) != HTTP_REQUEST_DONE || refresh->url == NULL)
+    {
+        conn_close(refresh);
+        return;
+    }
+    memcpy(refresh->url, conn->url, url_len + 1);
+    refresh->url_key = conn->url_key;
+    refresh->key = conn->key;
+    strcpy(refresh->vary, conn->vary);
+    http_response_init(&refresh->response);
+    refresh->request_time = time(NULL);
+    printf("Refreshing the stale response in the background\n");
+    if (handle_request(refresh, &refresh->request) < 0)
+    {
+        conn_close(refresh);
+    }
+}
+
+// returns 1 if a body follows the head of request: it has a Transfer-Encoding, or a Content-Length other than 0
+static int has_body(http_request *request)
+{
+    for (size_t i = 0; i < request->nheaders; i++)
+    {
+        http_header *h = &request->headers[i];
+        if (h->known == HTTP_TRANSFER_ENCODING || (h->known == HTTP_CONTENT_LENGTH && !http_view_eq(h->value, "0")))
+            return 1;
+    }
+    return 0;
+}
+
+/*
+    The revalidate_cached function turns the hit in conn->cached into a stale response the request revalidates, for a client that asked
+    for no-cache: conn->stale is the hit, and conn->cached the element the answer fills in its place. If a fetch of the response runs
+    already, the answer is only relayed and conn->cached is NULL.
+*/
+static void revalidate_cached(client_conn *conn)
+{
+    cache_element *cached = conn->cached;
+    conn->cached = cache_refresh(&conn->key, &conn->stale, 1);
+    if (conn->stale != NULL)
+        release_cache_element(cached); // pinned again as conn->stale
+    else
+        conn->stale = cached;
+}
+
+/*
+    The dispatch_request function handles a complete request from the client. It handles request parsing, caching, forwarding, and error handling.
+    Requests for a response that another request is fetching right now follow that fetch instead of starting their own. A stale
+    response is revalidated before it is used, or served right away while a background refresh revalidates it. So is a fresh one if
+    the client asks for it with no-cache or max-age=0, the disk cache is not looked at then. Only GET requests without a body get that
+    far: the key of a response is its url alone, so any other method is turned away before the caches are looked at, and a GET with a
+    body gets a 400 since the connection cannot go on after it.
+*/
+static void dispatch_request(client_conn *conn)
+{
+    int status;
+    http_request *request = &conn->request; // parsed while it was received
+    int no_cache;
+
+    if (!http_view_eq(request->method, "GET")) // If the request method is not GET
+    {
+        printf("This code doesn't support any method apart from GET\n");
+        conn_close(conn); // a body may follow the headers, the next request cannot be found
+        return;
+    }
+    if (has_body(request)) // the body is not forwarded, the remote server would wait for it and the proxy would read it as the next request
+    {
+        printf("A GET request with a body is not supported\n");
+        sendErrorMessage(conn->client.fd, 400);
+        conn_close(conn);
+        return;
+    }
+    if (request->host.len == 0 || checkHTTPversion(request->version.data) != 1) // If host is invalid or the HTTP version is not 1
+    {
+        sendErrorMessage(conn->client.fd, 500);
+        end_response(conn, 1);
+        return;
+    }
+
+    http_response_init(&conn->response);
+    if (cache_vary_get(&conn->url_key, conn->vary, sizeof(conn->vary)) < 0) // the responses for the request are not known to vary
+        conn->vary[0] = '\0';
+    if (variant_key(conn) < 0)
+    {
+        conn_close(conn);
+        return;
+    }
+    conn->cached = cache_lookup(&conn->key, &status, &conn->stale); // find the request in the cache, the element stays pinned until the connection is done with it
+    no_cache = http_cache_request_no_cache(request);
+    if ((status == CACHE_HIT || status == CACHE_STALE) && no_cache) // the client wants the cached response validated first
+    {
+        revalidate_cached(conn);
+        status = CACHE_FILL;
+    }
+    if (status == CACHE_HIT || status == CACHE_STALE) // If the request is found in cache
+    {
+        if (status == CACHE_STALE) // before the response is sent, which may move on to the next request
+            start_refresh(conn);
+        printf("Data retrieved from the catche\n");
+        send_element(conn);
+        return;
+    }
+    if (status == CACHE_FOLLOW) // another request is fetching it, stream its response as it arrives
+    {
+        cache_cursor_init(&conn->cursor, conn->cached);
+        conn->state = CONN_SEND_CACHED;
+        if (follow_element(conn) < 0)
+        {
+            sendErrorMessage(conn->client.fd, 500);
+            end_response(conn, 1);
+            return;
+        }
+        printf("Following the fetch of the same request\n");
+        send_cached(conn);
+        return;
+    }
+    if (!no_cache && disk_cache_lookup(&conn->key, &conn->stored) == 0) // the response is in the disk cache, nothing to fetch
+    {
+        cache_fill_withdraw(conn->cached);
+        conn->cached = NULL;
+        conn->state = CONN_SEND_STORED;
+        conn->stored_pos = stored_age(conn);
+        printf("Data retrieved from the disk cache\n");
+        send_stored(conn);
+        return;
+    }
+    conn->fill = conn->cached; // this request fetches the response, concurrent misses follow the element it fills
+    conn->cached = NULL;
+    conn->request_time = time(NULL);
+
+    if (handle_request(conn, request) == -1) // Handle the request
+    {
+        sendErrorMessage(conn->client.fd, 500); // send an error if the request handling failed
+        end_response(conn, 1);
+    }
+}
+
+/*
+    The wants_keep_alive function checks whether the client wants its connection kept open after the response: HTTP/1.1 clients do unless
+    they send "Connection: close", HTTP/1.0 clients only if they send "Connection: keep-alive". Proxy-Connection is read the same way.
+*/
+static int wants_keep_alive(http_request *request)
+{
+    int keep_alive = request->version_minor >= 1;
+    for (size_t i = 0; i < request->nheaders; i++)
+    {
+        http_header *h = &request->headers[i];
+        if (h->known != HTTP_CONNECTION && h->known != HTTP_PROXY_CONNECTION)
+            continue;
+        if (http_view_has_token(h->value, "close"))
+            keep_alive = 0;
+        else if (http_view_has_token(h->value, "keep-alive"))
+            keep_alive = 1;
+    }
+    return keep_alive;
+}
+
+/*
+    The process_request function writes out the canonical url of a complete request and its key, which the cache key of the response
+    starts from, and dispatches the request. Only the url identifies the response: the other headers the client sends, and the way it
+    spells the url, do not split the cache unless the response varies on them.
+*/
+static void process_request(client_conn *conn)
+{
+    stop_waiting(conn);
 
-    int server_port = 80;      // use default port as 80
-    if (request->port != NULL) // if port is provided with the request
+    conn->owner->requests++;
+    size_t len = cache_key_url(&conn->request, NULL, 0);
+    conn->url = (char *)arena_alloc(&conn->scratch, len + 1);
+    if (conn->url == NULL)
     {
-        server_port = atoi(request->port); // then use the given port after converting it to integer
+        conn_close(conn);
+        return;
     }
-    int remoteSocketId = connectRemoteServer(request->host, server_port); // connects to the remote server
+    cache_key_url(&conn->request, conn->url, len + 1);
+    conn->url_key = cache_key_digest(conn->url, len);
+    conn->keep_alive = wants_keep_alive(&conn->request);
 
-    if (remoteSocketId < 0) // if connection to remote server fails
-    {
-        return -1;
-    }
-    int bytes_sent = send(remoteSocketId, buf, strlen(buf), 0); // send the constructed HTTP request to the remote server
-    bzero(buf, MAX_BYTES);                                      // clears the buffer
-    bytes_sent = recv(remoteSocketId, buf, MAX_BYTES - 1, 0);   // receive the data from the remote server and store it in the buffer, store the number of bytes received in bytes_sent
+    dispatch_request(conn);
+}
 
-    char *temp_buffer = (char *)malloc(sizeof(char) * MAX_BYTES); // allocating a temporary buffer to store the response data for caching
-    int temp_buffer_size = MAX_BYTES;                             // initial size of the temporary buffer
-    int temp_buffer_index = 0;                                    // intialize the index for temporary buffer
+// moves a request whose head does not fit into a buffer of the pool to a bigger one, -1 if it is already as big as a head may be
+static int grow_buffer(client_conn *conn)
+{
+    if (conn->buffer_size >= MAX_HEAD_BYTES)
+        return -1;
+    conn->owner->buffers.heap_allocs++;
+    char *buffer = (char *)malloc(MAX_HEAD_BYTES);
+    if (buffer == NULL)
+        return -1;
+    memcpy(buffer, conn->buffer, conn->buffer_len + 1);
+    http_request_rebase(&conn->request, conn->buffer, buffer); // the parser goes on where it stopped
+    buffer_put(&conn->owner->buffers, conn->buffer);
+    conn->buffer = buffer;
+    conn->buffer_size = MAX_HEAD_BYTES;
+    return 0;
+}
 
-    // we are sending data to client and receiving data from server and on and on
-    while (bytes_sent > 0)
+// receives the request until the end of headers "\r\n\r\n", a pipelined request may already be in the buffer
+static void read_request(client_conn *conn)
+{
+    while (1)
     {
-        bytes_sent = send(clientSocketId, buf, bytes_sent, 0);   // sending data to client in chunks
-        for (int i = 0; i < bytes_sent / (int)sizeof(char); i++) // Copy the data from buf to temp_buffer for caching.
+        int status = http_request_parse(&conn->request, conn->buffer, conn->buffer_len); // goes on from where the last call stopped
+        if (status == HTTP_REQUEST_DONE) // end of headers found
         {
-            temp_buffer[temp_buffer_index] = buf[i];
-            temp_buffer_index++;
+            conn->request_len = conn->request.len;
+            process_request(conn);
+            return;
+        }
+        if (status == HTTP_REQUEST_ERROR)
+        {
+            printf("Parsing failed \n");
+            sendErrorMessage(conn->client.fd, 400);
+            conn_close(conn);
+            return;
         }
 
-        temp_buffer_size = MAX_BYTES;
-        temp_buffer = (char *)realloc(temp_buffer, temp_buffer_size); // reallocate temp_buffer if needed
-        if (bytes_sent < 0)                                           // checking if sending data to client failed
+        if (conn->buffer_len == conn->buffer_size - 1 && grow_buffer(conn) < 0) // the headers do not fit into the buffer
         {
-            perror("Error in sending data to the client !");
-            break;
+            sendErrorMessage(conn->client.fd, 400);
+            conn_close(conn);
+            return;
         }
-        bzero(buf, MAX_BYTES);                                    // clear the buffer
-        bytes_sent = recv(remoteSocketId, buf, MAX_BYTES - 1, 0); // recieve more data from the remote server
-    }
 
-    temp_buffer[temp_buffer_index] = '\0';                        // null terminating the temp_buffer, it allows functions like printf and strlen to know where the string ends.
-    free(buf);                                                    // free the allocated buffer
-    add_cache_element(temp_buffer, strlen(temp_buffer), tempReq); // adds the entire response to the cache
-    free(temp_buffer);                                            // free the temporary buffer
-    close(remoteSocketId);                                        // close the connection to the remote server
+        int bytes_sent_by_client = recv(conn->client.fd, conn->buffer + conn->buffer_len, conn->buffer_size - 1 - conn->buffer_len, 0); // receive the data from the client
+        if (bytes_sent_by_client < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return; // wait for the rest of the request
+            perror("Error in receiving the request !");
+            conn_close(conn);
+            return;
+        }
+        if (bytes_sent_by_client == 0)
+        {
+            printf("Client is disconnected\n"); // print message if client is disconnected
+            conn_close(conn);
+            return;
+        }
 
-    return 0;
-};
+        conn->buffer_len += bytes_sent_by_client;
+        conn->buffer[conn->buffer_len] = '\0';
+    }
+}
 
-/*
-    The sendErrorMessage function constructs and sends an HTTP error response based on a given status code to a specified socket.
-*/
-int sendErrorMessage(int socket, int status_code)
+// called by the event loop whenever the client socket is ready
+static void on_client_event(event_loop *loop, event_watcher *w, uint32_t events)
 {
-    char str[1024];       // a buffer to store the error message
-    char currentTime[50]; // a buffer to store the current time in a formatted string
-    time_t now = time(0); // current time in seconds since the UNIX epoch
-
-    struct tm data = *gmtime(&now);                                                // converts the UNIX timestamp to a broken down structure tm
-    strftime(currentTime, sizeof(currentTime), "%a, %d %b %Y %H:%M:%S %Z", &data); // formats the broken down structure to a human readable format and stores it in currentTime
-
-    switch (status_code)
+    client_conn *conn = (client_conn *)w->data;
+    switch (conn->state)
     {
-    case 400:
-        snprintf(str, sizeof(str), "HTTP/1.1 400 Bad Request\r\nContent-Length: 95\r\nConnection: keep-alive\r\nContent-Type: text/html\r\nDate: %s\r\nServer: VaibhavN/14785\r\n\r\n<HTML><HEAD><TITLE>400 Bad Request</TITLE></HEAD>\n<BODY><H1>400 Bad Rqeuest</H1>\n</BODY></HTML>", currentTime);
-        printf("400 Bad Request\n");
-        send(socket, str, strlen(str), 0);
-        break;
-
-    case 403:
-        snprintf(str, sizeof(str), "HTTP/1.1 403 Forbidden\r\nContent-Length: 112\r\nContent-Type: text/html\r\nConnection: keep-alive\r\nDate: %s\r\nServer: VaibhavN/14785\r\n\r\n<HTML><HEAD><TITLE>403 Forbidden</TITLE></HEAD>\n<BODY><H1>403 Forbidden</H1><br>Permission Denied\n</BODY></HTML>", currentTime);
-        printf("403 Forbidden\n");
-        send(socket, str, strlen(str), 0);
-        break;
-
-    case 404:
-        snprintf(str, sizeof(str), "HTTP/1.1 404 Not Found\r\nContent-Length: 91\r\nContent-Type: text/html\r\nConnection: keep-alive\r\nDate: %s\r\nServer: VaibhavN/14785\r\n\r\n<HTML><HEAD><TITLE>404 Not Found</TITLE></HEAD>\n<BODY><H1>404 Not Found</H1>\n</BODY></HTML>", currentTime);
-        printf("404 Not Found\n");
-        send(socket, str, strlen(str), 0);
+    case CONN_READ_REQUEST:
+        read_request(conn);
         break;
-
-    case 500:
-        snprintf(str, sizeof(str), "HTTP/1.1 500 Internal Server Error\r\nContent-Length: 115\r\nConnection: keep-alive\r\nContent-Type: text/html\r\nDate: %s\r\nServer: VaibhavN/14785\r\n\r\n<HTML><HEAD><TITLE>500 Internal Server Error</TITLE></HEAD>\n<BODY><H1>500 Internal Server Error</H1>\n</BODY></HTML>", currentTime);
-        printf("500 Internal Server Error\n");
-        send(socket, str, strlen(str), 0);
+    case CONN_SEND_CACHED:
+        send_cached(conn);
         break;
-
-    case 501:
-        snprintf(str, sizeof(str), "HTTP/1.1 501 Not Implemented\r\nContent-Length: 103\r\nConnection: keep-alive\r\nContent-Type: text/html\r\nDate: %s\r\nServer: VaibhavN/14785\r\n\r\n<HTML><HEAD><TITLE>404 Not Implemented</TITLE></HEAD>\n<BODY><H1>501 Not Implemented</H1>\n</BODY></HTML>", currentTime);
-        printf("501 Not Implemented\n");
-        send(socket, str, strlen(str), 0);
+    case CONN_SEND_STORED:
+        send_stored(conn);
         break;
-
-    case 505:
-        snprintf(str, sizeof(str), "HTTP/1.1 505 HTTP Version Not Supported\r\nContent-Length: 125\r\nConnection: keep-alive\r\nContent-Type: text/html\r\nDate: %s\r\nServer: VaibhavN/14785\r\n\r\n<HTML><HEAD><TITLE>505 HTTP Version Not Supported</TITLE></HEAD>\n<BODY><H1>505 HTTP Version Not Supported</H1>\n</BODY></HTML>", currentTime);
-        printf("505 HTTP Version Not Supported\n");
-        send(socket, str, strlen(str), 0);
+    case CONN_RELAY:
+        relay_response(conn);
         break;
-
     default:
-        return -1;
+        break;
+    }
+    if (conn->state != CONN_CLOSED && (events & (EPOLLERR | EPOLLHUP))) // the client went away
+    {
+        conn_close(conn);
     }
-    return 1;
 }
 
-// checks HTTP version
-int checkHTTPversion(char *msg)
+// called by the event loop when the cache wrote the eventfd of a followed element
+static void on_notify_event(event_loop *loop, event_watcher *w, uint32_t events)
 {
-    int version = -1;
-    if (strncmp(msg, "HTTP/1.1", 8) == 0 || strncmp(msg, "HTTP/1.0", 8) == 0)
+    client_conn *conn = (client_conn *)w->data;
+    uint64_t count;
+    while (read(w->fd, &count, sizeof(count)) > 0) // reset the eventfd
     {
-        version = 1;
     }
-    return version;
+    if (conn->state == CONN_SEND_CACHED)
+    {
+        send_cached(conn);
+    }
 }
 
-/*
-    The thread_fn function handles the incoming client requests in a separate thread. It handles request parsing, caching, forwarding, and error handling.
-*/
-void *thread_fn(void *socketNew)
+// called by the event loop whenever the remote socket is ready
+static void on_remote_event(event_loop *loop, event_watcher *w, uint32_t events)
 {
-    sem_wait(&semaphore); // acquires the semaphore, ensuring only one thread can execute at a time
-    int p;
-    sem_getvalue(&semaphore, &p);         // stores the current value of semaphore in p
-    printf("Semaphore value is %d\n", p); // print the semaphore value
-
-    int *t = (int *)socketNew;     // cast the void pointer to an integer pointer
-    int socket = *t;               // dereference the pointer to get the socket ID
-    int bytes_sent_by_client, len; // data sent by client and its length
-
-    char *buffer = (char *)calloc(MAX_BYTES, sizeof(char));    // allocating memory for the buffer to store received data
-    bzero(buffer, MAX_BYTES);                                  // clear the buffer
-    bytes_sent_by_client = recv(socket, buffer, MAX_BYTES, 0); // receive the data from the client
-
-    // loop to receive the complete HTTP request (until the end of headers "\r\n\r\n")
-    while (bytes_sent_by_client > 0)
+    client_conn *conn = (client_conn *)w->data;
+    if (conn->state == CONN_CONNECTING) // the non-blocking connect finished, check whether it worked
     {
-        len = strlen(buffer);                   // get the length of the current buffer
-        if (strstr(buffer, "\r\n\r\n") == NULL) // if the end of header is not found
-        {
-            bytes_sent_by_client = recv(socket, buffer + len, MAX_BYTES, 0); // then receive more data
-        }
-        else
+        int err = 0;
+        socklen_t err_len = sizeof(err);
+        if (getsockopt(w->fd, SOL_SOCKET, SO_ERROR, &err, &err_len) < 0 || err != 0)
         {
-            break; // end of headers found, break the loop
+            fprintf(stderr, "Error in connecting\n");
+            fail_request(conn);
+            return;
         }
+        conn->state = CONN_RELAY;
     }
-
-    // A copy of the recieved request for caching purpose
-    char *tempReq = (char *)malloc(strlen(buffer) * sizeof(char));
-    for (int i = 0; i < (int)strlen(buffer); i++)
+    if (conn->state == CONN_RELAY)
     {
-        tempReq[i] = buffer[i];
+        relay_response(conn);
     }
+}
 
-    struct cache_element *temp = find(tempReq); // find the request in the cache
-    if (temp != NULL)                           // If the request is found in cache
+// accepts every pending connection on the listening socket
+static void on_accept(event_loop *loop, event_watcher *w, uint32_t events)
+{
+    while (1)
     {
-        int size = temp->len / sizeof(char); // length  of the cached data
-        int pos = 0;                         // position index for sending data
-        char response[MAX_BYTES];            // response buffer
-        while (pos < size)
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr); // set the size of client address
+        bzero((char *)&client_addr, sizeof(client_addr)); // clear the client address structure
+
+        // creates new socket for communication between listening socket and client
+        int client_socket_id = accept4(w->fd, (struct sockaddr *)&client_addr, &client_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_socket_id < 0)
         {
-            bzero(response, MAX_BYTES); // clear the response buffer
-            for (int i = 0; i < MAX_BYTES; i++)
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
             {
-                response[i] = temp->data[1]; // copy data from cache to response buffer
-                pos++;
+                perror("Not able to connect !!");
             }
-            send(socket, response, MAX_BYTES, 0); // send the cached data to the client
+            return; // no more pending connections
         }
-        printf("Data retrieved from the catche\n");
-        printf("%s\n\n", response);
-    }
-    else if (bytes_sent_by_client > 0) // If the request was not found in cache but we recieved request/bytes from the client successfully
-    {
-        len = strlen(buffer);                              // length of the buffer
-        ParsedRequest *request = ParsedRequest_create();   // create a ParsedRequest object
-        if (ParsedRequest_parse(request, buffer, len) < 0) // parse the request in a readable format
-        {
-            printf("Parsing failed \n"); // if the parsing fails
-        }
-        else
+
+        struct in_addr ip_addr = client_addr.sin_addr; // getting IP address of the client
+        char str[INET_ADDRSTRLEN];
+
+        // converts numeric IP address to text
+        inet_ntop(AF_INET, &ip_addr, str, INET_ADDRSTRLEN);
+
+        printf("Client is connected with port number %d and IP address %s\n", ntohs(client_addr.sin_port), str);
+
+        client_conn *conn = conn_create((worker *)w->data, client_socket_id);
+        if (conn == NULL || event_loop_add(loop, &conn->client, EPOLLIN | EPOLLOUT) < 0)
         {
-            bzero(buffer, MAX_BYTES);            // clearing the buffer
-            if (!strcmp(request->method, "GET")) // If the request method is GET
-            {
-                if (request->host && request->path && checkHTTPversion(request->version) == 1) // If host is valid  and URL path is valid and the HTTP version is 1
-                {
-                    bytes_sent_by_client = handle_request(socket, request, tempReq); // Handle the request
-                    if (bytes_sent_by_client == -1)
-                    {
-                        sendErrorMessage(socket, 500); // send an error if the request handling failed
-                    }
-                }
-                else
-                {
-                    sendErrorMessage(socket, 500); // send an error message if the host or path or HTTP version could not be validated
-                }
-            }
-            else
+            printf("Not able to handle the client !!\n");
+            close(client_socket_id);
+            if (conn != NULL)
             {
-                printf("This code doesn't support any method apart from GET\n"); // if the method something else than GET
+                conn->client.fd = -1;
+                stop_waiting(conn);
+                conn_free(conn);
             }
         }
-        ParsedRequest_destroy(request); // destroy the ParsedRequest object
-    }
-    else if (bytes_sent_by_client == 0)
-    {
-        printf("Client is disconnected\n"); // print message if client is disconnected
     }
-    shutdown(socket, SHUT_RDWR);               // Shut down a socket, SHUT_RDWR -> terminate both reading and writing operations
-    close(socket);                             // close the socket
-    free(buffer);                              // free the buffer
-    sem_post(&semaphore);                      // increment the semaphore value, making it available
-    sem_getvalue(&semaphore, &p);              // get the current value of semaphore
-    printf("Semaphore post value is %d\n", p); // print the current value of semaphore
-    free(tempReq);                             // free the tempReq buffer
-    return NULL;                               // return NULL
 }
 
-int main(int argc, char *const argv[])
+// creates a non-blocking listening socket bound to port_number, returns -1 on failure
+static int create_listener()
 {
-    int client_socket_id, client_len; // client socket ID and client address length
-
     /*
         Definition for sockaddr, i.e., a descripter for a generic network address
         struct sockaddr{
@@ -349,34 +1926,19 @@ int main(int argc, char *const argv[])
         };
 
     */
-    struct sockaddr_in server_addr, client_addr; // structures to store client and server information
-    sem_init(&semaphore, 0, MAX_CLIENTS);        // initializing a semaphore with initial value MAX_CLIENTS
-
-    pthread_mutex_init(&lock, NULL); // initializing a mutex lock
-
-    if (argc == 2)
-    {
-        port_number = atoi(argv[1]); // Use port number if given
-    }
-    else
-    {
-        printf("Too few arguements\n");
-        exit(1);
-    }
-
-    printf("Starting proxy server at port: %d\n", port_number);
+    struct sockaddr_in server_addr; // structure to store server information
 
     /*
         The function socket(int domain, int type, int protocol) creates a new socket with
         the address family AF_INET (IPv4), and socket type SOCK_STREAM (TCP), and protocol
-        which is set to 0 for default protocol.
+        which is set to 0 for default protocol. The socket is non-blocking, accept() is driven by the event loop.
     */
-    proxy_socket_id = socket(AF_INET, SOCK_STREAM, 0);
+    int proxy_socket_id = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
 
     if (proxy_socket_id < 0)
     {
         printf("Failed to create a socket !!\n");
-        exit(1);
+        return -1;
     }
 
     int reuse = 1;
@@ -384,6 +1946,12 @@ int main(int argc, char *const argv[])
     {
         perror("setSockOpt Failed \n");
     }
+    if (setsockopt(proxy_socket_id, SOL_SOCKET, SO_REUSEPORT, (const char *)&reuse, sizeof(reuse)) < 0) // every worker binds its own socket to the same port
+    {
+        perror("setSockOpt SO_REUSEPORT Failed \n");
+        close(proxy_socket_id);
+        return -1;
+    }
 
     // Writes 0's in server_addr to replace garbage value (clearing the server_addr structure)
     bzero((char *)&server_addr, sizeof(server_addr));
@@ -400,156 +1968,362 @@ int main(int argc, char *const argv[])
     // Binding the socket proxy_socket_id with the Address server_addr
     if (bind(proxy_socket_id, (const struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
     {
-        perror("Port is not available !!"); // exit if binding fails
-        exit(1);
+        perror("Port is not available !!");
+        close(proxy_socket_id);
+        return -1;
     }
-    printf("Binding on port %d\n", port_number);
 
-    int listen_status = listen(proxy_socket_id, MAX_CLIENTS); // sets the socket to listen for incoming connections
+    int listen_status = listen(proxy_socket_id, SOMAXCONN); // sets the socket to listen for incoming connections
     if (listen_status < 0)
     {
         perror("Error in listening \n");
-        exit(1);
+        close(proxy_socket_id);
+        return -1;
+    }
+    return proxy_socket_id;
+}
+
+// called by the event loop every second, closes the connections that have been idle for too long and fails the fetches that stalled
+static void on_tick(event_loop *loop, event_watcher *w, uint32_t events)
+{
+    worker *self = (worker *)w->data;
+    uint64_t expirations;
+    while (read(w->fd, &expirations, sizeof(expirations)) > 0) // reset the timerfd
+    {
     }
 
-    int i = 0;                           // initializing current number of client connections
-    int Connectd_socket_id[MAX_CLIENTS]; // array for connected socket ID's
+    upstream_pool_sweep(self->pool);
+    resolver_sweep(self->dns);
 
-    while (1)
+    time_t now = monotonic_now();
+    while (self->idle_head != NULL && now - self->idle_head->idle_since >= keep_alive_timeout)
     {
-        bzero((char *)&client_addr, sizeof(client_addr)); // clear the client address structure
-        client_len = sizeof(client_addr);                 // set the size of client address
+        conn_close(self->idle_head); // takes the connection off the list
+    }
+    while (self->fetch_head != NULL && now - self->fetch_head->fetch_since >= UPSTREAM_TIMEOUT)
+    {
+        client_conn *conn = self->fetch_head;
+        printf("The fetch made no progress for %d seconds, giving up\n", UPSTREAM_TIMEOUT);
+        stop_fetching(conn);
+        fail_request(conn); // abandons the fill, its followers and a background refresh are not left waiting
+    }
 
-        // creates new socket for communication between listening socket and client
-        client_socket_id = accept(proxy_socket_id, (struct sockaddr *)&client_addr, (socklen_t *)&client_len);
-        if (client_socket_id < 0)
-        {
-            printf("Not able to connect !!\n");
-            exit(1); // exit if accepting a connection fails
-        }
-        else
-        {
-            Connectd_socket_id[i] = client_socket_id; // store the clients socket ID
-        }
+    // the heap allocations stop growing once the pools have warmed up, whatever the number of requests
+    if (++self->ticks >= STATS_INTERVAL && self->requests != self->reported)
+    {
+        printf("Worker %d: %lu requests, %lu heap allocations of buffers and connections\n", self->id, self->requests, self->buffers.heap_allocs);
+        self->reported = self->requests;
+        self->ticks = 0;
+    }
+}
 
-        struct sockaddr_in *client_pt = (struct sockaddr_in *)&client_addr; // creating a copy
-        struct in_addr ip_addr = client_pt->sin_addr;                       // getting IP address of the client
-        char str[INET_ADDRSTRLEN];
+// creates the timerfd of a worker, returns -1 on failure
+static int create_tick()
+{
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0)
+    {
+        perror("timerfd_create failed");
+        return -1;
+    }
+    struct itimerspec interval;
+    bzero(&interval, sizeof(interval));
+    interval.it_value.tv_sec = 1;
+    interval.it_interval.tv_sec = 1;
+    if (timerfd_settime(fd, 0, &interval, NULL) < 0)
+    {
+        perror("timerfd_settime failed");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
 
-        // converts numeric IP address to text
-        inet_ntop(AF_INET, &ip_addr, str, INET_ADDRSTRLEN);
+// runs the event loop of one worker, pinned to its own CPU when possible
+static void *worker_fn(void *arg)
+{
+    worker *self = (worker *)arg;
 
-        printf("Client is connected with port number %d and IP address %s\n", ntohs(client_addr.sin_port), str);
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpus > 0)
+    {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(self->id % ncpus, &cpus);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    }
 
-        // create a new thread to hanlde the clients request
-        pthread_create(&tid[i], NULL, thread_fn, (void *)&Connectd_socket_id[i]);
-        i++;
+    event_watcher listener;
+    listener.fd = self->proxy_socket_id;
+    listener.cb = on_accept;
+    listener.data = self;
+    if (event_loop_add(self->loop, &listener, EPOLLIN) < 0)
+    {
+        perror("Error in watching the proxy socket \n");
+        return NULL;
     }
-    close(proxy_socket_id); // close the proxy socket
-    return 0;
+
+    self->tick.cb = on_tick;
+    self->tick.data = self;
+    if (event_loop_add(self->loop, &self->tick, EPOLLIN) < 0)
+    {
+        perror("Error in watching the worker timer \n");
+        return NULL;
+    }
+
+    event_loop_run(self->loop);
+    return NULL;
+}
+
+// saves the cache to snapshot_path and reports how long it took
+static void save_snapshot()
+{
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int count = cache_snapshot(snapshot_path);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (count >= 0)
+    {
+        long ms = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+        printf("Snapshot of %d responses written to %s in %ld ms\n", count, snapshot_path, ms);
+    }
+}
+
+/*
+    The snapshot_fn thread saves the cache every snapshot_interval seconds, so a restarted proxy serves hits right away instead of sending
+    a storm of misses to the remote servers. SIGINT and SIGTERM are blocked in every thread and only taken here: the proxy saves the cache
+    one last time before it exits.
+*/
+static void *snapshot_fn(void *arg)
+{
+    sigset_t *stop = (sigset_t *)arg;
+    struct timespec interval = {snapshot_interval, 0};
+    while (1)
+    {
+        int sig = sigtimedwait(stop, NULL, &interval);
+        if (sig < 0 && errno != EAGAIN)
+            continue; // interrupted
+        save_snapshot();
+        if (sig > 0)
+        {
+            printf("Stopping on signal %d\n", sig);
+            exit(0);
+        }
+    }
+    return NULL;
+}
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s [-w workers] [-c connections] [-t seconds] [-k seconds] [-n nameserver[:port]] [-d directory] [-m megabytes] [-s file] [-i seconds] [-e policy] [-z level] <port>\n", prog);
+    printf("  -w workers      number of event loop threads (default: one per CPU)\n");
+    printf("  -c connections  connections a worker opens to the same remote server at most (default: %d)\n", UPSTREAM_CONNS_PER_HOST);
+    printf("  -t seconds      time an unused connection to a remote server is kept open, 0 disables reuse (default: %d)\n", UPSTREAM_IDLE_TIMEOUT);
+    printf("  -k seconds      time a client connection may wait for its next request (default: %d)\n", KEEP_ALIVE_TIMEOUT);
+    printf("  -n nameserver   IPv4 address of the DNS server host names are resolved with (default: from /etc/resolv.conf)\n");
+    printf("  -d directory    keep large responses in a disk cache in directory (default: memory only)\n");
+    printf("  -m megabytes    size of the disk cache (default: %d)\n", DISK_MAX_SIZE);
+    printf("  -s file         save the cache to file regularly and on exit, and restore it from there at startup (default: start cold)\n");
+    printf("  -i seconds      time between two saves of the cache (default: %d)\n", SNAPSHOT_INTERVAL);
+    printf("  -e policy       eviction policy of the memory cache, one of %s (default: %s)\n", CACHE_POLICY_NAMES, CACHE_POLICY_DEFAULT);
+    printf("  -z level        keep text responses gzip compressed in the memory cache, with a zlib level from 1 to 9 (default: 0, off)\n");
 }
 
-// finds and returns an element in the cache
-cache_element *find(char *url)
+int main(int argc, char *const argv[])
 {
-    cache_element *site = NULL;
-    int temp_lock_val = pthread_mutex_lock(&lock);
-    printf("Remove Cache Lock acquired %d\n", temp_lock_val);
+    long nworkers = sysconf(_SC_NPROCESSORS_ONLN); // one worker per core by default
+    int opt;
+    struct sockaddr_in nameserver;
+
+    if (resolver_system_nameserver(&nameserver) < 0)
+    {
+        printf("No /etc/resolv.conf, resolving with 127.0.0.1\n");
+    }
 
-    if (head != NULL)
+
+    while ((opt = getopt(argc, argv, "w:c:t:k:n:d:m:s:i:e:z:h")) != -1)
     {
-        site = head;
-        while (site != NULL)
+        switch (opt)
+        {
+        case 'w':
+            nworkers = atoi(optarg);
+            break;
+        case 'c':
+            upstream_conns_per_host = atoi(optarg);
+            break;
+        case 't':
+            upstream_idle_timeout = atoi(optarg);
+            break;
+        case 'k':
+            keep_alive_timeout = atoi(optarg);
+            break;
+        case 'n':
         {
-            if (!strcmp(site->url, url))
+            char *port = strchr(optarg, ':');
+            if (port != NULL)
             {
-                printf("LRU time track before : %d\n", (int)(site->lru_time_track));
-                printf("\n Url found\n");
-                site->lru_time_track = time(NULL);
-                printf("LRU time track after %d\n", (int)(site->lru_time_track));
-                break;
+                *port++ = '\0';
+                nameserver.sin_port = htons(atoi(port));
+            }
+            if (inet_pton(AF_INET, optarg, &nameserver.sin_addr) != 1)
+            {
+                printf("Invalid nameserver address %s\n", optarg);
+                exit(1);
             }
-            site = site->next;
+            break;
+        }
+        case 'd':
+            disk_cache_dir = optarg;
+            break;
+        case 'm':
+            disk_cache_size = atol(optarg);
+            break;
+        case 's':
+            snapshot_path = optarg;
+            break;
+        case 'i':
+            snapshot_interval = atoi(optarg);
+            break;
+        case 'e':
+            eviction_policy = optarg;
+            break;
+        case 'z':
+            gzip_level = atoi(optarg);
+            if (gzip_level > 9)
+                gzip_level = 9;
+            break;
+        default:
+            usage(argv[0]);
+            exit(1);
         }
     }
+
+    if (optind == argc - 1)
+    {
+        port_number = atoi(argv[optind]); // Use port number if given
+    }
     else
     {
-        printf("URL not found\n");
+        printf("Too few arguements\n");
+        usage(argv[0]);
+        exit(1);
+    }
+    if (nworkers < 1)
+    {
+        nworkers = 1;
     }
-    temp_lock_val = pthread_mutex_unlock(&lock);
-    printf("Lock is unlocked\n");
-    return site;
-}
 
-// Search for element with least lru_time_track and remove it
-void remove_cache_element()
-{
-    cache_element *p;
-    cache_element *q;
-    cache_element *temp;
+    if (cache_init(nworkers * CACHE_SHARDS_PER_WORKER, eviction_policy) < 0) // initializing the cache and its locks
+    {
+        printf("Unknown or failed eviction policy %s, use one of %s\n", eviction_policy, CACHE_POLICY_NAMES);
+        exit(1);
+    }
+    if (disk_cache_dir != NULL && disk_cache_init(disk_cache_dir, (size_t)disk_cache_size << 20) < 0)
+    {
+        printf("Failed to open the disk cache in %s, caching in memory only\n", disk_cache_dir);
+    }
+    if (snapshot_path != NULL)
+    {
+        int count = cache_restore(snapshot_path);
+        if (count >= 0)
+            printf("Restored a snapshot of %d responses from %s\n", count, snapshot_path);
+        if (snapshot_interval < 1)
+            snapshot_interval = SNAPSHOT_INTERVAL;
+    }
+
+    signal(SIGPIPE, SIG_IGN); // a client closing early must not kill the proxy
+
+    // every connection needs up to two descriptors, so allow as many as the hard limit permits
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
 
-    int temp_lock_val = pthread_mutex_lock(&lock);
-    printf("Lock is acquired \n");
+    printf("Starting proxy server at port: %d with %ld workers\n", port_number, nworkers);
+    printf("Scanning headers with the %s kernel\n", scan_kernel());
+    printf("Evicting from the memory cache with the %s policy\n", eviction_policy);
+    if (gzip_level > 0)
+        printf("Compressing cached text responses with gzip level %d\n", gzip_level);
 
-    // linked list type iteration
-    if (head != NULL)
+    // every listener is created before the first worker starts, so a busy port is reported right away
+    worker *workers = (worker *)calloc(nworkers, sizeof(worker));
+    for (int i = 0; i < nworkers; i++)
     {
-        for (p = head, q = head, temp = head; q->next != NULL; q = q->next)
+        workers[i].id = i;
+        workers[i].proxy_socket_id = create_listener();
+        if (workers[i].proxy_socket_id < 0)
         {
-            if ((q->next)->lru_time_track < temp->lru_time_track)
-            {
-                temp = q->next;
-                p = q;
-            }
+            exit(1);
         }
-        if (temp == head)
+        workers[i].loop = event_loop_create();
+        if (workers[i].loop == NULL)
         {
-            head = head->next;
+            printf("Failed to create the event loop !!\n");
+            exit(1);
         }
-        else
+        workers[i].pool = upstream_pool_create(workers[i].loop, upstream_conns_per_host, upstream_idle_timeout, UPSTREAM_WAIT_TIMEOUT);
+        if (workers[i].pool == NULL)
         {
-            p->next = temp->next;
+            printf("Failed to create the connection pool !!\n");
+            exit(1);
+        }
+        workers[i].dns = resolver_create(workers[i].loop, &nameserver);
+        if (workers[i].dns == NULL)
+        {
+            printf("Failed to create the resolver !!\n");
+            exit(1);
+        }
+        buffer_pool_init(&workers[i].buffers, MAX_BYTES, SPARE_BUFFERS);
+        workers[i].tick.fd = create_tick();
+        if (workers[i].tick.fd < 0)
+        {
+            exit(1);
         }
-        cache_size = cache_size - (temp->len) - sizeof(cache_element) - strlen(temp->url) - 1;
-        free(temp->data);
-        free(temp->url);
-        free(temp);
     }
-    temp_lock_val = pthread_mutex_unlock(&lock);
-    printf("Remove mutex lock\n");
-}
+    printf("Binding on port %d\n", port_number);
 
-int add_cache_element(char *data, int size, char *url)
-{
-    int temp_lock_val = pthread_mutex_lock(&lock);
-    printf("Add Cache Lock acquired %d\n", temp_lock_val);
+    sigset_t stop; // taken by the snapshot thread only, the workers must not be interrupted by them
+    sigemptyset(&stop);
+    sigaddset(&stop, SIGINT);
+    sigaddset(&stop, SIGTERM);
+    pthread_t snapshot_tid;
+    if (snapshot_path != NULL)
+    {
+        pthread_sigmask(SIG_BLOCK, &stop, NULL);
+        if (pthread_create(&snapshot_tid, NULL, snapshot_fn, &stop) != 0)
+        {
+            perror("Failed to start the snapshot thread");
+            exit(1);
+        }
+    }
 
-    int element_size = size + 1 + strlen(url) + sizeof(cache_element);
-    if (element_size < MAX_ELEMENT_SIZE)
+    for (int i = 0; i < nworkers; i++)
     {
-        temp_lock_val = pthread_mutex_unlock(&lock);
-        printf("Add cache lock is unlocked\n");
-        return 0;
+        if (pthread_create(&workers[i].tid, NULL, worker_fn, &workers[i]) != 0)
+        {
+            perror("Failed to start a worker");
+            exit(1);
+        }
     }
-    else
+
+    for (int i = 0; i < nworkers; i++)
     {
-        while (cache_size + element_size > MAX_SIZE)
+        pthread_join(workers[i].tid, NULL);
+        upstream_pool_destroy(workers[i].pool);
+        resolver_destroy(workers[i].dns);
+        close(workers[i].tick.fd);
+        while (workers[i].spare != NULL)
         {
-            remove_cache_element();
+            client_conn *conn = workers[i].spare;
+            workers[i].spare = conn->idle_next;
+            free(conn);
         }
-        cache_element *element = (cache_element *)malloc(sizeof(cache_element));
-        element->data = (char *)malloc(size + 1);
-        strcpy(element->data, data);
-        element->url = (char *)malloc(strlen(url) + sizeof(char) + 1);
-        strcpy(element->url, url);
-        element->lru_time_track = time(NULL);
-        element->next = head;
-        element->len = size;
-        head = element;
-        cache_size += element_size;
-        temp_lock_val = pthread_mutex_unlock(&lock);
-        printf("Add Cache lock is unlocked\n");
-        return 1;
+        buffer_pool_destroy(&workers[i].buffers);
+        event_loop_destroy(workers[i].loop);
+        close(workers[i].proxy_socket_id); // close the proxy socket
     }
+    free(workers);
     return 0;
 }
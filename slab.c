@@ -0,0 +1,219 @@
+/*
+  slab.c -- size-class allocator of the memory of the cache.
+*/
+
+#include "slab.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#define SLAB_MIN_ITEM 64  // smallest class, items are aligned to it
+#define MAX_CLASSES 32
+
+typedef struct slab_page slab_page;
+typedef struct slab_class slab_class;
+
+// descriptor of a page, kept outside the arena so items fill their pages exactly
+struct slab_page
+{
+    int cls;          // class of the items, -1 when the page is in the pool
+    unsigned nfree;   // items of the page that are free, including the ones never handed out
+    size_t bump;      // offset of the first item never handed out
+    void *free;       // items handed out and given back, linked through their first word
+    slab_page *prev;  // pages of the same class with free items, or pages of the pool
+    slab_page *next;
+};
+
+struct slab_class
+{
+    pthread_mutex_t lock; // protects the pages of the class
+    size_t size;          // size of the items
+    unsigned per_page;    // items that fit into a page
+    slab_page *partial;   // pages with at least one free item
+} __attribute__((aligned(64)));
+
+static char *arena;
+static size_t npages;
+static slab_page *pages;      // descriptors, one per page of the arena
+static slab_class classes[MAX_CLASSES];
+static int nclasses;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER; // protects pool and fresh
+static slab_page *pool;       // pages given back by their class
+static size_t fresh;          // pages below this index have been used at least once
+static size_t used_pages;
+
+int slab_init(size_t budget)
+{
+    npages = budget / SLAB_PAGE_SIZE;
+    if (npages == 0)
+        return -1;
+    // only the pages that are touched take memory, the rest is address space
+    void *mem = mmap(NULL, npages * SLAB_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem == MAP_FAILED)
+    {
+        perror("Error in reserving the cache memory");
+        return -1;
+    }
+    arena = (char *)mem;
+    pages = (slab_page *)calloc(npages, sizeof(slab_page));
+    if (pages == NULL)
+        return -1;
+
+    // powers of two and the points half way between them: 64, 96, 128, 192, ... 65536
+    for (size_t size = SLAB_MIN_ITEM; size <= SLAB_MAX_ITEM && nclasses < MAX_CLASSES; nclasses++)
+    {
+        slab_class *cls = &classes[nclasses];
+        pthread_mutex_init(&cls->lock, NULL);
+        cls->size = size;
+        cls->per_page = SLAB_PAGE_SIZE / size;
+        cls->partial = NULL;
+        size_t power = (size_t)1 << (63 - __builtin_clzll(size));
+        size = size == power ? power + power / 2 : power * 2;
+    }
+    return 0;
+}
+
+// smallest class holding size bytes, -1 if there is none
+static int class_for(size_t size)
+{
+    int lo = 0, hi = nclasses - 1;
+    if (size > classes[hi].size)
+        return -1;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (classes[mid].size >= size)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return lo;
+}
+
+// takes a page from the pool, or one never used before, NULL once the arena is exhausted
+static slab_page *take_page()
+{
+    slab_page *page = NULL;
+    pthread_mutex_lock(&pool_lock);
+    if (pool != NULL)
+    {
+        page = pool;
+        pool = page->next;
+    }
+    else if (fresh < npages)
+    {
+        page = &pages[fresh++];
+    }
+    if (page != NULL)
+        used_pages++;
+    pthread_mutex_unlock(&pool_lock);
+    return page;
+}
+
+// returns an empty page to the pool and its memory to the system
+static void give_page(slab_page *page)
+{
+    madvise(arena + (page - pages) * (size_t)SLAB_PAGE_SIZE, SLAB_PAGE_SIZE, MADV_DONTNEED);
+    page->cls = -1;
+    pthread_mutex_lock(&pool_lock);
+    page->next = pool;
+    pool = page;
+    used_pages--;
+    pthread_mutex_unlock(&pool_lock);
+}
+
+/*
+  Partial list helpers, the caller holds the class lock
+*/
+
+static void partial_push(slab_class *cls, slab_page *page)
+{
+    page->prev = NULL;
+    page->next = cls->partial;
+    if (cls->partial != NULL)
+        cls->partial->prev = page;
+    cls->partial = page;
+}
+
+static void partial_unlink(slab_class *cls, slab_page *page)
+{
+    if (page->prev != NULL)
+        page->prev->next = page->next;
+    else
+        cls->partial = page->next;
+    if (page->next != NULL)
+        page->next->prev = page->prev;
+}
+
+void *slab_alloc(size_t size, size_t *item_size)
+{
+    int c = class_for(size);
+    if (c < 0)
+        return NULL;
+    slab_class *cls = &classes[c];
+
+    pthread_mutex_lock(&cls->lock);
+    slab_page *page = cls->partial;
+    if (page == NULL)
+    {
+        page = take_page();
+        if (page == NULL)
+        {
+            pthread_mutex_unlock(&cls->lock);
+            return NULL;
+        }
+        page->cls = c;
+        page->nfree = cls->per_page;
+        page->bump = 0;
+        page->free = NULL;
+        partial_push(cls, page);
+    }
+
+    void *item;
+    if (page->free != NULL) // reuse a freed item before touching new memory
+    {
+        item = page->free;
+        page->free = *(void **)item;
+    }
+    else
+    {
+        item = arena + (page - pages) * (size_t)SLAB_PAGE_SIZE + page->bump;
+        page->bump += cls->size;
+    }
+    if (--page->nfree == 0)
+        partial_unlink(cls, page);
+    pthread_mutex_unlock(&cls->lock);
+
+    *item_size = cls->size;
+    return item;
+}
+
+void slab_free(void *item)
+{
+    slab_page *page = &pages[((char *)item - arena) / SLAB_PAGE_SIZE];
+    slab_class *cls = &classes[page->cls];
+
+    pthread_mutex_lock(&cls->lock);
+    *(void **)item = page->free;
+    page->free = item;
+    if (page->nfree++ == 0) // the page was full
+        partial_push(cls, page);
+    int empty = page->nfree == cls->per_page && (cls->partial != page || page->next != NULL); // the only partial page of a class is kept, it would be taken again right away
+    if (empty)
+        partial_unlink(cls, page);
+    pthread_mutex_unlock(&cls->lock);
+
+    if (empty)
+        give_page(page);
+}
+
+size_t slab_used()
+{
+    pthread_mutex_lock(&pool_lock);
+    size_t used = used_pages * SLAB_PAGE_SIZE;
+    pthread_mutex_unlock(&pool_lock);
+    return used;
+}
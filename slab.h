@@ -0,0 +1,39 @@
+/*
+ * slab.h -- size-class allocator of the memory of the cache.
+ *
+ * The memory of the cache is one arena reserved up front, as big as its
+ * budget, so the budget is a hard limit on the bytes the cache really uses.
+ * The arena is cut into pages of SLAB_PAGE_SIZE bytes. A page serves items of
+ * a single size class and goes back to a shared pool, its memory returned to
+ * the system, as soon as all its items are free, so a class that needs more
+ * room takes the pages another one gave up instead of the heap fragmenting
+ * over time.
+ *
+ * Classes are spaced by a factor of about 1.41, an item wastes at most a third
+ * of its size. Every class has its own lock.
+ */
+
+#include <stddef.h>
+
+#ifndef SLAB
+#define SLAB
+
+#define SLAB_PAGE_SIZE (1 << 20)      // pages are aligned to their size
+#define SLAB_MAX_ITEM (64 * 1024)     // biggest item that can be allocated
+
+/* Reserve an arena of budget bytes (rounded down to whole pages), returns -1
+ * on failure. Must be called once before any other slab function. */
+int slab_init(size_t budget);
+
+/* Allocate an item of at least size bytes, *item_size is set to the real size
+ * of the item. Returns NULL if size is too big or no page is left: the caller
+ * frees some items and tries again. */
+void *slab_alloc(size_t size, size_t *item_size);
+
+/* Give an item back to its class */
+void slab_free(void *item);
+
+/* Bytes of the pages handed to classes, i.e. the memory the cache really holds */
+size_t slab_used();
+
+#endif
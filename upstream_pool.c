@@ -0,0 +1,331 @@
+/*
+  upstream_pool.c -- pool of connections to remote servers.
+*/
+
+#include "upstream_pool.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#define HOST_BUCKETS 256 // must be a power of two
+
+struct upstream_idle
+{
+    event_watcher watcher;  // reports the remote server closing the connection
+    upstream_pool *pool;
+    upstream_host *host;
+    time_t since;           // time the connection became idle
+    upstream_idle *prev;    // idle connections of the same host, most recently used first
+    upstream_idle *next;
+    upstream_idle *older;   // idle connections of the whole pool, in the order they became idle
+    upstream_idle *newer;
+};
+
+struct upstream_pool
+{
+    event_loop *loop;
+    int max_per_host;
+    int idle_timeout;
+    int wait_timeout;
+    upstream_idle *oldest;              // next idle connection to time out
+    upstream_idle *newest;
+    upstream_host *hosts[HOST_BUCKETS]; // hash table of the hosts
+};
+
+static time_t monotonic_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+// FNV-1a hash of the host name, ignoring case, and of the port
+static size_t hash_host(const char *name, int port)
+{
+    size_t h = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)name; *p != '\0'; p++)
+    {
+        h ^= tolower(*p);
+        h *= 16777619u;
+    }
+    h ^= (size_t)port;
+    h *= 16777619u;
+    return h;
+}
+
+// finds the entry of name:port, creating it if needed, returns NULL if it could not be allocated
+static upstream_host *find_host(upstream_pool *pool, const char *name, int port)
+{
+    upstream_host **bucket = &pool->hosts[hash_host(name, port) & (HOST_BUCKETS - 1)];
+    for (upstream_host *host = *bucket; host != NULL; host = host->next)
+    {
+        if (host->port == port && strcasecmp(host->name, name) == 0)
+            return host;
+    }
+
+    upstream_host *host = (upstream_host *)calloc(1, sizeof(upstream_host));
+    if (host == NULL)
+        return NULL;
+    host->name = strdup(name);
+    if (host->name == NULL)
+    {
+        free(host);
+        return NULL;
+    }
+    host->port = port;
+    host->next = *bucket;
+    *bucket = host;
+    return host;
+}
+
+// removes an idle connection from the pool and returns its descriptor
+static int take_idle(upstream_pool *pool, upstream_idle *idle)
+{
+    upstream_host *host = idle->host;
+    if (idle->prev != NULL)
+        idle->prev->next = idle->next;
+    else
+        host->idle = idle->next;
+    if (idle->next != NULL)
+        idle->next->prev = idle->prev;
+    if (idle->older != NULL)
+        idle->older->newer = idle->newer;
+    else
+        pool->oldest = idle->newer;
+    if (idle->newer != NULL)
+        idle->newer->older = idle->older;
+    else
+        pool->newest = idle->older;
+    host->nidle--;
+
+    int fd = idle->watcher.fd;
+    event_loop_remove(pool->loop, &idle->watcher);
+    idle->watcher.fd = -1;
+    event_loop_defer(pool->loop, free, idle); // an event of the current batch may still point at the watcher
+    return fd;
+}
+
+// called by the event loop when the remote server closed an idle connection or sent something unexpected
+static void on_idle_event(event_loop *loop, event_watcher *w, uint32_t events)
+{
+    upstream_idle *idle = (upstream_idle *)w->data;
+    close(take_idle(idle->pool, idle));
+}
+
+// adds a connection to the idle ones of host, returns -1 on failure
+static int park(upstream_pool *pool, upstream_host *host, int fd)
+{
+    upstream_idle *idle = (upstream_idle *)malloc(sizeof(upstream_idle));
+    if (idle == NULL)
+        return -1;
+    idle->watcher.fd = fd;
+    idle->watcher.cb = on_idle_event;
+    idle->watcher.data = idle;
+    if (event_loop_add(pool->loop, &idle->watcher, EPOLLIN | EPOLLRDHUP) < 0)
+    {
+        free(idle);
+        return -1;
+    }
+    idle->pool = pool;
+    idle->host = host;
+    idle->since = monotonic_now();
+
+    idle->prev = NULL;
+    idle->next = host->idle;
+    if (host->idle != NULL)
+        host->idle->prev = idle;
+    host->idle = idle;
+
+    idle->newer = NULL;
+    idle->older = pool->newest;
+    if (pool->newest != NULL)
+        pool->newest->newer = idle;
+    else
+        pool->oldest = idle;
+    pool->newest = idle;
+
+    host->nidle++;
+    return 0;
+}
+
+// checks that the remote server neither closed an idle connection nor sent anything on it
+static int still_open(int fd)
+{
+    char c;
+    return recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+// checks whether a lease of host can have a connection now: an idle one, or a new one while the open ones are below the limit
+static int has_room(upstream_pool *pool, upstream_host *host)
+{
+    return host->idle != NULL || host->active + host->nidle < pool->max_per_host;
+}
+
+// gives lease a connection of host, which has_room(): the most recently used idle one that is still open, or none so the holder opens one
+static void admit(upstream_pool *pool, upstream_host *host, upstream_lease *lease)
+{
+    lease->fd = -1;
+    while (host->idle != NULL && lease->fd < 0) // the most recently used connection is the least likely to have been closed
+    {
+        int fd = take_idle(pool, host->idle);
+        if (still_open(fd))
+            lease->fd = fd;
+        else
+            close(fd);
+    }
+    host->active++;
+}
+
+// takes the oldest lease waiting for host out of the line
+static upstream_lease *dequeue(upstream_host *host)
+{
+    upstream_lease *lease = host->waiting_head;
+    host->waiting_head = lease->next;
+    if (host->waiting_head != NULL)
+        host->waiting_head->prev = NULL;
+    else
+        host->waiting_tail = NULL;
+    lease->waiting = 0;
+    return lease;
+}
+
+// hands out the connections of host that became available to the leases waiting for them
+static void wake_waiters(upstream_pool *pool, upstream_host *host)
+{
+    while (host->waiting_head != NULL && has_room(pool, host))
+    {
+        upstream_lease *lease = dequeue(host);
+        admit(pool, host, lease);
+        lease->ready(lease, UPSTREAM_READY); // may release other leases of host, the loop condition is checked again afterwards
+    }
+}
+
+int upstream_acquire(upstream_pool *pool, upstream_lease *lease, const char *name, int port)
+{
+    upstream_host *host = find_host(pool, name, port);
+    if (host == NULL)
+        return -1;
+    lease->host = host;
+    lease->fd = -1;
+
+    if (host->waiting_head == NULL && has_room(pool, host)) // the leases in line come first
+    {
+        admit(pool, host, lease);
+        return UPSTREAM_READY;
+    }
+
+    lease->since = monotonic_now();
+    lease->waiting = 1;
+    lease->next = NULL;
+    lease->prev = host->waiting_tail;
+    if (host->waiting_tail != NULL)
+        host->waiting_tail->next = lease;
+    else
+        host->waiting_head = lease;
+    host->waiting_tail = lease;
+    return UPSTREAM_WAIT;
+}
+
+void upstream_release(upstream_pool *pool, upstream_lease *lease, int fd, int reusable)
+{
+    upstream_host *host = lease->host;
+    if (host == NULL)
+    {
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+    lease->host = NULL;
+
+    if (lease->waiting) // leave the line
+    {
+        if (lease->prev != NULL)
+            lease->prev->next = lease->next;
+        else
+            host->waiting_head = lease->next;
+        if (lease->next != NULL)
+            lease->next->prev = lease->prev;
+        else
+            host->waiting_tail = lease->prev;
+        lease->waiting = 0;
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+
+    host->active--;
+    if (fd >= 0 && !(reusable && pool->idle_timeout > 0 && park(pool, host, fd) == 0))
+    {
+        close(fd);
+    }
+    wake_waiters(pool, host);
+}
+
+void upstream_pool_sweep(upstream_pool *pool)
+{
+    time_t now = monotonic_now();
+    while (pool->oldest != NULL && now - pool->oldest->since >= pool->idle_timeout)
+    {
+        close(take_idle(pool, pool->oldest));
+    }
+
+    for (int i = 0; i < HOST_BUCKETS; i++) // hosts are only freed below, failing a lease cannot free the one it waited for
+    {
+        for (upstream_host *host = pool->hosts[i]; host != NULL; host = host->next)
+        {
+            while (host->waiting_head != NULL && now - host->waiting_head->since >= pool->wait_timeout) // the oldest come first
+            {
+                upstream_lease *lease = dequeue(host);
+                lease->host = NULL; // holds nothing, releasing it does nothing
+                lease->ready(lease, -1);
+            }
+        }
+    }
+
+    for (int i = 0; i < HOST_BUCKETS; i++)
+    {
+        upstream_host **link = &pool->hosts[i];
+        while (*link != NULL)
+        {
+            upstream_host *host = *link;
+            if (host->active == 0 && host->nidle == 0 && host->waiting_head == NULL)
+            {
+                *link = host->next;
+                free(host->name);
+                free(host);
+            }
+            else
+            {
+                link = &host->next;
+            }
+        }
+    }
+}
+
+upstream_pool *upstream_pool_create(event_loop *loop, int max_per_host, int idle_timeout, int wait_timeout)
+{
+    upstream_pool *pool = (upstream_pool *)calloc(1, sizeof(upstream_pool));
+    if (pool == NULL)
+        return NULL;
+    pool->loop = loop;
+    pool->max_per_host = max_per_host > 0 ? max_per_host : 1;
+    pool->idle_timeout = idle_timeout > 0 ? idle_timeout : 0;
+    pool->wait_timeout = wait_timeout > 0 ? wait_timeout : 1;
+    return pool;
+}
+
+void upstream_pool_destroy(upstream_pool *pool)
+{
+    while (pool->oldest != NULL)
+    {
+        close(take_idle(pool, pool->oldest));
+    }
+    upstream_pool_sweep(pool);
+    free(pool);
+}
@@ -0,0 +1,98 @@
+/*
+ * upstream_pool.h -- pool of connections to remote servers.
+ *
+ * Connections to remote servers are kept open between requests, so that a
+ * miss on a host that was contacted recently skips the name lookup, the TCP
+ * handshake and slow start. Every worker owns a pool, which is only used by
+ * the thread running the worker's event loop and needs no locking.
+ *
+ * Connections are grouped by host and port. A connection is either active
+ * (connecting, or carrying a request and its response) or idle in the pool.
+ * Idle connections are closed as soon as the remote server closes them, and
+ * by upstream_pool_sweep() once they have been idle for idle_timeout seconds.
+ * At most max_per_host connections to the same host are open at a time,
+ * idle ones included, further requests wait in line for one of them. A
+ * request that waited wait_timeout seconds is failed.
+ */
+
+#include <time.h>
+#include "event_loop.h"
+
+#ifndef UPSTREAM_POOL
+#define UPSTREAM_POOL
+
+typedef struct upstream_pool upstream_pool;
+typedef struct upstream_host upstream_host;
+typedef struct upstream_idle upstream_idle;
+typedef struct upstream_lease upstream_lease;
+
+typedef void (*upstream_ready_fn)(upstream_lease *lease, int status);
+
+struct upstream_host
+{
+   char *name;                   // host name of the requests
+   int port;                     // port of the remote server
+   int active;                   // connections handed out and not released yet
+   int nidle;                    // connections idle in the pool
+   upstream_idle *idle;          // idle connections, most recently used first
+   upstream_lease *waiting_head; // leases waiting for a connection, oldest first
+   upstream_lease *waiting_tail;
+   upstream_host *next;          // next host in the same hash bucket
+};
+
+/*
+   A lease holds one of the connections of a host while a request uses it.
+   It is embedded in the object making the request (a client connection for
+   example).
+ */
+struct upstream_lease
+{
+   upstream_host *host;     // host of the connection, NULL when the lease holds nothing
+   int fd;                  // connection handed out by the pool, -1 if the holder has to open a new one
+   int waiting;             // the lease is in line for a connection
+   upstream_ready_fn ready; // called once a waiting lease got its connection, or gave up
+   void *data;              // owner of the lease
+   time_t since;            // time the lease got in line
+   upstream_lease *prev;    // leases waiting for the same host
+   upstream_lease *next;
+};
+
+/* Create the pool of the worker running loop, returns NULL on failure. An
+ * idle_timeout of 0 disables the pool: connections are never reused. */
+upstream_pool *upstream_pool_create(event_loop *loop, int max_per_host, int idle_timeout, int wait_timeout);
+
+/* Close every idle connection and free the pool, no lease may be held */
+void upstream_pool_destroy(upstream_pool *pool);
+
+/* Close the connections that have been idle for too long, fail the leases that
+ * waited too long and forget the hosts nobody uses anymore, the owner calls it
+ * about once a second */
+void upstream_pool_sweep(upstream_pool *pool);
+
+/*
+   Get a connection to name:port for lease, returns:
+
+   UPSTREAM_READY: lease->fd is an idle connection taken from the pool, or -1
+                   if the holder has to connect itself. Either way the
+                   connection counts against the limit of the host until it is
+                   released.
+   UPSTREAM_WAIT:  the host is at its limit, lease->ready() is called as soon
+                   as the lease gets its connection, with the status
+                   UPSTREAM_READY as if it had been returned then. If that
+                   takes longer than wait_timeout seconds, it is called with
+                   -1 instead and the lease holds nothing anymore.
+   -1:             the lease could not be set up.
+ */
+#define UPSTREAM_READY 0
+#define UPSTREAM_WAIT 1
+int upstream_acquire(upstream_pool *pool, upstream_lease *lease, const char *name, int port);
+
+/*
+   End the use of lease. fd is the connection the holder used (-1 if it has
+   none), the holder must stop watching it first. It is kept in the pool if
+   reusable is set, and closed otherwise. A lease still waiting for a
+   connection leaves the line.
+ */
+void upstream_release(upstream_pool *pool, upstream_lease *lease, int fd, int reusable);
+
+#endif